@@ -0,0 +1,53 @@
+/*
+ *     Filename: bitvector.h
+ *  Description: Header file for Bit Vector and Aggregated Bit Vector
+ *
+ *       Author: Xiang Wang (xiang.wang.s@gmail.com)
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#ifndef __BITVECTOR_H__
+#define __BITVECTOR_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "common/rule_trace.h"
+
+#define BV_BLOCK_WORDS 4 /* 64-bit words of a block, ANDed at once by AVX2 */
+
+
+/*
+ * The values of a dimension are cut into intervals at the rule endpoints.
+ * The bitmap of an interval has bit i set if rule i covers it, and with an
+ * aggregate, its summary has bit b set if block b of the bitmap is nonzero.
+ */
+struct bv_dim {
+    uint32_t *bounds; /* the first value of each interval, from 0 */
+    uint64_t *bms; /* word_num words of each interval */
+    uint64_t *aggs; /* agg_num words of each interval, or NULL */
+    int interval_num;
+};
+
+/* Rules are numbered in priority order: the first bit set is the best */
+struct bv_result {
+    struct bv_dim dims[DIM_MAX];
+    int *pris; /* of the rule of each bit */
+    int rule_num;
+    int word_num; /* a multiple of BV_BLOCK_WORDS */
+    int agg_num; /* 0 without the aggregate */
+    int def_rule;
+    /* ANDs a word at a time, or a block at a time with AVX2 */
+    int (*lookup)(const struct packet *p_pkt, const struct bv_result *p_bv);
+};
+
+
+int bv_build(void *built_result, const struct partition *p_pa,
+        int is_aggregated);
+int bv_lookup(const struct packet *p_pkt, const void *built_result);
+size_t bv_memory(const void *built_result);
+void bv_destroy(void *built_result);
+
+#endif /* __BITVECTOR_H__ */
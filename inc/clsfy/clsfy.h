@@ -0,0 +1,70 @@
+/*
+ *     Filename: clsfy.h
+ *  Description: Header file for the registry of classification algorithms
+ *
+ *       Author: Xiang Wang (xiang.wang.s@gmail.com)
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#ifndef __CLSFY_H__
+#define __CLSFY_H__
+
+#include <stddef.h>
+#include "common/flow_cache.h"
+#include "common/rule_trace.h"
+
+
+#define CLSFY_OPT_BINTH 0x1 /* leaves of at most binth rules */
+#define CLSFY_OPT_DAG 0x2 /* shares identical subtrees */
+#define CLSFY_OPT_PACKED 0x4 /* has the packed layout */
+#define CLSFY_OPT_THREAD 0x8 /* builds with thread_num threads */
+
+
+/* Build options of all algorithms, each one taking those of its opts */
+struct clsfy_param {
+    int thread_num;
+    int binth; /* most rules of a leaf, 0 for none */
+    int is_dag; /* share identical subtrees */
+    int is_packed; /* cache-line blocks of several levels */
+    int is_simd; /* prepare for lookup_simd */
+};
+
+/* The rule a packet matches in the built result */
+typedef int (*clsfy_lookup_t)(const struct packet *p_pkt,
+        const void *built_result);
+
+/*
+ * The operations of an algorithm on its built result, with the signatures
+ * of hs_*. The optional ones are NULL where not supported. A plain or SIMD
+ * search is clsfy_search over lookup or lookup_simd.
+ */
+struct clsfy_algo {
+    const char *name;
+    const char *desc;
+    unsigned int opts; /* CLSFY_OPT_* the build takes */
+    int (*build)(void *built_result, const struct partition *p_pa,
+            const struct clsfy_param *p_param);
+    clsfy_lookup_t lookup;
+    clsfy_lookup_t lookup_simd;
+    int (*search_batch)(const struct trace *p_t, const void *built_result);
+    int (*search_cache)(const struct trace *p_t, const void *built_result,
+            struct flow_cache *p_fc, int is_batch);
+    int (*simd_lanes)(const void *built_result);
+    int (*save)(const void *built_result, const char *s_file);
+    int (*load)(void *built_result, const char *s_file);
+    int (*insert)(void *built_result, const struct rule *p_rule);
+    int (*delete)(void *built_result, const struct rule *p_rule);
+    size_t (*memory)(const void *built_result);
+    void (*destroy)(void *built_result);
+};
+
+
+const struct clsfy_algo *clsfy_find(const char *s_name);
+const struct clsfy_algo *clsfy_get(int i);
+int clsfy_search(clsfy_lookup_t lookup, const struct trace *p_t,
+        const void *built_result);
+
+#endif /* __CLSFY_H__ */
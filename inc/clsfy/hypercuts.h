@@ -0,0 +1,75 @@
+/*
+ *     Filename: hypercuts.h
+ *  Description: Header file for HyperCuts
+ *
+ *       Author: Xiang Wang (xiang.wang.s@gmail.com)
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#ifndef __HYPERCUTS_H__
+#define __HYPERCUTS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "common/rule_trace.h"
+
+#define HC_BINTH_DEFAULT 8 /* most rules of a leaf if not given */
+#define HC_SPFAC 4 /* rules in all children over rules in the node */
+#define HC_CUT_BITS_MAX 8 /* at most 256 children of a node */
+#define HC_DEPTH_MAX 64
+#define HC_CHILD_EMPTY UINT32_MAX /* a child holding no rule */
+#define HC_LEAF UINT32_MAX /* child of a leaf */
+
+
+/*
+ * A node covers the box [lo, hi] compacted to its rules, so a packet out of
+ * it matches none of them. The cuts are equal-sized and a power of 2 along
+ * each dimension: a packet goes to the child at child plus the indexes
+ * (dims[d] - lo[d]) >> shift[d] of all dimensions, each taking bits[d]. The
+ * rules at rule are those pushed up from all children, or those of a leaf.
+ */
+struct hc_node {
+    uint32_t lo[DIM_MAX];
+    uint32_t hi[DIM_MAX];
+    uint32_t child; /* first child in p_child, or HC_LEAF */
+    uint32_t rule; /* first rule in p_rule */
+    uint32_t rule_num;
+    uint8_t shift[DIM_MAX]; /* 32 along a dimension not cut */
+    uint8_t bits[DIM_MAX];
+}; /* 64 bytes */
+
+/* A rule of a node, laid out for a linear scan */
+struct hc_rule {
+    uint32_t lo[DIM_MAX];
+    uint32_t hi[DIM_MAX];
+    int pri;
+};
+
+struct hc_tree {
+    struct hc_node *p_node; /* the root is the first */
+    uint32_t *p_child; /* node ids, or HC_CHILD_EMPTY */
+    struct hc_rule *p_rule;
+    int node_num;
+    int child_num;
+    int rule_num;
+    int depth_max;
+    int pri_min; /* no packet matches a better rule in the tree */
+};
+
+/* Trees are in ascending order of pri_min, as those of HyperSplit */
+struct hc_result {
+    struct hc_tree *trees;
+    int tree_num;
+    int def_rule;
+};
+
+
+int hc_build(void *built_result, const struct partition *p_pa, int binth);
+int hc_lookup(const struct packet *p_pkt, const void *built_result);
+size_t hc_memory(const void *built_result);
+void hc_destroy(void *built_result);
+
+#endif /* __HYPERCUTS_H__ */
@@ -17,11 +17,36 @@
 
 #include <stdint.h>
 #include "common/mpool.h"
+#include "common/flow_cache.h"
 #include "common/rule_trace.h"
 
 #define NODE_NUM_BITS 29
 #define NODE_NUM_MAX (1 << NODE_NUM_BITS)
 
+#define HS_BATCH_SIZE 16 /* packets walking the trees in lockstep */
+#define HS_BATCH_CACHE_SIZE (1 << 20) /* used if L2 size is unknown */
+
+#define HS_SIMD_LANES_MAX 16 /* trees walked at once with AVX-512 */
+
+#define HS_BUCKET_LANES 8 /* fields of a bucket rule compared at once */
+#define HS_BUCKET_PRI DIM_MAX /* lane of lo holding the priority */
+
+#define HS_PACK_LEVEL 3 /* binary levels packed into one cache line */
+#define HS_PACK_INODE ((1 << HS_PACK_LEVEL) - 1)
+#define HS_PACK_CHILD (1 << HS_PACK_LEVEL)
+#define HS_PACK_DIM_BITS 3
+#define HS_PACK_DIM_MASK ((1 << HS_PACK_DIM_BITS) - 1)
+
+/* rule ids of a work item followed by their endpoints sorted per dimension,
+ * which are kept only by work items of more than HS_RULE_ENDS_MIN rules */
+#define HS_RULE_BLK_SIZE(n) ((n) * (1 + (DIM_MAX << 1)))
+#define HS_RULE_ENDS_MIN 16
+#define HS_ITEM_CHUNK_SIZE (1 << 20) /* bytes of work item pool chunk */
+
+#define HS_FILE_MAGIC 0x43504853 /* "SHPC" in little endian */
+#define HS_FILE_VERSION 3
+#define HS_FILE_ALIGN 64 /* node arrays start on cache lines */
+
 
 struct hs_node {
     uint64_t thresh;
@@ -31,25 +56,136 @@ struct hs_node {
     uint32_t rchild : NODE_NUM_BITS;
 };
 
+/*
+ * The binary nodes of HS_PACK_LEVEL levels are stored in heap order, a missing
+ * node never goes right. A child less than (def_rule + 1) is a rule, otherwise
+ * it is the offset of the child block to the current one plus (def_rule + 1).
+ */
+struct hs_pack_node {
+    uint32_t thresh[HS_PACK_INODE];
+    uint32_t dims; /* HS_PACK_DIM_BITS per binary node */
+    uint32_t child[HS_PACK_CHILD];
+} __attribute__((aligned(64)));
+
+/*
+ * A rule of a leaf bucket in one cache line, so that its fields are checked
+ * with one vector compare per bound. Lanes past DIM_MAX are never checked,
+ * and lo[HS_BUCKET_PRI] is the priority.
+ */
+struct hs_bucket_rule {
+    uint32_t lo[HS_BUCKET_LANES];
+    uint32_t hi[HS_BUCKET_LANES];
+} __attribute__((aligned(64)));
+
+/* The first rule from p_br on that matches dims, or pri if it is not better */
+typedef int (*hs_bucket_match_t)(const struct hs_bucket_rule *p_br,
+        const uint32_t *dims, int pri);
+
+/*
+ * Children from (def_rule + 1) up to the node offset are leaf buckets: the
+ * bucket rules from p_bucket[child - def_rule - 1] on, in priority order, of
+ * which the first matched is the result. Each ends with the default rule.
+ */
 struct hs_tree {
     struct hs_node *p_root;
+    struct hs_pack_node *p_pack; /* replaces p_root after hs_pack */
+    struct hs_bucket_rule *p_bucket;
+    int bucket_num;
+    int bucket_rule_num;
+    int pack_num;
     int inode_num;
     int enode_num;
     int depth_max;
     double depth_avg;
+    int pri_min; /* no packet matches a better rule in the tree */
 };
 
+/* Trees are in ascending order of pri_min, so a search stops at the first
+ * tree that cannot beat the current match */
 struct hs_result {
     struct hs_tree *trees;
     int tree_num;
     int def_rule;
+    void *p_map; /* node arrays are in the mapped file if loaded */
+    size_t map_size;
+    void *p_block; /* or in one block if merged */
+    struct hs_simd *p_simd; /* for hs_lookup_simd, built by hs_merge */
+    hs_bucket_match_t bucket_match; /* scalar or AVX2, as the CPU allows */
+};
+
+/*
+ * The saved file: a header, tree_num tree entries, then the node arrays,
+ * each aligned to HS_FILE_ALIGN. Offsets are from the file start, and 0
+ * for a missing array. The node sizes guard against incompatible builds.
+ */
+struct hs_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t node_size;
+    uint32_t pack_size;
+    uint32_t tree_num;
+    int32_t def_rule;
+    uint64_t size;
+};
+
+struct hs_file_tree {
+    uint64_t root_off;
+    uint64_t pack_off;
+    uint64_t bucket_off;
+    int32_t bucket_num;
+    int32_t bucket_rule_num;
+    int32_t pack_num;
+    int32_t inode_num;
+    int32_t enode_num;
+    int32_t depth_max;
+    int32_t pri_min;
+    double depth_avg;
+};
+
+/* Nodes under construction, linked by pointers across per-thread pools */
+struct hs_build_node {
+    union {
+        struct hs_build_node *p_node;
+        int pri;
+        int *rule_id; /* the rule number, then the rules of a bucket */
+    } child[2];
+    uint32_t thresh;
+    uint8_t dim;
+    uint8_t leaf[2]; /* child[i] is an HS_LEAF_* or a node */
+};
+
+/* how a dimension to split is chosen: the fewest rules per range of the
+ * original paper, or the fewest rules replicated, which suits rfg groups */
+enum {
+    HS_MEASURE_INV = -1,
+    HS_MEASURE_RFG = 0,
+    HS_MEASURE_ORIG = 1,
+    HS_MEASURE_MAX = 2
+};
+
+enum {
+    HS_LEAF_NONE = 0,
+    HS_LEAF_RULE = 1,
+    HS_LEAF_BUCKET = 2
 };
 
-MPOOL(hsn_pool, struct hs_node);
+CMPOOL(hsbn_pool, struct hs_build_node);
 
 
-int hs_build(void *built_result, const struct partition *p_pa);
-int hs_search(const struct trace *p_t, const void *built_result);
+int hs_build(void *built_result, const struct partition *p_pa, int thread_num,
+        int binth, int measure);
+int hs_pack(void *built_result);
+int hs_dag(void *built_result);
+int hs_merge(void *built_result);
+int hs_lookup(const struct packet *p_pkt, const void *built_result);
+int hs_search_batch(const struct trace *p_t, const void *built_result);
+int hs_lookup_simd(const struct packet *p_pkt, const void *built_result);
+int hs_simd_lanes(const void *built_result);
+size_t hs_memory(const void *built_result);
+int hs_search_cache(const struct trace *p_t, const void *built_result,
+        struct flow_cache *p_fc, int is_batch);
+int hs_save(const void *built_result, const char *s_file);
+int hs_load(void *built_result, const char *s_file);
 void hs_destroy(void *built_result);
 
 #endif /* __HYPERSPLIT_H__ */
@@ -0,0 +1,61 @@
+/*
+ *     Filename: rfc.h
+ *  Description: Header file for Recursive Flow Classification
+ *
+ *       Author: Xiang Wang (xiang.wang.s@gmail.com)
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#ifndef __RFC_H__
+#define __RFC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "common/rule_trace.h"
+
+#define RFC_CHUNK_NUM 7 /* 16-bit chunks of the 5-tuple, the protocol of 8 */
+#define RFC_TABLE_NUM 12 /* the chunk tables, then the phases combining them */
+#define RFC_BYTES_MAX (1ULL << 30) /* most bytes of a table, or its classes */
+
+
+/*
+ * A table maps a chunk value, or a combination of classes of earlier tables,
+ * to a class: the set of rules matching all packets of the entry. The last
+ * table maps to the best rule of its class instead.
+ */
+struct rfc_table {
+    uint32_t *ids;
+    uint32_t entry_num;
+    int class_num;
+};
+
+/*
+ * Phase 0 tables 0-6 are indexed by the high and low chunks of the source
+ * and destination addresses, the ports and the protocol. Phase 1 combines
+ * them into the classes of the source (7), the destination (8) and the
+ * ports and protocol (9), phase 2 the classes of both addresses (10), and
+ * phase 3 those with the classes of 9. Table t of inputs a, b and c is
+ * indexed by (class_a * class_num_b + class_b) * class_num_c + class_c.
+ */
+struct rfc_set {
+    struct rfc_table tables[RFC_TABLE_NUM];
+    int pri_min; /* no packet matches a better rule in the set */
+};
+
+/* Sets are in ascending order of pri_min, as the trees of HyperSplit */
+struct rfc_result {
+    struct rfc_set *sets;
+    int set_num;
+    int def_rule;
+};
+
+
+int rfc_build(void *built_result, const struct partition *p_pa);
+int rfc_lookup(const struct packet *p_pkt, const void *built_result);
+size_t rfc_memory(const void *built_result);
+void rfc_destroy(void *built_result);
+
+#endif /* __RFC_H__ */
@@ -0,0 +1,70 @@
+/*
+ *     Filename: tuplemerge.h
+ *  Description: Header file for Tuple Space Search and TupleMerge
+ *
+ *       Author: Xiang Wang (xiang.wang.s@gmail.com)
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#ifndef __TUPLEMERGE_H__
+#define __TUPLEMERGE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "common/rule_trace.h"
+
+#define TM_SLOT_NUM_MIN 16 /* slots of a new table */
+#define TM_COLLIDE_MAX 8 /* rules of a slot, bar a table of exact lengths */
+#define TM_IP_STEP 4 /* relaxed address lengths are multiples of this */
+
+
+/* A rule in a slot, laid out for a linear scan */
+struct tm_rule {
+    uint32_t lo[DIM_MAX];
+    uint32_t hi[DIM_MAX];
+    int pri;
+};
+
+/* The rules hashed to a slot, in priority order */
+struct tm_slot {
+    struct tm_rule *rules;
+    int rule_num;
+    int rule_cap;
+};
+
+/*
+ * A table of the rules whose fields are all within prefixes of lens: they
+ * are hashed by the fields masked to lens, as the packets they match are
+ */
+struct tm_table {
+    uint32_t masks[DIM_MAX];
+    int lens[DIM_MAX];
+    struct tm_slot *slots;
+    uint32_t slot_mask;
+    int rule_num;
+    int pri_min; /* the best rule of the table, updated on deletes */
+};
+
+/* Tables are in ascending order of pri_min, so a search stops at the first
+ * table that cannot beat the current match */
+struct tm_result {
+    struct tm_table *tables;
+    int table_num;
+    int table_cap;
+    int def_rule;
+    int is_relaxed; /* TupleMerge, or Tuple Space Search of prefixes */
+};
+
+
+int tm_build(void *built_result, const struct partition *p_pa,
+        int is_relaxed);
+int tm_insert(void *built_result, const struct rule *p_rule);
+int tm_delete(void *built_result, const struct rule *p_rule);
+int tm_lookup(const struct packet *p_pkt, const void *built_result);
+size_t tm_memory(const void *built_result);
+void tm_destroy(void *built_result);
+
+#endif /* __TUPLEMERGE_H__ */
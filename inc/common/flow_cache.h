@@ -0,0 +1,168 @@
+/*
+ *     Filename: flow_cache.h
+ *  Description: Header file for exact-match flow cache
+ *
+ *       Author: Xiang Wang (xiang.wang.s@gmail.com)
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#ifndef __FLOW_CACHE_H__
+#define __FLOW_CACHE_H__
+
+#include <stdint.h>
+#include <string.h>
+#include "common/rule_trace.h"
+
+#define FLOW_CACHE_WAYS 3 /* entries in a cache-line bucket */
+
+
+enum {
+    FLOW_EVICT_INV = -1,
+    FLOW_EVICT_CLOCK = 0,
+    FLOW_EVICT_LRU = 1,
+    FLOW_EVICT_MAX = 2
+};
+
+
+struct flow_entry {
+    uint32_t sip;
+    uint32_t dip;
+    uint16_t sport;
+    uint16_t dport;
+    int pri;
+    uint8_t proto;
+    uint8_t is_valid;
+    uint8_t is_ref; /* hit since the CLOCK hand passed */
+};
+
+/* LRU keeps the entries in recency order, CLOCK sweeps them with hand */
+struct flow_bucket {
+    struct flow_entry entries[FLOW_CACHE_WAYS];
+    uint32_t hand;
+} __attribute__((aligned(64)));
+
+/*
+ * A set-associative table of 5-tuples and their matched priorities, owned
+ * by one searching thread
+ */
+struct flow_cache {
+    struct flow_bucket *buckets;
+    uint64_t bucket_mask;
+    int evict;
+    uint64_t hit_num;
+    uint64_t miss_num;
+    uint64_t evict_num;
+};
+
+
+int flow_cache_init(struct flow_cache *p_fc, size_t entry_num, int evict);
+void flow_cache_term(struct flow_cache *p_fc);
+
+static inline struct flow_bucket *flow_cache_bucket(
+        const struct flow_cache *p_fc, const uint32_t *dims)
+{
+    uint64_t h = ((uint64_t)dims[DIM_SIP] << 32 | dims[DIM_DIP]) *
+        0x9e3779b97f4a7c15ULL;
+
+    h ^= ((uint64_t)dims[DIM_SPORT] << 24 | dims[DIM_DPORT] << 8 |
+            dims[DIM_PROTO]) * 0xc2b2ae3d27d4eb4fULL;
+
+    return &p_fc->buckets[(h ^ (h >> 31)) & p_fc->bucket_mask];
+}
+
+static inline int flow_entry_match(const struct flow_entry *p_fe,
+        const uint32_t *dims)
+{
+    return p_fe->is_valid && p_fe->sip == dims[DIM_SIP] &&
+        p_fe->dip == dims[DIM_DIP] && p_fe->sport == dims[DIM_SPORT] &&
+        p_fe->dport == dims[DIM_DPORT] && p_fe->proto == dims[DIM_PROTO];
+}
+
+/* The priority cached for the packet, or -1 on a miss */
+static inline int flow_cache_lookup(struct flow_cache *p_fc,
+        struct flow_bucket *p_fb, const uint32_t *dims)
+{
+    struct flow_entry fe;
+    int i, pri;
+
+    for (i = 0; i < FLOW_CACHE_WAYS; i++) {
+        if (!flow_entry_match(&p_fb->entries[i], dims)) {
+            continue;
+        }
+
+        p_fc->hit_num++;
+        pri = p_fb->entries[i].pri;
+
+        if (p_fc->evict == FLOW_EVICT_CLOCK) {
+            p_fb->entries[i].is_ref = 1;
+
+        } else if (i) {
+            fe = p_fb->entries[i];
+            memmove(&p_fb->entries[1], &p_fb->entries[0],
+                    i * sizeof(fe));
+            p_fb->entries[0] = fe;
+        }
+
+        return pri;
+    }
+
+    p_fc->miss_num++;
+
+    return -1;
+}
+
+static inline void flow_cache_insert(struct flow_cache *p_fc,
+        struct flow_bucket *p_fb, const uint32_t *dims, int pri)
+{
+    struct flow_entry *p_fe;
+    uint32_t i;
+
+    /* entries hold valid headers only, so a truncated one never hits */
+    if (dims[DIM_SPORT] > UINT16_MAX || dims[DIM_DPORT] > UINT16_MAX ||
+        dims[DIM_PROTO] > UINT8_MAX) {
+        return;
+    }
+
+    /* a flow missed twice in a batch is inserted once */
+    for (i = 0; i < FLOW_CACHE_WAYS; i++) {
+        if (flow_entry_match(&p_fb->entries[i], dims)) {
+            return;
+        }
+    }
+
+    if (p_fc->evict == FLOW_EVICT_CLOCK) {
+        /* the first entry not hit since the last sweep, or an empty one */
+        for (i = p_fb->hand; p_fb->entries[i].is_valid &&
+            p_fb->entries[i].is_ref; i = (i + 1) % FLOW_CACHE_WAYS) {
+            p_fb->entries[i].is_ref = 0;
+        }
+
+        p_fb->hand = (i + 1) % FLOW_CACHE_WAYS;
+        p_fe = &p_fb->entries[i];
+        p_fc->evict_num += p_fe->is_valid;
+
+    } else {
+        /* the least recently used entry is dropped from the end */
+        i = FLOW_CACHE_WAYS - 1;
+        p_fc->evict_num += p_fb->entries[i].is_valid;
+        memmove(&p_fb->entries[1], &p_fb->entries[0],
+                i * sizeof(*p_fe));
+        p_fe = &p_fb->entries[0];
+    }
+
+    p_fe->sip = dims[DIM_SIP];
+    p_fe->dip = dims[DIM_DIP];
+    p_fe->sport = dims[DIM_SPORT];
+    p_fe->dport = dims[DIM_DPORT];
+    p_fe->proto = dims[DIM_PROTO];
+    p_fe->pri = pri;
+    p_fe->is_valid = 1;
+    p_fe->is_ref = 0;
+
+    return;
+}
+
+#endif /* __FLOW_CACHE_H__ */
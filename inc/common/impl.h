@@ -18,6 +18,8 @@
 #include "common/point_range.h"
 #include "common/rule_trace.h"
 #include "clsfy/hypersplit.h"
+#include "clsfy/hypercuts.h"
+#include "clsfy/rfc.h"
 #include "group/rfg.h"
 
 /* buffer */
@@ -25,8 +27,14 @@ VECTOR_PROTOTYPE(extern, prefix_vector, struct prefix)
 
 VECTOR_PROTOTYPE(extern, rule_vector, struct rule)
 
+VECTOR_PROTOTYPE(extern, rule_set_vector, struct rule_set)
+
+VECTOR_PROTOTYPE(extern, packet_vector, struct packet)
+
+RING_PROTOTYPE(extern, trace_ring, struct trace)
+
 /* mpool */
-MPOOL_PROTOTYPE(extern, hsn_pool)
+CMPOOL_PROTOTYPE(extern, hsbn_pool)
 
 /* sort */
 ISORT_PROTOTYPE(extern, int, int)
@@ -34,9 +42,20 @@ QSORT_PROTOTYPE(extern, int, int)
 
 ISORT_PROTOTYPE(extern, int64, int64_t)
 QSORT_PROTOTYPE(extern, int64, int64_t)
+RSORT_PROTOTYPE(extern, int64, int64_t)
 
 ISORT_PROTOTYPE(extern, rng_rid, struct rfg_rng_rid)
 QSORT_PROTOTYPE(extern, rng_rid, struct rfg_rng_rid)
+RSORT_PROTOTYPE(extern, rng_rid, struct rfg_rng_rid)
+
+ISORT_PROTOTYPE(extern, hs_tree, struct hs_tree)
+QSORT_PROTOTYPE(extern, hs_tree, struct hs_tree)
+
+ISORT_PROTOTYPE(extern, hc_tree, struct hc_tree)
+QSORT_PROTOTYPE(extern, hc_tree, struct hc_tree)
+
+ISORT_PROTOTYPE(extern, rfc_set, struct rfc_set)
+QSORT_PROTOTYPE(extern, rfc_set, struct rfc_set)
 
 BSEARCH_PROTOTYPE(extern, rng_idx, struct rfg_rng_idx)
 
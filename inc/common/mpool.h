@@ -306,5 +306,34 @@ void *gcmpool_malloc(struct gcmpool *mp);
 void *gcmpool_calloc(struct gcmpool *mp);
 void gcmpool_free(struct gcmpool *mp, void *p);
 
+
+/* Variable-size blocks released in LIFO order: a freed block is reclaimed
+ * once all blocks above it are freed. Blocks can be freed by any thread,
+ * but only the owner thread allocates */
+struct gsmpool_chunk {
+    struct gsmpool_chunk *next;
+    char *end;
+    char data[] __attribute__((aligned(16)));
+};
+
+struct gsmpool_block {
+    struct gsmpool_block *prev;
+    struct gsmpool_chunk *chunk;
+    int is_free;
+} __attribute__((aligned(16)));
+
+struct gsmpool {
+    size_t chunk_size;
+    char *top;
+    struct gsmpool_block *last;
+    struct gsmpool_chunk *cur, *chunks;
+};
+
+void gsmpool_init(struct gsmpool *mp, size_t chunk_size);
+void gsmpool_term(struct gsmpool *mp);
+
+void *gsmpool_malloc(struct gsmpool *mp, size_t size);
+void gsmpool_free(void *p);
+
 #endif /* __MPOOL_H__ */
 
@@ -0,0 +1,55 @@
+/*
+ *     Filename: pcap.h
+ *  Description: Header file for pcap and pcapng trace parsing
+ *
+ *       Author: Xiang Wang (xiang.wang.s@gmail.com)
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#ifndef __PCAP_H__
+#define __PCAP_H__
+
+#include <stdint.h>
+#include <unistd.h>
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAPNG_SHB_TYPE 0x0a0d0d0a
+#define PCAPNG_BYTE_ORDER 0x1a2b3c4d
+
+#define PCAP_FILE_HDR_SIZE 24
+#define PCAP_REC_HDR_SIZE 16
+#define PCAP_IF_MAX 64
+
+enum {
+    PCAP_LINK_ETHERNET = 1,
+    PCAP_LINK_RAW = 101,
+    PCAP_LINK_LINUX_SLL = 113,
+    PCAP_LINK_IPV4 = 228
+};
+
+struct packet;
+
+/*
+ * Parsing state of a classic pcap or a pcapng file, which is fed record
+ * by record. Only IPv4 packets over Ethernet (with VLAN tags), Linux
+ * cooked or raw links are extracted, the others are counted as skipped.
+ */
+struct pcap_parser {
+    int is_started;
+    int is_ng;
+    int is_swapped;
+    int if_num;
+    uint16_t linktypes[PCAP_IF_MAX]; /* classic pcap has linktypes[0] */
+    uint64_t skip_num;
+};
+
+int pcap_detect(const void *p_data, size_t len);
+void pcap_init(struct pcap_parser *p_pp);
+ssize_t pcap_parse(struct pcap_parser *p_pp, const void *p_data, size_t len,
+        struct packet *p_pkt, int *p_is_pkt);
+
+#endif /* __PCAP_H__ */
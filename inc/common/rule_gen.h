@@ -0,0 +1,60 @@
+/*
+ *     Filename: rule_gen.h
+ *  Description: Header file for synthetic rule and trace generation
+ *
+ *       Author: Xiang Wang (xiang.wang.s@gmail.com)
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#ifndef __RULE_GEN_H__
+#define __RULE_GEN_H__
+
+#include <stdint.h>
+#include "common/rule_trace.h"
+
+#define GEN_PROTO_WC 256 /* index of the wildcard protocol */
+
+
+enum {
+    GEN_PROFILE_INV = -1,
+    GEN_PROFILE_ACL = 0,
+    GEN_PROFILE_FW = 1,
+    GEN_PROFILE_IPC = 2,
+    GEN_PROFILE_MAX = 3
+};
+
+enum {
+    GEN_PORT_WC = 0, /* 0 : 65535 */
+    GEN_PORT_HI = 1, /* 1024 : 65535 */
+    GEN_PORT_LO = 2, /* 0 : 1023 */
+    GEN_PORT_EM = 3, /* exact match */
+    GEN_PORT_AR = 4, /* arbitrary range */
+    GEN_PORT_MAX = 5
+};
+
+
+/*
+ * Seed parameters in the manner of ClassBench: relative weights of the
+ * prefix lengths, the port range classes and the protocols of a rule set
+ */
+struct gen_profile {
+    uint32_t sip_lens[33];
+    uint32_t dip_lens[33];
+    uint32_t sport_cls[GEN_PORT_MAX];
+    uint32_t dport_cls[GEN_PORT_MAX];
+    uint32_t protos[GEN_PROTO_WC + 1];
+};
+
+
+int gen_profile_init(struct gen_profile *p_gp, int profile);
+int gen_profile_learn(struct gen_profile *p_gp, const struct rule_set *p_rs);
+
+int gen_rules(struct rule_set *p_rs, const struct gen_profile *p_gp,
+        int rule_num, uint64_t seed);
+int gen_trace(struct trace *p_t, const struct rule_set *p_rs, int pkt_num,
+        uint64_t seed);
+
+#endif /* __RULE_GEN_H__ */
@@ -16,16 +16,7 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include "common/buffer.h"
-
-#define WUSTL_RULE_FMT_SCN \
-    "@%"SCNu32".%"SCNu32".%"SCNu32".%"SCNu32"/%"SCNu32\
-    " %"SCNu32".%"SCNu32".%"SCNu32".%"SCNu32"/%"SCNu32\
-    " %"SCNu32" : %"SCNu32\
-    " %"SCNu32" : %"SCNu32\
-    " %"SCNx32"/%"SCNx32"\n"
-
-#define WUSTL_PKT_FMT_SCN \
-    "%"SCNu32" %"SCNu32" %"SCNu32" %"SCNu32" %"SCNu32" %"SCNd32"\n"
+#include "common/pcap.h"
 
 #define PART_HEAD_FMT_PRI \
     "#%"PRIu32",%"PRIu32"\n"
@@ -38,20 +29,12 @@
     ",%"PRIu32",%"PRIu32 \
     ",%"PRId32"\n"
 
-#define PART_HEAD_FMT_SCN \
-    "#%"SCNu32",%"SCNu32"\n"
+#define TRACE_STREAM_BUF_SIZE (1 << 20) /* 1M */
 
-#define PART_RULE_FMT_SCN \
-    "@%"SCNu32",%"SCNu32 \
-    ",%"SCNu32",%"SCNu32 \
-    ",%"SCNu32",%"SCNu32 \
-    ",%"SCNu32",%"SCNu32 \
-    ",%"SCNu32",%"SCNu32 \
-    ",%"SCNd32"\n"
+#define TRACE_FILE_MAGIC 0x52544350 /* "PCTR" */
+#define TRACE_FILE_VERSION 1
 
-#define RULE_MAX (1 << 17) /* 128K */
-#define PKT_MAX (1 << 17) /* 128K */
-#define PART_MAX (1 << 6) /* 64 */
+#define TRACE_MATCH_UNKNOWN (-1) /* not checked by searching */
 
 
 enum {
@@ -90,6 +73,33 @@ struct packet {
 struct trace {
     struct packet *pkts;
     int pkt_num;
+    void *p_map; /* packets are in the mapped file if binary */
+    size_t map_size;
+};
+
+/*
+ * The binary trace: a header and then pkt_num packets laid out as struct
+ * packet, little-endian, with match_rule counted from 0. It is mapped and
+ * searched in place, so loading takes no parsing.
+ */
+struct trace_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t pkt_size;
+    uint32_t pkt_num;
+};
+
+/* A trace file parsed through a fixed-size read buffer, so that traces
+ * larger than memory can be replayed */
+struct trace_stream {
+    char *buf;
+    size_t len;
+    size_t cur;
+    int fd;
+    int is_eof;
+    int is_binary;
+    int is_pcap;
+    struct pcap_parser pcap;
 };
 
 struct shadow_range {
@@ -100,13 +110,24 @@ struct shadow_range {
 };
 
 VECTOR(rule_vector, struct rule);
+VECTOR(rule_set_vector, struct rule_set);
+VECTOR(packet_vector, struct packet);
+RING(trace_ring, struct trace);
 
 
 int load_rules(struct rule_set *p_rs, const char *s_rf);
 void unload_rules(struct rule_set *p_rs);
+int dump_rules(const char *s_rf, const struct rule_set *p_rs);
 
 int load_trace(struct trace *p_t, const char *s_tf);
 void unload_trace(struct trace *p_t);
+int dump_trace(const char *s_tf, const struct trace *p_t);
+int print_trace(const char *s_tf, const struct trace *p_t);
+void label_trace(struct trace *p_t, const struct partition *p_pa);
+
+int open_trace(struct trace_stream *p_ts, const char *s_tf);
+int read_trace(struct trace_stream *p_ts, struct packet *pkts, int pkt_num);
+void close_trace(struct trace_stream *p_ts);
 
 int load_partition(struct partition *p_pa, const char *s_pf);
 void unload_partition(struct partition *p_pa);
@@ -117,6 +138,12 @@ int split_range_rule(struct rule_vector *p_vector, const struct rule *p_rule);
 int shadow_rules(struct shadow_range *srngs, int64_t *spnts,
         const uint32_t dim_rng[2], const int *rule_id, int rule_num,
         const struct rule *rules, int dim);
+/* ends: (rule_id << 1 | is_end) of all endpoints sorted on dimension dim */
+int sort_rule_ends(int *ends, int64_t *spnts, const int *rule_id,
+        int rule_num, const struct rule *rules, int dim);
+int shadow_sorted_rules(struct shadow_range *srngs, int64_t *spnts,
+        const uint32_t dim_rng[2], const int *ends, int end_num,
+        const struct rule *rules, int dim);
 
 #endif /* __RULE_TRACE_H__ */
 
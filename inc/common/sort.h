@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include "common/utils.h"
@@ -205,10 +206,78 @@
         return 0; \
     }
 
+#define RSORT_PROTOTYPE(scope, name, type_t) \
+    scope long name##_RSORT(type_t *base, type_t *buf, size_t num);
+
+/* LSD radix sort on the uint64_t returned by key, one byte per pass,
+ * the passes on bytes shared by all keys are skipped */
+#define RSORT_GENERATE(scope, name, type_t, key) \
+    scope long name##_RSORT(type_t *base, type_t *buf, size_t num) \
+    { \
+        uint64_t k; \
+        size_t i, d, cnts[8][256]; \
+        type_t *tmp, *src = base, *dst; \
+        if (num <= 1) { \
+            return 0; \
+        } \
+        if (!(dst = buf ? buf : malloc(num * sizeof(*buf)))) { \
+            return -ENOMEM; \
+        } \
+        memset(cnts, 0, sizeof(cnts)); \
+        for (i = 0; i < num; i++) { \
+            k = key(base + i); \
+            for (d = 0; d < 8; d++) { \
+                cnts[d][(k >> (d << 3)) & 0xff]++; \
+            } \
+        } \
+        k = key(base); \
+        for (d = 0; d < 8; d++) { \
+            size_t sum, *cnt = cnts[d]; \
+            unsigned int shift = d << 3; \
+            if (cnt[(k >> shift) & 0xff] == num) { \
+                continue; \
+            } \
+            for (sum = i = 0; i < 256; i++) { \
+                size_t c = cnt[i]; \
+                cnt[i] = sum; \
+                sum += c; \
+            } \
+            for (i = 0; i < num; i++) { \
+                dst[cnt[(key(src + i) >> shift) & 0xff]++] = src[i]; \
+            } \
+            tmp = src, src = dst, dst = tmp; \
+        } \
+        if (src != base) { \
+            memcpy(base, src, num * sizeof(*base)); \
+            dst = src; \
+        } \
+        if (!buf) { \
+            free(dst); \
+        } \
+        return 0; \
+    }
+
 #define BSEARCH(name, key, base, num) name##_BSEARCH(key, base, num)
 #define ISORT(name, base, num) name##_ISORT(base, num)
 #define QSORT(name, base, num) name##_QSORT(base, num)
 #define MSORT(name, base, buf, num) name##_MSORT(base, buf, num)
+#define RSORT(name, base, buf, num) name##_RSORT(base, buf, num)
+
+/* Insertion sort for small arrays, radix sort for large ones, quick sort
+ * in between. buf holds num elements for the radix sort, or is NULL */
+#define SORT_ISORT_MAX 32
+#define SORT_RADIX_MIN 512
+
+#define SORT(name, base, buf, num) \
+    do { \
+        size_t __num = (num); \
+        if (__num <= SORT_ISORT_MAX) { \
+            ISORT(name, base, __num); \
+        } else if (__num < SORT_RADIX_MIN || \
+            RSORT(name, base, buf, __num)) { \
+            QSORT(name, base, __num); \
+        } \
+    } while (0)
 
 #else
 typedef long (*sort_cmp_t)(const void *, const void *);
@@ -0,0 +1,29 @@
+/*
+ *     Filename: group.h
+ *  Description: Header file for the registry of grouping algorithms
+ *
+ *       Author: Xiang Wang (xiang.wang.s@gmail.com)
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#ifndef __GROUP_H__
+#define __GROUP_H__
+
+#include "common/rule_trace.h"
+
+
+/* A grouping splits the one subset of p_pa into the subsets of p_pa_grp */
+struct grp_algo {
+    const char *name;
+    const char *desc;
+    int (*group)(struct partition *p_pa_grp, const struct partition *p_pa);
+};
+
+
+const struct grp_algo *grp_find(const char *s_name);
+const struct grp_algo *grp_get(int i);
+
+#endif /* __GROUP_H__ */
@@ -0,0 +1,446 @@
+/*
+ *     Filename: bitvector.c
+ *  Description: Source file for Bit Vector and Aggregated Bit Vector
+ *
+ *       Author: Xiang Wang (xiang.wang.s@gmail.com)
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <immintrin.h>
+
+#include "common/impl.h"
+#include "common/utils.h"
+#include "clsfy/bitvector.h"
+
+
+static const uint32_t s_bv_max[DIM_MAX] = {
+    UINT32_MAX, UINT32_MAX, UINT16_MAX, UINT16_MAX, UINT8_MAX
+};
+
+
+static int f_bv_dim(struct bv_result *p_bv, const struct rule *rules, int d);
+static inline int f_bv_interval(const struct bv_dim *p_dim, uint32_t value);
+
+static inline int f_bv_lookup(const struct packet *p_pkt,
+        const struct bv_result *p_bv);
+static inline int f_bv_block(const uint64_t **bms, int block);
+static int f_bv_lookup_avx2(const struct packet *p_pkt,
+        const struct bv_result *p_bv);
+static inline int f_bv_block_avx2(const uint64_t **bms, int block);
+
+
+int bv_build(void *built_result, const struct partition *p_pa,
+        int is_aggregated)
+{
+    int i, j, d, ret = 0, rule_num = 0;
+    size_t size;
+    int64_t *keys;
+    struct rule *rules, *sorted = NULL;
+    struct bv_result *p_bv;
+    const struct rule_set *p_rs;
+
+    if (!built_result || !p_pa || !p_pa->subsets || p_pa->subset_num <= 0 ||
+        p_pa->rule_num <= 1) {
+        return -EINVAL;
+    }
+
+    p_bv = calloc(1, sizeof(*p_bv));
+    rules = malloc(p_pa->rule_num * sizeof(*rules));
+    keys = malloc(p_pa->rule_num * 2 * sizeof(*keys));
+    if (!p_bv || !rules || !keys) {
+        free(p_bv);
+        free(rules);
+        free(keys);
+        return -ENOMEM;
+    }
+
+    *(typeof(p_bv) *)built_result = p_bv;
+
+    /* the CPU is asked here rather than for each packet */
+    p_bv->lookup = __builtin_cpu_supports("avx2") ? f_bv_lookup_avx2 :
+        f_bv_lookup;
+
+    /* Bits of all subsets are in one priority order: grouping brings nothing */
+    p_bv->def_rule = p_pa->subsets[0].def_rule;
+    for (i = 0; i < p_pa->subset_num; i++) {
+        p_rs = &p_pa->subsets[i];
+        for (j = 0; j < p_rs->rule_num; j++) {
+            if (p_rs->rules[j].pri != p_rs->def_rule) {
+                keys[rule_num] = (int64_t)p_rs->rules[j].pri << 32 | rule_num;
+                rules[rule_num++] = p_rs->rules[j];
+            }
+        }
+    }
+
+    SORT(int64, keys, keys + rule_num, rule_num);
+
+    p_bv->rule_num = rule_num;
+    p_bv->word_num = (rule_num + 63) / 64;
+    p_bv->word_num = (p_bv->word_num + BV_BLOCK_WORDS - 1) /
+        BV_BLOCK_WORDS * BV_BLOCK_WORDS;
+    p_bv->agg_num = is_aggregated ?
+        (p_bv->word_num / BV_BLOCK_WORDS + 63) / 64 : 0;
+
+    p_bv->pris = malloc(p_bv->word_num * 64 * sizeof(*p_bv->pris));
+    sorted = malloc(rule_num * sizeof(*sorted));
+    if (!p_bv->pris || !sorted) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for (i = 0; i < rule_num; i++) {
+        sorted[i] = rules[keys[i] & UINT32_MAX];
+        p_bv->pris[i] = sorted[i].pri;
+    }
+
+    for (d = 0; !ret && d < DIM_MAX; d++) {
+        ret = f_bv_dim(p_bv, sorted, d);
+    }
+
+    if (ret) {
+        goto out;
+    }
+
+    for (size = d = 0; d < DIM_MAX; d++) {
+        size += (size_t)p_bv->dims[d].interval_num *
+            (p_bv->word_num + p_bv->agg_num) * sizeof(uint64_t);
+    }
+
+    fprintf(stderr, "%d rules, %d %d %d %d %d intervals, %zu bytes of "
+            "bitmaps\n", rule_num, p_bv->dims[0].interval_num,
+            p_bv->dims[1].interval_num, p_bv->dims[2].interval_num,
+            p_bv->dims[3].interval_num, p_bv->dims[4].interval_num, size);
+
+out:
+    if (ret) {
+        bv_destroy(built_result);
+        *(typeof(p_bv) *)built_result = NULL;
+    }
+
+    free(rules);
+    free(sorted);
+    free(keys);
+
+    return ret;
+}
+
+/* The best rule a packet matches: the first bit set in all dimensions */
+int bv_lookup(const struct packet *p_pkt, const void *built_result)
+{
+    const struct bv_result *p_bv;
+
+    assert(p_pkt && built_result);
+
+    p_bv = *(typeof(p_bv) *)built_result;
+
+    return p_bv->lookup(p_pkt, p_bv);
+}
+
+/* Bytes of the intervals of all dimensions and the rule priorities */
+size_t bv_memory(const void *built_result)
+{
+    int d;
+    size_t size;
+    const struct bv_result *p_bv;
+
+    if (!built_result) {
+        return 0;
+    }
+
+    p_bv = *(typeof(p_bv) *)built_result;
+    if (!p_bv) {
+        return 0;
+    }
+
+    size = sizeof(*p_bv) + p_bv->word_num * 64 * sizeof(*p_bv->pris);
+    for (d = 0; d < DIM_MAX; d++) {
+        size += (size_t)p_bv->dims[d].interval_num * (sizeof(uint32_t) +
+                (p_bv->word_num + p_bv->agg_num) * sizeof(uint64_t));
+    }
+
+    return size;
+}
+
+void bv_destroy(void *built_result)
+{
+    int d;
+    struct bv_result *p_bv;
+
+    if (!built_result) {
+        return;
+    }
+
+    p_bv = *(typeof(p_bv) *)built_result;
+    if (!p_bv) {
+        return;
+    }
+
+    for (d = 0; d < DIM_MAX; d++) {
+        free(p_bv->dims[d].bounds);
+        free(p_bv->dims[d].bms);
+        free(p_bv->dims[d].aggs);
+    }
+
+    free(p_bv->pris);
+    free(p_bv);
+
+    return;
+}
+
+/*
+ * Cut dimension d at the endpoints of the rules, numbered in priority
+ * order, and sweep the intervals, each rule setting its bit from its first
+ * interval to its last
+ */
+static int f_bv_dim(struct bv_result *p_bv, const struct rule *rules, int d)
+{
+    int i, k, b, e, ret, num, key_num, *rule_id = NULL;
+    int rule_num = p_bv->rule_num, word_num = p_bv->word_num;
+    int64_t *spnts = NULL;
+    uint32_t rng[2] = {0, s_bv_max[d]};
+    uint64_t *bm = NULL, *p_agg;
+    const uint64_t *p_bm;
+    struct shadow_range srng = {NULL, NULL, 0, 0};
+    struct bv_dim *p_dim = &p_bv->dims[d];
+
+    ret = -ENOMEM;
+    rule_id = malloc(rule_num * sizeof(*rule_id));
+    /* two endpoints of each rule, and as many again for shadow_rules to sort */
+    spnts = malloc(rule_num * 4 * sizeof(*spnts));
+    srng.pnts = malloc(rule_num * 4 * sizeof(*srng.pnts));
+    p_dim->bounds = malloc((rule_num * 2 + 1) * sizeof(*p_dim->bounds));
+    bm = calloc(word_num, sizeof(*bm));
+    if (!rule_id || !spnts || !srng.pnts || !p_dim->bounds || !bm) {
+        goto out;
+    }
+
+    for (i = 0; i < rule_num; i++) {
+        rule_id[i] = i;
+    }
+
+    ret = shadow_rules(&srng, spnts, rng, rule_id, rule_num, rules, d);
+    if (ret) {
+        goto out;
+    }
+
+    /* the shadow ranges go from the first endpoint to the last one */
+    num = 0;
+    if (srng.pnts[0] > 0) {
+        p_dim->bounds[num++] = 0;
+    }
+
+    for (i = 0; i < srng.pnt_num; i += 2) {
+        p_dim->bounds[num++] = srng.pnts[i];
+    }
+
+    if (srng.pnts[srng.pnt_num - 1] < rng[1]) {
+        p_dim->bounds[num++] = srng.pnts[srng.pnt_num - 1] + 1;
+    }
+
+    p_dim->interval_num = num;
+
+    ret = -ENOMEM;
+    p_dim->bms = malloc((size_t)num * word_num * sizeof(*p_dim->bms));
+    if (!p_dim->bms) {
+        goto out;
+    }
+
+    if (p_bv->agg_num) {
+        p_dim->aggs = calloc((size_t)num * p_bv->agg_num,
+                sizeof(*p_dim->aggs));
+        if (!p_dim->aggs) {
+            goto out;
+        }
+    }
+
+    /* each rule opens its bit at its first interval, closes past its last */
+    for (key_num = k = 0; k < rule_num; k++) {
+        i = f_bv_interval(p_dim, rules[k].dims[d][0]);
+        spnts[key_num++] = (int64_t)i << 32 | k;
+        i = f_bv_interval(p_dim, rules[k].dims[d][1]);
+        spnts[key_num++] = (int64_t)(i + 1) << 32 | 1U << 31 | k;
+    }
+
+    SORT(int64, spnts, spnts + key_num, key_num);
+
+    for (e = i = 0; i < num; i++) {
+        for (; e < key_num && (spnts[e] >> 32) == i; e++) {
+            k = spnts[e] & INT32_MAX;
+            bm[k >> 6] ^= 1ULL << (k & 63);
+        }
+
+        memcpy(p_dim->bms + (size_t)i * word_num, bm, word_num * sizeof(*bm));
+    }
+
+    for (i = 0; p_bv->agg_num && i < num; i++) {
+        p_bm = p_dim->bms + (size_t)i * word_num;
+        p_agg = p_dim->aggs + (size_t)i * p_bv->agg_num;
+        for (b = 0; b < word_num / BV_BLOCK_WORDS; b++) {
+            for (k = 0; k < BV_BLOCK_WORDS; k++) {
+                if (p_bm[b * BV_BLOCK_WORDS + k]) {
+                    p_agg[b >> 6] |= 1ULL << (b & 63);
+                    break;
+                }
+            }
+        }
+    }
+
+    ret = 0;
+
+out:
+    free(rule_id);
+    free(spnts);
+    free(srng.pnts);
+    free(bm);
+
+    return ret;
+}
+
+/* The interval holding value: the last one starting at or below it */
+static inline int f_bv_interval(const struct bv_dim *p_dim, uint32_t value)
+{
+    int lo = 0, hi = p_dim->interval_num - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi + 1) >> 1;
+        if (p_dim->bounds[mid] <= value) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return lo;
+}
+
+/*
+ * AND the bitmaps of the packet intervals up to the first bit set. With the
+ * aggregate, only the blocks nonzero in all summaries are ANDed.
+ */
+static inline int f_bv_lookup(const struct packet *p_pkt,
+        const struct bv_result *p_bv)
+{
+    int d, a, b, r;
+    uint64_t agg;
+    const uint64_t *bms[DIM_MAX], *aggs[DIM_MAX];
+
+    for (d = 0; d < DIM_MAX; d++) {
+        r = f_bv_interval(&p_bv->dims[d], p_pkt->dims[d]);
+        bms[d] = p_bv->dims[d].bms + (size_t)r * p_bv->word_num;
+        if (p_bv->agg_num) {
+            aggs[d] = p_bv->dims[d].aggs + (size_t)r * p_bv->agg_num;
+        }
+    }
+
+    if (!p_bv->agg_num) {
+        for (b = 0; b < p_bv->word_num / BV_BLOCK_WORDS; b++) {
+            r = f_bv_block(bms, b);
+            if (r >= 0) {
+                return p_bv->pris[r];
+            }
+        }
+
+        return p_bv->def_rule;
+    }
+
+    for (a = 0; a < p_bv->agg_num; a++) {
+        agg = aggs[0][a] & aggs[1][a] & aggs[2][a] & aggs[3][a] & aggs[4][a];
+        for (; agg; agg &= agg - 1) {
+            r = f_bv_block(bms, (a << 6) + __builtin_ctzll(agg));
+            if (r >= 0) {
+                return p_bv->pris[r];
+            }
+        }
+    }
+
+    return p_bv->def_rule;
+}
+
+/* The first bit set in block of the ANDed bitmaps, or -1 */
+static inline int f_bv_block(const uint64_t **bms, int block)
+{
+    int w, end = (block + 1) * BV_BLOCK_WORDS;
+    uint64_t word;
+
+    for (w = block * BV_BLOCK_WORDS; w < end; w++) {
+        word = bms[0][w] & bms[1][w] & bms[2][w] & bms[3][w] & bms[4][w];
+        if (word) {
+            return (w << 6) + __builtin_ctzll(word);
+        }
+    }
+
+    return -1;
+}
+
+/* f_bv_lookup with a block of 256 bits ANDed at once */
+__attribute__((target("avx2")))
+static int f_bv_lookup_avx2(const struct packet *p_pkt,
+        const struct bv_result *p_bv)
+{
+    int d, a, b, r;
+    uint64_t agg;
+    const uint64_t *bms[DIM_MAX], *aggs[DIM_MAX];
+
+    for (d = 0; d < DIM_MAX; d++) {
+        r = f_bv_interval(&p_bv->dims[d], p_pkt->dims[d]);
+        bms[d] = p_bv->dims[d].bms + (size_t)r * p_bv->word_num;
+        if (p_bv->agg_num) {
+            aggs[d] = p_bv->dims[d].aggs + (size_t)r * p_bv->agg_num;
+        }
+    }
+
+    if (!p_bv->agg_num) {
+        for (b = 0; b < p_bv->word_num / BV_BLOCK_WORDS; b++) {
+            r = f_bv_block_avx2(bms, b);
+            if (r >= 0) {
+                return p_bv->pris[r];
+            }
+        }
+
+        return p_bv->def_rule;
+    }
+
+    for (a = 0; a < p_bv->agg_num; a++) {
+        agg = aggs[0][a] & aggs[1][a] & aggs[2][a] & aggs[3][a] & aggs[4][a];
+        for (; agg; agg &= agg - 1) {
+            r = f_bv_block_avx2(bms, (a << 6) + __builtin_ctzll(agg));
+            if (r >= 0) {
+                return p_bv->pris[r];
+            }
+        }
+    }
+
+    return p_bv->def_rule;
+}
+
+__attribute__((target("avx2")))
+static inline int f_bv_block_avx2(const uint64_t **bms, int block)
+{
+    int w, d;
+    uint64_t words[BV_BLOCK_WORDS];
+    __m256i v;
+
+    w = block * BV_BLOCK_WORDS;
+    v = _mm256_loadu_si256((const __m256i *)&bms[0][w]);
+    for (d = 1; d < DIM_MAX; d++) {
+        v = _mm256_and_si256(v,
+                _mm256_loadu_si256((const __m256i *)&bms[d][w]));
+    }
+
+    if (_mm256_testz_si256(v, v)) {
+        return -1;
+    }
+
+    _mm256_storeu_si256((__m256i *)words, v);
+    for (d = 0; !words[d]; d++);
+
+    return ((w + d) << 6) + __builtin_ctzll(words[d]);
+}
@@ -0,0 +1,279 @@
+/*
+ *     Filename: clsfy.c
+ *  Description: Source file for the registry of classification algorithms
+ *
+ *       Author: Xiang Wang (xiang.wang.s@gmail.com)
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "common/utils.h"
+#include "clsfy/clsfy.h"
+#include "clsfy/hypersplit.h"
+#include "clsfy/hypercuts.h"
+#include "clsfy/tuplemerge.h"
+#include "clsfy/rfc.h"
+#include "clsfy/bitvector.h"
+
+
+static int f_hs_build(void *built_result, const struct partition *p_pa,
+        const struct clsfy_param *p_param);
+static int f_hs_orig_build(void *built_result, const struct partition *p_pa,
+        const struct clsfy_param *p_param);
+static int f_hs_finish(void *built_result, const struct clsfy_param *p_param);
+static int f_hc_build(void *built_result, const struct partition *p_pa,
+        const struct clsfy_param *p_param);
+static int f_tm_build(void *built_result, const struct partition *p_pa,
+        const struct clsfy_param *p_param);
+static int f_tss_build(void *built_result, const struct partition *p_pa,
+        const struct clsfy_param *p_param);
+static int f_rfc_build(void *built_result, const struct partition *p_pa,
+        const struct clsfy_param *p_param);
+static int f_bv_build(void *built_result, const struct partition *p_pa,
+        const struct clsfy_param *p_param);
+static int f_abv_build(void *built_result, const struct partition *p_pa,
+        const struct clsfy_param *p_param);
+
+
+/* A new algorithm is added here, and is selected by its name */
+static const struct clsfy_algo s_clsfy_algos[] = {
+    {
+        .name = "hs",
+        .desc = "HyperSplit, splitting dimensions adapted to rfg groups",
+        .opts = CLSFY_OPT_BINTH | CLSFY_OPT_DAG | CLSFY_OPT_PACKED |
+            CLSFY_OPT_THREAD,
+        .build = f_hs_build,
+        .lookup = hs_lookup,
+        .lookup_simd = hs_lookup_simd,
+        .search_batch = hs_search_batch,
+        .search_cache = hs_search_cache,
+        .simd_lanes = hs_simd_lanes,
+        .save = hs_save,
+        .load = hs_load,
+        .memory = hs_memory,
+        .destroy = hs_destroy
+    },
+    {
+        .name = "hs_orig",
+        .desc = "HyperSplit, splitting dimensions as originally proposed",
+        .opts = CLSFY_OPT_BINTH | CLSFY_OPT_DAG | CLSFY_OPT_PACKED |
+            CLSFY_OPT_THREAD,
+        .build = f_hs_orig_build,
+        .lookup = hs_lookup,
+        .lookup_simd = hs_lookup_simd,
+        .search_batch = hs_search_batch,
+        .search_cache = hs_search_cache,
+        .simd_lanes = hs_simd_lanes,
+        .save = hs_save,
+        .load = hs_load,
+        .memory = hs_memory,
+        .destroy = hs_destroy
+    },
+    {
+        .name = "hc",
+        .desc = "HyperCuts, multi-dimensional cuts with rule pushing",
+        .opts = CLSFY_OPT_BINTH,
+        .build = f_hc_build,
+        .lookup = hc_lookup,
+        .memory = hc_memory,
+        .destroy = hc_destroy
+    },
+    {
+        .name = "tm",
+        .desc = "TupleMerge, hash tables of relaxed tuples",
+        .build = f_tm_build,
+        .lookup = tm_lookup,
+        .insert = tm_insert,
+        .delete = tm_delete,
+        .memory = tm_memory,
+        .destroy = tm_destroy
+    },
+    {
+        .name = "tss",
+        .desc = "Tuple Space Search, hash tables of prefix tuples",
+        .build = f_tss_build,
+        .lookup = tm_lookup,
+        .insert = tm_insert,
+        .delete = tm_delete,
+        .memory = tm_memory,
+        .destroy = tm_destroy
+    },
+    {
+        .name = "rfc",
+        .desc = "Recursive Flow Classification, chunk and phase tables",
+        .build = f_rfc_build,
+        .lookup = rfc_lookup,
+        .memory = rfc_memory,
+        .destroy = rfc_destroy
+    },
+    {
+        .name = "bv",
+        .desc = "Bit Vector, rule bitmaps of the intervals of each field",
+        .build = f_bv_build,
+        .lookup = bv_lookup,
+        .memory = bv_memory,
+        .destroy = bv_destroy
+    },
+    {
+        .name = "abv",
+        .desc = "Aggregated Bit Vector, bit vectors skipping zero blocks",
+        .build = f_abv_build,
+        .lookup = bv_lookup,
+        .memory = bv_memory,
+        .destroy = bv_destroy
+    }
+};
+
+
+const struct clsfy_algo *clsfy_find(const char *s_name)
+{
+    int i;
+
+    assert(s_name);
+
+    for (i = 0; i < (int)ARRAY_SIZE(s_clsfy_algos); i++) {
+        if (!strcmp(s_clsfy_algos[i].name, s_name)) {
+            return &s_clsfy_algos[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* The i-th algorithm registered, or NULL past the last one */
+const struct clsfy_algo *clsfy_get(int i)
+{
+    if (i < 0 || i >= (int)ARRAY_SIZE(s_clsfy_algos)) {
+        return NULL;
+    }
+
+    return &s_clsfy_algos[i];
+}
+
+/* Look up each packet, and check the match against the one of the trace */
+int clsfy_search(clsfy_lookup_t lookup, const struct trace *p_t,
+        const void *built_result)
+{
+    int i, pri;
+
+    if (!lookup || !p_t || !p_t->pkts || !built_result ||
+        !*(void *const *)built_result) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < p_t->pkt_num; i++) {
+        pri = lookup(&p_t->pkts[i], built_result);
+
+        if (pri != p_t->pkts[i].match_rule &&
+            p_t->pkts[i].match_rule != TRACE_MATCH_UNKNOWN) {
+            fprintf(stderr, "packet %d match %d, but should match %d\n",
+                    i, pri, p_t->pkts[i].match_rule);
+            return -EFAULT;
+        }
+    }
+
+    return 0;
+}
+
+static int f_hs_build(void *built_result, const struct partition *p_pa,
+        const struct clsfy_param *p_param)
+{
+    int ret;
+
+    assert(p_param);
+
+    ret = hs_build(built_result, p_pa, p_param->thread_num, p_param->binth,
+            HS_MEASURE_RFG);
+    if (ret) {
+        return ret;
+    }
+
+    return f_hs_finish(built_result, p_param);
+}
+
+static int f_hs_orig_build(void *built_result, const struct partition *p_pa,
+        const struct clsfy_param *p_param)
+{
+    int ret;
+
+    assert(p_param);
+
+    ret = hs_build(built_result, p_pa, p_param->thread_num, p_param->binth,
+            HS_MEASURE_ORIG);
+    if (ret) {
+        return ret;
+    }
+
+    return f_hs_finish(built_result, p_param);
+}
+
+/* Reshape the built trees as asked, in the only order that works */
+static int f_hs_finish(void *built_result, const struct clsfy_param *p_param)
+{
+    int ret = 0;
+
+    if (p_param->is_dag) {
+        ret = hs_dag(built_result);
+    }
+
+    if (!ret && p_param->is_packed) {
+        ret = hs_pack(built_result);
+    }
+
+    if (!ret && p_param->is_simd) {
+        ret = hs_merge(built_result);
+    }
+
+    if (ret) {
+        hs_destroy(built_result);
+        *(void **)built_result = NULL;
+    }
+
+    return ret;
+}
+
+static int f_hc_build(void *built_result, const struct partition *p_pa,
+        const struct clsfy_param *p_param)
+{
+    assert(p_param);
+
+    return hc_build(built_result, p_pa, p_param->binth);
+}
+
+static int f_tm_build(void *built_result, const struct partition *p_pa,
+        const struct clsfy_param *p_param)
+{
+    return tm_build(built_result, p_pa, 1);
+}
+
+static int f_tss_build(void *built_result, const struct partition *p_pa,
+        const struct clsfy_param *p_param)
+{
+    return tm_build(built_result, p_pa, 0);
+}
+
+static int f_rfc_build(void *built_result, const struct partition *p_pa,
+        const struct clsfy_param *p_param)
+{
+    return rfc_build(built_result, p_pa);
+}
+
+static int f_bv_build(void *built_result, const struct partition *p_pa,
+        const struct clsfy_param *p_param)
+{
+    return bv_build(built_result, p_pa, 0);
+}
+
+static int f_abv_build(void *built_result, const struct partition *p_pa,
+        const struct clsfy_param *p_param)
+{
+    return bv_build(built_result, p_pa, 1);
+}
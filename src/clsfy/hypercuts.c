@@ -0,0 +1,808 @@
+/*
+ *     Filename: hypercuts.c
+ *  Description: Source file for HyperCuts
+ *
+ *       Author: Xiang Wang (xiang.wang.s@gmail.com)
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "common/impl.h"
+#include "common/utils.h"
+#include "clsfy/hypercuts.h"
+
+
+struct hc_context {
+    const struct rule_set *p_rs;
+    struct hc_tree *p_tree;
+    int *marks; /* cells holding each rule, while pushing */
+    int node_cap;
+    int child_cap;
+    int rule_cap;
+    int binth;
+};
+
+
+static int f_hc_tree(struct hc_context *p_ctx, int cur);
+static int f_hc_node(struct hc_context *p_ctx, uint32_t id,
+        uint32_t (*box)[2], const int *rule_id, int rule_num, int depth);
+static int f_hc_leaf(struct hc_context *p_ctx, uint32_t id,
+        const int *rule_id, int rule_num);
+static int f_hc_cut(const struct hc_context *p_ctx, uint32_t (*box)[2],
+        const int *rule_id, int rule_num, int *bits, int *shifts);
+static long f_hc_cut_sum(const struct rule *rules, const int *rule_id,
+        int rule_num, uint32_t (*box)[2], int dim, int shift);
+static int f_hc_cells(const struct rule *rules, const int *rule_id,
+        int rule_num, uint32_t (*box)[2], const int *bits,
+        const int *shifts, int *offs, int *ids);
+static int f_hc_cell_box(uint32_t (*cell_box)[2], uint32_t (*box)[2],
+        const int *bits, const int *shifts, int cell);
+static int f_hc_cover(const struct rule *rules, const int *rule_id,
+        int rule_num, uint32_t (*box)[2]);
+static int f_hc_grow(void **pp, int *p_cap, int num, size_t size);
+
+static inline int f_hc_lookup(const struct packet *p_pkt,
+        const struct hc_result *p_hc_result);
+
+
+int hc_build(void *built_result, const struct partition *p_pa, int binth)
+{
+    int i, ret = 0, node_num = 0, child_num = 0, rule_num = 0, depth_max = 0;
+    struct hc_context ctx;
+    struct hc_result *p_hc_result;
+
+    if (!built_result || !p_pa || !p_pa->subsets || p_pa->subset_num <= 0 ||
+        p_pa->rule_num <= 1 || binth < 0) {
+        return -EINVAL;
+    }
+
+    p_hc_result = malloc(sizeof(*p_hc_result));
+    if (!p_hc_result) {
+        return -ENOMEM;
+    }
+
+    p_hc_result->trees = calloc(p_pa->subset_num,
+            sizeof(*p_hc_result->trees));
+    p_hc_result->tree_num = p_pa->subset_num;
+    p_hc_result->def_rule = p_pa->subsets[0].def_rule;
+    if (!p_hc_result->trees) {
+        free(p_hc_result);
+        return -ENOMEM;
+    }
+
+    *(typeof(p_hc_result) *)built_result = p_hc_result;
+
+    ctx.binth = binth ? binth : HC_BINTH_DEFAULT;
+    for (i = 0; i < p_pa->subset_num; i++) {
+        ctx.p_rs = &p_pa->subsets[i];
+        ctx.p_tree = &p_hc_result->trees[i];
+        ret = f_hc_tree(&ctx, i);
+        if (ret) {
+            hc_destroy(built_result);
+            *(typeof(p_hc_result) *)built_result = NULL;
+            return ret;
+        }
+
+        node_num += ctx.p_tree->node_num;
+        child_num += ctx.p_tree->child_num;
+        rule_num += ctx.p_tree->rule_num;
+        depth_max = MAX(depth_max, ctx.p_tree->depth_max);
+    }
+
+    fprintf(stderr, "%d nodes (%zu bytes), %d children (%zu bytes), "
+            "%d rules (%zu bytes), depth %d at most\n", node_num,
+            node_num * sizeof(struct hc_node), child_num,
+            child_num * sizeof(uint32_t), rule_num,
+            rule_num * sizeof(struct hc_rule), depth_max);
+
+    /* by pri_min, so a lookup leaves off once no tree left can do better */
+    QSORT(hc_tree, p_hc_result->trees, p_hc_result->tree_num);
+
+    return 0;
+}
+
+/* The best rule a packet matches, from the leaf it reaches in each tree */
+int hc_lookup(const struct packet *p_pkt, const void *built_result)
+{
+    const struct hc_result *p_hc_result;
+
+    assert(p_pkt && built_result);
+
+    p_hc_result = *(typeof(p_hc_result) *)built_result;
+
+    return f_hc_lookup(p_pkt, p_hc_result);
+}
+
+/* Bytes of the trees: their nodes, children and rules */
+size_t hc_memory(const void *built_result)
+{
+    int i;
+    size_t size;
+    const struct hc_tree *p_tree;
+    const struct hc_result *p_hc_result;
+
+    if (!built_result) {
+        return 0;
+    }
+
+    p_hc_result = *(typeof(p_hc_result) *)built_result;
+    if (!p_hc_result || !p_hc_result->trees) {
+        return 0;
+    }
+
+    size = p_hc_result->tree_num * sizeof(*p_hc_result->trees);
+    for (i = 0; i < p_hc_result->tree_num; i++) {
+        p_tree = &p_hc_result->trees[i];
+        size += p_tree->node_num * sizeof(*p_tree->p_node) +
+            p_tree->child_num * sizeof(*p_tree->p_child) +
+            p_tree->rule_num * sizeof(*p_tree->p_rule);
+    }
+
+    return size;
+}
+
+void hc_destroy(void *built_result)
+{
+    int i;
+    struct hc_result *p_hc_result;
+
+    if (!built_result) {
+        return;
+    }
+
+    p_hc_result = *(typeof(p_hc_result) *)built_result;
+    if (!p_hc_result || !p_hc_result->trees) {
+        return;
+    }
+
+    for (i = 0; i < p_hc_result->tree_num; i++) {
+        free(p_hc_result->trees[i].p_node);
+        free(p_hc_result->trees[i].p_child);
+        free(p_hc_result->trees[i].p_rule);
+    }
+
+    free(p_hc_result->trees);
+    free(p_hc_result);
+
+    return;
+}
+
+static int f_hc_tree(struct hc_context *p_ctx, int cur)
+{
+    int i, ret, rule_num = 0, *rule_id;
+    struct hc_tree *p_tree = p_ctx->p_tree;
+    const struct rule_set *p_rs = p_ctx->p_rs;
+    uint32_t box[DIM_MAX][2] = {
+        {0, UINT32_MAX}, {0, UINT32_MAX},
+        {0, UINT16_MAX}, {0, UINT16_MAX},
+        {0, UINT8_MAX}
+    };
+
+    assert(p_rs->rules && p_rs->rule_num > 0);
+
+    p_ctx->node_cap = p_ctx->child_cap = p_ctx->rule_cap = 0;
+    p_ctx->marks = calloc(p_rs->rule_num, sizeof(*p_ctx->marks));
+    rule_id = malloc(p_rs->rule_num * sizeof(*rule_id));
+    if (!p_ctx->marks || !rule_id) {
+        free(p_ctx->marks);
+        free(rule_id);
+        return -ENOMEM;
+    }
+
+    /* The default rule needs no leaf: f_hc_lookup starts from it */
+    p_tree->pri_min = p_rs->def_rule;
+    for (i = 0; i < p_rs->rule_num; i++) {
+        if (p_rs->rules[i].pri != p_rs->def_rule) {
+            p_tree->pri_min = MIN(p_tree->pri_min, p_rs->rules[i].pri);
+            rule_id[rule_num++] = i;
+        }
+    }
+
+    ret = f_hc_grow((void **)&p_tree->p_node, &p_ctx->node_cap, 1,
+            sizeof(*p_tree->p_node));
+    if (!ret) {
+        p_tree->node_num = 1;
+        ret = f_hc_node(p_ctx, 0, box, rule_id, rule_num, 1);
+    }
+
+    if (ret) {
+        fprintf(stderr, "Cannot build the tree of subset %d\n", cur);
+    }
+
+    free(p_ctx->marks);
+    free(rule_id);
+
+    return ret;
+}
+
+/*
+ * Build node id over box from its rules, in priority order. Its children
+ * are built depth first, so the node array may move under the recursion.
+ */
+static int f_hc_node(struct hc_context *p_ctx, uint32_t id,
+        uint32_t (*box)[2], const int *rule_id, int rule_num, int depth)
+{
+    int i, j, d, ret = 0, bit_num, cell, cell_num, live_num = 0, push_num = 0;
+    int bits[DIM_MAX], shifts[DIM_MAX], *offs, *lens, *ids, *heads;
+    uint32_t cell_box[DIM_MAX][2], child_box[DIM_MAX][2], child;
+    struct hc_tree *p_tree = p_ctx->p_tree;
+    const struct rule *rules = p_ctx->p_rs->rules;
+    struct hc_node *p_node;
+
+    p_tree->depth_max = MAX(p_tree->depth_max, depth);
+
+    /* a rule covering the box hides all the rules after it */
+    rule_num = f_hc_cover(rules, rule_id, rule_num, box);
+
+    /* region compaction: the box shrinks to the rules in it */
+    p_node = &p_tree->p_node[id];
+    for (d = 0; d < DIM_MAX; d++) {
+        p_node->lo[d] = box[d][1];
+        p_node->hi[d] = box[d][0];
+        for (i = 0; i < rule_num; i++) {
+            p_node->lo[d] = MIN(p_node->lo[d],
+                    MAX(rules[rule_id[i]].dims[d][0], box[d][0]));
+            p_node->hi[d] = MAX(p_node->hi[d],
+                    MIN(rules[rule_id[i]].dims[d][1], box[d][1]));
+        }
+
+        if (!rule_num) {
+            p_node->lo[d] = box[d][0];
+            p_node->hi[d] = box[d][1];
+        }
+
+        box[d][0] = p_node->lo[d];
+        box[d][1] = p_node->hi[d];
+    }
+
+    /* a merged child may cover the whole box, so depth is bounded too */
+    bit_num = rule_num <= p_ctx->binth || depth >= HC_DEPTH_MAX ? 0 :
+        f_hc_cut(p_ctx, box, rule_id, rule_num, bits, shifts);
+    if (bit_num < 0) {
+        return bit_num;
+    }
+
+    if (!bit_num) {
+        return f_hc_leaf(p_ctx, id, rule_id, rule_num);
+    }
+
+    /* the rules of each cell, in priority order */
+    for (cell_num = 1, d = 0; d < DIM_MAX; d++) {
+        cell_num <<= bits[d];
+    }
+
+    offs = calloc(cell_num + 1, sizeof(*offs));
+    lens = malloc(cell_num * sizeof(*lens));
+    heads = malloc(cell_num * sizeof(*heads));
+    ids = offs && lens && heads ? malloc(f_hc_cells(rules, rule_id, rule_num,
+                box, bits, shifts, offs, NULL) * sizeof(*ids)) : NULL;
+    if (!ids) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    f_hc_cells(rules, rule_id, rule_num, box, bits, shifts, offs, ids);
+
+    for (cell = 0; cell < cell_num; cell++) {
+        lens[cell] = 0;
+        if (!f_hc_cell_box(cell_box, box, bits, shifts, cell)) {
+            continue;
+        }
+
+        live_num++;
+        lens[cell] = f_hc_cover(rules, &ids[offs[cell]],
+                offs[cell + 1] - offs[cell], cell_box);
+        for (i = 0; i < lens[cell]; i++) {
+            p_ctx->marks[ids[offs[cell] + i]]++;
+        }
+    }
+
+    /* rule pushing: the rules of all cells are searched at the node */
+    for (i = 0; i < rule_num; i++) {
+        if (p_ctx->marks[rule_id[i]] == live_num) {
+            push_num++;
+        }
+    }
+
+    if (push_num == rule_num) {
+        for (i = 0; i < rule_num; i++) {
+            p_ctx->marks[rule_id[i]] = 0;
+        }
+
+        ret = f_hc_leaf(p_ctx, id, rule_id, rule_num);
+        goto out;
+    }
+
+    ret = f_hc_grow((void **)&p_tree->p_rule, &p_ctx->rule_cap,
+            p_tree->rule_num + push_num, sizeof(*p_tree->p_rule));
+    if (!ret) {
+        ret = f_hc_grow((void **)&p_tree->p_child, &p_ctx->child_cap,
+                p_tree->child_num + cell_num, sizeof(*p_tree->p_child));
+    }
+
+    if (ret) {
+        goto out;
+    }
+
+    p_node = &p_tree->p_node[id];
+    p_node->rule = p_tree->rule_num;
+    p_node->rule_num = push_num;
+    p_node->child = p_tree->child_num;
+    for (d = 0; d < DIM_MAX; d++) {
+        p_node->bits[d] = bits[d];
+        p_node->shift[d] = shifts[d];
+    }
+
+    for (i = 0; i < rule_num; i++) {
+        const struct rule *p_rule = &rules[rule_id[i]];
+        struct hc_rule *p_hr = &p_tree->p_rule[p_tree->rule_num];
+
+        if (p_ctx->marks[rule_id[i]] != live_num) {
+            continue;
+        }
+
+        for (d = 0; d < DIM_MAX; d++) {
+            p_hr->lo[d] = p_rule->dims[d][0];
+            p_hr->hi[d] = p_rule->dims[d][1];
+        }
+
+        p_hr->pri = p_rule->pri;
+        p_tree->rule_num++;
+    }
+
+    for (cell = 0; cell < cell_num; cell++) {
+        for (i = j = 0; i < lens[cell]; i++) {
+            if (p_ctx->marks[ids[offs[cell] + i]] != live_num) {
+                ids[offs[cell] + j++] = ids[offs[cell] + i];
+            }
+        }
+
+        lens[cell] = j;
+    }
+
+    for (i = 0; i < rule_num; i++) {
+        p_ctx->marks[rule_id[i]] = 0;
+    }
+
+    /* node merging: cells of the same rules share the first one's child */
+    for (cell = 0; cell < cell_num; cell++) {
+        heads[cell] = cell;
+        for (i = 0; lens[cell] && i < cell; i++) {
+            if (heads[i] == i && lens[i] == lens[cell] &&
+                !memcmp(&ids[offs[i]], &ids[offs[cell]],
+                    lens[cell] * sizeof(*ids))) {
+                heads[cell] = i;
+                break;
+            }
+        }
+    }
+
+    child = p_tree->child_num;
+    p_tree->child_num += cell_num;
+
+    for (cell = 0; cell < cell_num; cell++) {
+        if (!lens[cell]) {
+            p_tree->p_child[child + cell] = HC_CHILD_EMPTY;
+            continue;
+
+        } else if (heads[cell] != cell) {
+            p_tree->p_child[child + cell] =
+                p_tree->p_child[child + heads[cell]];
+            continue;
+        }
+
+        /* the child covers all the cells merged into it */
+        f_hc_cell_box(child_box, box, bits, shifts, cell);
+        for (i = cell + 1; i < cell_num; i++) {
+            if (heads[i] != cell || !lens[i]) {
+                continue;
+            }
+
+            f_hc_cell_box(cell_box, box, bits, shifts, i);
+            for (d = 0; d < DIM_MAX; d++) {
+                child_box[d][0] = MIN(child_box[d][0], cell_box[d][0]);
+                child_box[d][1] = MAX(child_box[d][1], cell_box[d][1]);
+            }
+        }
+
+        if (p_tree->node_num == INT_MAX) {
+            ret = -E2BIG;
+            goto out;
+        }
+
+        ret = f_hc_grow((void **)&p_tree->p_node, &p_ctx->node_cap,
+                p_tree->node_num + 1, sizeof(*p_tree->p_node));
+        if (ret) {
+            goto out;
+        }
+
+        p_tree->p_child[child + cell] = p_tree->node_num++;
+        ret = f_hc_node(p_ctx, p_tree->p_child[child + cell], child_box,
+                &ids[offs[cell]], lens[cell], depth + 1);
+        if (ret) {
+            goto out;
+        }
+    }
+
+out:
+    free(ids);
+    free(heads);
+    free(lens);
+    free(offs);
+
+    return ret;
+}
+
+static int f_hc_leaf(struct hc_context *p_ctx, uint32_t id,
+        const int *rule_id, int rule_num)
+{
+    int i, d, ret;
+    struct hc_tree *p_tree = p_ctx->p_tree;
+    struct hc_node *p_node;
+
+    ret = f_hc_grow((void **)&p_tree->p_rule, &p_ctx->rule_cap,
+            p_tree->rule_num + rule_num, sizeof(*p_tree->p_rule));
+    if (ret) {
+        return ret;
+    }
+
+    p_node = &p_tree->p_node[id];
+    p_node->child = HC_LEAF;
+    p_node->rule = p_tree->rule_num;
+    p_node->rule_num = rule_num;
+    for (d = 0; d < DIM_MAX; d++) {
+        p_node->bits[d] = 0;
+        p_node->shift[d] = 32;
+    }
+
+    for (i = 0; i < rule_num; i++) {
+        const struct rule *p_rule = &p_ctx->p_rs->rules[rule_id[i]];
+        struct hc_rule *p_hr = &p_tree->p_rule[p_tree->rule_num++];
+
+        for (d = 0; d < DIM_MAX; d++) {
+            p_hr->lo[d] = p_rule->dims[d][0];
+            p_hr->hi[d] = p_rule->dims[d][1];
+        }
+
+        p_hr->pri = p_rule->pri;
+    }
+
+    return 0;
+}
+
+/*
+ * Choose the bits cut along each dimension: the dimensions of more distinct
+ * rule projections than the mean are cut, each as finely as the space
+ * factor allows, and the cuts of all are then bounded by the rule number.
+ * Return the bits of all dimensions, 0 if no cut helps, or -ENOMEM.
+ */
+static int f_hc_cut(const struct hc_context *p_ctx, uint32_t (*box)[2],
+        const int *rule_id, int rule_num, int *bits, int *shifts)
+{
+    int i, d, b, cap, dim_num = 0, bit_num = 0, widths[DIM_MAX];
+    long sum, mean = 0, distincts[DIM_MAX];
+    int64_t *keys;
+    const struct rule *rules = p_ctx->p_rs->rules;
+
+    keys = malloc(rule_num * sizeof(*keys));
+    if (!keys) {
+        return -ENOMEM;
+    }
+
+    for (d = 0; d < DIM_MAX; d++) {
+        bits[d] = 0;
+        shifts[d] = 32;
+        distincts[d] = 0;
+        widths[d] = box[d][1] - box[d][0] ?
+            32 - __builtin_clz(box[d][1] - box[d][0]) : 0;
+        if (!widths[d]) {
+            continue;
+        }
+
+        for (i = 0; i < rule_num; i++) {
+            const uint32_t *rng = rules[rule_id[i]].dims[d];
+
+            keys[i] = (int64_t)((uint64_t)MAX(rng[0], box[d][0]) << 32 |
+                    MIN(rng[1], box[d][1]));
+        }
+
+        QSORT(int64, keys, rule_num);
+        for (distincts[d] = i = 1; i < rule_num; i++) {
+            distincts[d] += keys[i] != keys[i - 1];
+        }
+
+        if (distincts[d] > 1) {
+            mean += distincts[d];
+            dim_num++;
+        }
+    }
+
+    free(keys);
+
+    if (!dim_num) {
+        return 0;
+    }
+
+    for (d = 0; d < DIM_MAX; d++) {
+        if (distincts[d] <= 1 || distincts[d] * dim_num < mean) {
+            continue;
+        }
+
+        for (b = 1; b <= widths[d] && b <= HC_CUT_BITS_MAX; b++) {
+            sum = f_hc_cut_sum(rules, rule_id, rule_num, box, d,
+                    widths[d] - b);
+            if (sum + (1L << b) > (long)HC_SPFAC * rule_num) {
+                break;
+            }
+        }
+
+        bits[d] = MAX(b - 1, 1);
+        bit_num += bits[d];
+    }
+
+    /* no more children than spfac * sqrt(n), as HyperCuts bounds them */
+    cap = __builtin_ctz(HC_SPFAC) + (31 - __builtin_clz(rule_num)) / 2;
+    cap = MAX(MIN(cap, HC_CUT_BITS_MAX), 1);
+    while (bit_num > cap) {
+        for (b = d = 0; d < DIM_MAX; d++) {
+            if (bits[d] > bits[b]) {
+                b = d;
+            }
+        }
+
+        bits[b]--;
+        bit_num--;
+    }
+
+    for (d = 0; d < DIM_MAX; d++) {
+        if (bits[d]) {
+            shifts[d] = widths[d] - bits[d];
+        }
+    }
+
+    return bit_num;
+}
+
+/* Rules in all cells of shift bits along dim */
+static long f_hc_cut_sum(const struct rule *rules, const int *rule_id,
+        int rule_num, uint32_t (*box)[2], int dim, int shift)
+{
+    int i;
+    long sum = 0;
+
+    for (i = 0; i < rule_num; i++) {
+        const uint32_t *rng = rules[rule_id[i]].dims[dim];
+
+        sum += ((MIN(rng[1], box[dim][1]) - box[dim][0]) >> shift) -
+            ((MAX(rng[0], box[dim][0]) - box[dim][0]) >> shift) + 1;
+    }
+
+    return sum;
+}
+
+/*
+ * Count the rules of each cell into offs, or with ids, append each rule to
+ * the cells it overlaps. Return the rules in all cells.
+ */
+static int f_hc_cells(const struct rule *rules, const int *rule_id,
+        int rule_num, uint32_t (*box)[2], const int *bits,
+        const int *shifts, int *offs, int *ids)
+{
+    int i, d, cell, total = 0, cell_num = 1;
+    int firsts[DIM_MAX], lasts[DIM_MAX], cur[DIM_MAX], pos[DIM_MAX];
+
+    for (d = DIM_MAX - 1; d >= 0; d--) {
+        pos[d] = cell_num;
+        cell_num <<= bits[d];
+    }
+
+    for (i = 0; i < rule_num; i++) {
+        const struct rule *p_rule = &rules[rule_id[i]];
+
+        for (d = 0; d < DIM_MAX; d++) {
+            firsts[d] = cur[d] = !bits[d] ? 0 :
+                (MAX(p_rule->dims[d][0], box[d][0]) - box[d][0]) >> shifts[d];
+            lasts[d] = !bits[d] ? 0 :
+                (MIN(p_rule->dims[d][1], box[d][1]) - box[d][0]) >> shifts[d];
+        }
+
+        /* every combination of the cells along each dimension */
+        for (;;) {
+            for (cell = d = 0; d < DIM_MAX; d++) {
+                cell += cur[d] * pos[d];
+            }
+
+            if (ids) {
+                ids[offs[cell]++] = rule_id[i];
+            } else {
+                offs[cell + 1]++;
+            }
+
+            total++;
+
+            for (d = DIM_MAX - 1; d >= 0 && cur[d] == lasts[d]; d--) {
+                cur[d] = firsts[d];
+            }
+
+            if (d < 0) {
+                break;
+            }
+
+            cur[d]++;
+        }
+    }
+
+    /* the counts become offsets, which the filling moves a cell forward */
+    if (!ids) {
+        for (cell = 0; cell < cell_num; cell++) {
+            offs[cell + 1] += offs[cell];
+        }
+
+    } else {
+        for (cell = cell_num; cell > 0; cell--) {
+            offs[cell] = offs[cell - 1];
+        }
+
+        offs[0] = 0;
+    }
+
+    return total;
+}
+
+/* The box of a cell, or 0 if the cell lies past the end of box */
+static int f_hc_cell_box(uint32_t (*cell_box)[2], uint32_t (*box)[2],
+        const int *bits, const int *shifts, int cell)
+{
+    int d;
+    uint64_t idx, lo, hi;
+
+    for (d = DIM_MAX - 1; d >= 0; d--) {
+        idx = cell & ((1 << bits[d]) - 1);
+        cell >>= bits[d];
+
+        if (!bits[d]) {
+            cell_box[d][0] = box[d][0];
+            cell_box[d][1] = box[d][1];
+            continue;
+        }
+
+        lo = box[d][0] + (idx << shifts[d]);
+        hi = lo + (1ULL << shifts[d]) - 1;
+        if (lo > box[d][1]) {
+            return 0;
+        }
+
+        cell_box[d][0] = lo;
+        cell_box[d][1] = MIN(hi, (uint64_t)box[d][1]);
+    }
+
+    return 1;
+}
+
+/* The rules up to the first one covering box */
+static int f_hc_cover(const struct rule *rules, const int *rule_id,
+        int rule_num, uint32_t (*box)[2])
+{
+    int i, d;
+
+    for (i = 0; i < rule_num; i++) {
+        const struct rule *p_rule = &rules[rule_id[i]];
+
+        for (d = 0; d < DIM_MAX; d++) {
+            if (p_rule->dims[d][0] > box[d][0] ||
+                p_rule->dims[d][1] < box[d][1]) {
+                break;
+            }
+        }
+
+        if (d == DIM_MAX) {
+            return i + 1;
+        }
+    }
+
+    return rule_num;
+}
+
+/* Make room for num elements in the array at *pp */
+static int f_hc_grow(void **pp, int *p_cap, int num, size_t size)
+{
+    int cap = *p_cap;
+    void *p;
+
+    if (num <= cap) {
+        return 0;
+    }
+
+    while (cap < num) {
+        cap = cap ? cap << 1 : 64;
+        if (cap <= 0) {
+            return -E2BIG;
+        }
+    }
+
+    p = realloc(*pp, cap * size);
+    if (!p) {
+        return -ENOMEM;
+    }
+
+    *pp = p;
+    *p_cap = cap;
+
+    return 0;
+}
+
+static inline int f_hc_lookup(const struct packet *p_pkt,
+        const struct hc_result *p_hc_result)
+{
+    int i, d, pri = p_hc_result->def_rule;
+    uint32_t id, idx, r, end;
+    const uint32_t *dims = p_pkt->dims;
+    const struct hc_tree *p_tree;
+    const struct hc_node *p_node;
+    const struct hc_rule *p_hr;
+
+    for (i = 0; i < p_hc_result->tree_num &&
+        p_hc_result->trees[i].pri_min < pri; i++) {
+        p_tree = &p_hc_result->trees[i];
+
+        for (id = 0; ; ) {
+            p_node = &p_tree->p_node[id];
+
+            for (d = 0; d < DIM_MAX; d++) {
+                if (dims[d] < p_node->lo[d] || dims[d] > p_node->hi[d]) {
+                    break;
+                }
+            }
+
+            if (d < DIM_MAX) {
+                break;
+            }
+
+            /* the rules are in priority order: the first match is the best */
+            end = p_node->rule + p_node->rule_num;
+            for (r = p_node->rule; r < end; r++) {
+                p_hr = &p_tree->p_rule[r];
+                if (p_hr->pri >= pri) {
+                    break;
+                }
+
+                for (d = 0; d < DIM_MAX; d++) {
+                    if (dims[d] < p_hr->lo[d] || dims[d] > p_hr->hi[d]) {
+                        break;
+                    }
+                }
+
+                if (d == DIM_MAX) {
+                    pri = p_hr->pri;
+                    break;
+                }
+            }
+
+            if (p_node->child == HC_LEAF) {
+                break;
+            }
+
+            for (idx = d = 0; d < DIM_MAX; d++) {
+                idx = idx << p_node->bits[d] |
+                    (uint32_t)((uint64_t)(dims[d] - p_node->lo[d]) >>
+                            p_node->shift[d]);
+            }
+
+            id = p_tree->p_child[p_node->child + idx];
+            if (id == HC_CHILD_EMPTY) {
+                break;
+            }
+        }
+    }
+
+    return pri;
+}
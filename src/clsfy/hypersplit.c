@@ -14,12 +14,20 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
 #include <float.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/queue.h>
+#include <immintrin.h>
 
 #include "common/impl.h"
 #include "common/utils.h"
@@ -28,79 +36,193 @@
 
 struct hs_queue_entry {
     uint32_t space[DIM_MAX][2];
-    STAILQ_ENTRY(hs_queue_entry) e;
-    ssize_t node_id;
-    int *rule_id;
+    TAILQ_ENTRY(hs_queue_entry) e;
+    struct hs_build_node *p_node;
+    int *rule_id; /* follows the entry in the same block */
+    int *rule_ends[DIM_MAX]; /* sorted endpoints, in the block of rule_id */
     int rule_num;
     int depth;
+    int cur; /* subset of the tree */
 };
 
-STAILQ_HEAD(hs_queue_head, hs_queue_entry);
+TAILQ_HEAD(hs_queue_head, hs_queue_entry);
+
+struct hs_context {
+    struct hs_runtime *hs_rts;
+    const struct partition *p_pa;
+    struct hs_tree *trees;
+    struct hs_build_node **roots;
+    int *pend_nums; /* unfinished work items of each tree */
+    int pend_num; /* unfinished work items of all trees */
+    int thread_num;
+    int binth; /* most rules of a leaf bucket, 0 for none */
+    int measure;
+    int ret; /* the first failure of all threads */
+};
 
 struct hs_runtime {
     struct shadow_range shadow_rngs[DIM_MAX];
     int64_t *shadow_pnts[DIM_MAX];
-    struct hsn_pool node_pool;
-    struct hs_queue_head wqh;
-    const struct partition *p_pa;
-    struct hs_tree *trees;
-    int cur;
+    uint8_t *marks; /* rules of the child being spawned */
+    struct hsbn_pool node_pool;
+    struct gsmpool item_pool; /* work items with their rule blocks */
+    struct gsmpool bucket_pool; /* rules of leaf buckets, kept till the end */
+    struct hs_queue_head wqh; /* the owner works on head, thieves on tail */
+    pthread_spinlock_t lock;
+    struct hs_context *p_ctx;
+    pthread_t tid;
+    int id;
+};
+
+struct hs_gather_entry {
+    const struct hs_build_node *p_bnode;
+    uint32_t parent;
+    int side; /* -1 for the root */
+    int depth;
+};
+
+/*
+ * Trees walked HS_SIMD_LANES_MAX at a time: node arrays are addressed by
+ * 32-bit byte offsets to base, and the lanes past tree_num never walk.
+ */
+struct hs_simd {
+    int (*lookup)(const struct packet *p_pkt, const struct hs_simd *p_simd);
+    const char *base;
+    int32_t *roots; /* byte offset of the first node of each tree */
+    int32_t *pri_mins;
+    uint32_t *offsets; /* children from it on are nodes */
+    const struct hs_bucket_rule **buckets;
+    hs_bucket_match_t bucket_match;
+    int tree_num;
+    int lanes;
+    uint32_t def_rule;
+};
+
+struct hs_pack_runtime {
+    const struct hs_node *p_root;
+    struct hs_pack_node *blks;
+    uint32_t *blk_node; /* block index -> binary node id of its root */
+    uint32_t offset;
+    int blk_num;
 };
 
 
-static int f_hs_init(struct hs_runtime *p_hs_rt, const struct partition *p_pa);
-static void f_hs_term(struct hs_runtime *p_hs_rt);
+static int f_hs_init(struct hs_context *p_ctx, const struct partition *p_pa,
+        int thread_num, int binth, int measure);
+static void f_hs_term(struct hs_context *p_ctx);
+static void *f_hs_worker(void *arg);
+
+static void f_hs_enqueue(struct hs_runtime *p_hs_rt,
+        struct hs_queue_entry *p_wqe);
+static struct hs_queue_entry *f_hs_dequeue(struct hs_runtime *p_hs_rt);
+static struct hs_queue_entry *f_hs_steal(struct hs_runtime *p_hs_rt);
 
-static int f_hs_trigger(struct hs_runtime *p_hs_rt);
-static int f_hs_process(struct hs_runtime *p_hs_rt);
-static int f_hs_gather(struct hs_runtime *p_hs_rt);
+static int f_hs_trigger(struct hs_context *p_ctx, int cur);
+static int f_hs_process(struct hs_runtime *p_hs_rt,
+        struct hs_queue_entry *p_wqe);
+static int f_hs_gather(struct hs_context *p_ctx, int cur);
 
 static int f_hs_dim_decision(struct hs_runtime *p_hs_rt,
         const struct hs_queue_entry *p_wqe);
 static uint32_t f_hs_pnt_decision(const struct shadow_range *p_shadow_rng);
 static int f_hs_spawn(struct hs_runtime *p_hs_rt, struct hs_queue_entry *p_wqe,
-        int split_dim, int is_inplace);
+        int split_dim, int is_inplace, struct hs_queue_entry **pp_child);
+static struct hs_queue_entry *f_hs_item_alloc(struct hs_runtime *p_hs_rt,
+        int rule_num, int is_sorted);
 
 static int f_space_is_fully_covered(uint32_t (*left)[2], uint32_t (*right)[2]);
-
-
-int hs_build(void *built_result, const struct partition *p_pa)
+static void f_hs_bucket_fill(struct hs_bucket_rule *p_br,
+        const struct rule_set *p_rs, const int *rule_id, int rule_num);
+static int f_hs_bucket_match(const struct hs_bucket_rule *p_br,
+        const uint32_t *dims, int pri);
+static int f_hs_bucket_match_avx2(const struct hs_bucket_rule *p_br,
+        const uint32_t *dims, int pri);
+static hs_bucket_match_t f_hs_bucket_matcher(void);
+
+static inline int f_hs_lookup(const struct packet *p_pkt,
+        const struct hs_result *p_hs_result);
+static void f_hs_lookup_batch(int *pri, const struct packet *pkts, int pkt_num,
+        const struct hs_result *p_hs_result, long cache_size);
+static int f_hs_search_misses(const struct packet *misses, const int *miss_id,
+        struct flow_bucket **buckets, int miss_num,
+        const struct hs_result *p_hs_result, struct flow_cache *p_fc,
+        long cache_size);
+static inline size_t f_hs_tree_size(const struct hs_tree *p_tree);
+
+static int f_hs_merge_block(struct hs_result *p_hs_result);
+static int f_hs_simd_init(struct hs_simd *p_simd,
+        const struct hs_result *p_hs_result);
+static void f_hs_simd_term(struct hs_simd *p_simd);
+static int f_hs_simd_resolve(const struct hs_simd *p_simd,
+        const uint32_t *leaves, int j, int lanes, const uint32_t *dims,
+        int pri);
+static int f_hs_lookup_avx512(const struct packet *p_pkt,
+        const struct hs_simd *p_simd);
+static int f_hs_lookup_avx512_pack(const struct packet *p_pkt,
+        const struct hs_simd *p_simd);
+static int f_hs_lookup_avx2(const struct packet *p_pkt,
+        const struct hs_simd *p_simd);
+static int f_hs_lookup_avx2_pack(const struct packet *p_pkt,
+        const struct hs_simd *p_simd);
+
+static int f_hs_write(FILE *fp, const void *p, size_t size, uint64_t *p_off);
+
+static int f_hs_dag_tree(struct hs_tree *p_tree, uint32_t def_rule);
+static int f_hs_dag_buckets(struct hs_tree *p_tree, uint32_t def_rule,
+        uint32_t *bucket_map);
+static inline uint64_t f_hs_dag_hash(uint64_t a, uint64_t b);
+
+static int f_hs_pack_tree(struct hs_tree *p_tree, uint32_t offset);
+static void f_hs_pack_fill(struct hs_pack_runtime *p_pack_rt, int blk,
+        int slot, uint32_t ref);
+static inline uint32_t f_hs_pack_step(const struct hs_pack_node *p_blk,
+        const uint32_t *dims);
+
+
+int hs_build(void *built_result, const struct partition *p_pa, int thread_num,
+        int binth, int measure)
 {
-    int ret;
-    struct hs_runtime hs_rt;
+    int i, ret, inode_num = 0, bucket_num = 0, bucket_rule_num = 0;
+    struct hs_context ctx;
     struct hs_result *p_hs_result;
 
     if (!built_result || !p_pa || !p_pa->subsets || p_pa->subset_num <= 0 ||
-        p_pa->subset_num > PART_MAX || p_pa->rule_num <= 1) {
+        p_pa->rule_num <= 1 || thread_num <= 0 || binth < 0 ||
+        measure <= HS_MEASURE_INV || measure >= HS_MEASURE_MAX) {
         return -EINVAL;
     }
 
-    /* Init */
-    ret = f_hs_init(&hs_rt, p_pa);
+    /* Init: each thread has its own runtime */
+    ret = f_hs_init(&ctx, p_pa, thread_num, binth, measure);
     if (ret) {
         return ret;
     }
 
-    /* Build hypersplit tree for each subset */
-    for (hs_rt.cur = 0; hs_rt.cur < p_pa->subset_num; hs_rt.cur++) {
-
-        /* trigger entry enqueue */
-        ret = f_hs_trigger(&hs_rt);
+    /* trigger entry enqueue */
+    for (i = 0; i < p_pa->subset_num; i++) {
+        ret = f_hs_trigger(&ctx, i);
         if (ret) {
             goto err;
         }
+    }
 
-        /* hypersplit building */
-        ret = f_hs_process(&hs_rt);
-        if (ret) {
-            goto err;
+    /* hypersplit building: work items of all trees are stolen among threads */
+    for (i = 1; i < ctx.thread_num; i++) {
+        if (pthread_create(&ctx.hs_rts[i].tid, NULL, f_hs_worker,
+            &ctx.hs_rts[i])) {
+            break; /* running threads steal the work of the others */
         }
+    }
 
-        /* write subset result */
-        ret = f_hs_gather(&hs_rt);
-        if (ret) {
-            goto err;
-        }
+    f_hs_worker(&ctx.hs_rts[0]);
+
+    while (--i > 0) {
+        pthread_join(ctx.hs_rts[i].tid, NULL);
+    }
+
+    ret = ctx.ret;
+    if (ret) {
+        goto err;
     }
 
     /* Write final result */
@@ -110,35 +232,59 @@ int hs_build(void *built_result, const struct partition *p_pa)
         goto err;
     }
 
-    p_hs_result->trees = hs_rt.trees;
-    hs_rt.trees = NULL;
+    for (i = 0; i < p_pa->subset_num; i++) {
+        inode_num += ctx.trees[i].inode_num;
+        bucket_num += ctx.trees[i].bucket_num;
+        bucket_rule_num += ctx.trees[i].bucket_rule_num;
+    }
+
+    fprintf(stderr, "%d nodes (%zu bytes), %d buckets of %d rules (%zu bytes)\n",
+            inode_num, inode_num * sizeof(struct hs_node), bucket_num,
+            bucket_rule_num, bucket_rule_num * sizeof(struct hs_bucket_rule));
+
+    /* Trees with better rules first: any order gives the same matches */
+    QSORT(hs_tree, ctx.trees, p_pa->subset_num);
+
+    p_hs_result->trees = ctx.trees;
+    ctx.trees = NULL;
     p_hs_result->tree_num = p_pa->subset_num;
     p_hs_result->def_rule = p_pa->subsets[0].def_rule;
+    p_hs_result->p_map = NULL;
+    p_hs_result->map_size = 0;
+    p_hs_result->p_block = NULL;
+    p_hs_result->p_simd = NULL;
+    p_hs_result->bucket_match = f_hs_bucket_matcher();
     *(typeof(p_hs_result) *)built_result = p_hs_result;
 
     /* Term */
-    f_hs_term(&hs_rt);
+    f_hs_term(&ctx);
 
     return 0;
 
 err:
-    while (--hs_rt.cur >= 0) {
-        free(hs_rt.trees[hs_rt.cur].p_root);
-    }
-
-    f_hs_term(&hs_rt);
+    f_hs_term(&ctx);
 
     return ret;
 }
 
-int hs_search(const struct trace *p_t, const void *built_result)
+/* The best rule a packet matches over all trees, one tree after another */
+int hs_lookup(const struct packet *p_pkt, const void *built_result)
 {
-    int i, j, pri;
     const struct hs_result *p_hs_result;
 
-    register uint32_t id, offset;
-    register const struct packet *p_pkt;
-    register const struct hs_node *p_node, *p_root;
+    assert(p_pkt && built_result);
+
+    p_hs_result = *(typeof(p_hs_result) *)built_result;
+
+    return f_hs_lookup(p_pkt, p_hs_result);
+}
+
+int hs_search_batch(const struct trace *p_t, const void *built_result)
+{
+    long cache_size;
+    int i, j, pkt_num, pri[HS_BATCH_SIZE];
+    const struct hs_result *p_hs_result;
+    const struct packet *pkts;
 
     if (!p_t || !p_t->pkts || !built_result) {
         return -EINVAL;
@@ -149,417 +295,2415 @@ int hs_search(const struct trace *p_t, const void *built_result)
         return -EINVAL;
     }
 
-    /* For each packet */
-    offset = p_hs_result->def_rule + 1;
-    for (i = 0; i < p_t->pkt_num; i++) {
+    cache_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (cache_size <= 0) {
+        cache_size = HS_BATCH_CACHE_SIZE;
+    }
 
-        /* For each tree */
-        pri = p_hs_result->def_rule, p_pkt = &p_t->pkts[i];
-        for (j = 0; j < p_hs_result->tree_num; j++) {
+    /* For each batch of packets */
+    for (i = 0; i < p_t->pkt_num; i += HS_BATCH_SIZE) {
+        pkts = &p_t->pkts[i];
+        pkt_num = p_t->pkt_num - i < HS_BATCH_SIZE ?
+            p_t->pkt_num - i : HS_BATCH_SIZE;
 
-            /* For each node */
-            id = offset, p_root = p_hs_result->trees[j].p_root;
-            do {
-                p_node = p_root + id - offset;
-                id = p_pkt->dims[p_node->dim] <= p_node->thresh ?
-                    p_node->lchild : p_node->rchild;
-            } while (id >= offset);
+        f_hs_lookup_batch(pri, pkts, pkt_num, p_hs_result, cache_size);
 
-            if (id < pri) {
-                pri = id;
+        for (j = 0; j < pkt_num; j++) {
+            if (pri[j] != pkts[j].match_rule &&
+                pkts[j].match_rule != TRACE_MATCH_UNKNOWN) {
+                fprintf(stderr, "packet %d match %d, but should match %d\n",
+                        i + j, pri[j], pkts[j].match_rule);
+                return -EFAULT;
             }
         }
-
-        if (pri != p_t->pkts[i].match_rule) {
-            fprintf(stderr, "packet %d match %d, but should match %d\n",
-                    i, pri, p_t->pkts[i].match_rule);
-            return -EFAULT;
-        }
     }
 
     return 0;
 }
 
-void hs_destroy(void *built_result)
+/* Each packet walks several trees at once in the vector lanes */
+int hs_lookup_simd(const struct packet *p_pkt, const void *built_result)
+{
+    const struct hs_simd *p_simd;
+    const struct hs_result *p_hs_result;
+
+    assert(p_pkt && built_result);
+
+    /* the descriptor is built by hs_merge */
+    p_hs_result = *(typeof(p_hs_result) *)built_result;
+    p_simd = p_hs_result->p_simd;
+    assert(p_simd);
+
+    return p_simd->lookup ? p_simd->lookup(p_pkt, p_simd) :
+        f_hs_lookup(p_pkt, p_hs_result);
+}
+
+/* Trees walked at once by hs_lookup_simd, or 0 if it falls back to scalar */
+int hs_simd_lanes(const void *built_result)
+{
+    const struct hs_result *p_hs_result;
+
+    if (!built_result) {
+        return -EINVAL;
+    }
+
+    p_hs_result = *(typeof(p_hs_result) *)built_result;
+    if (!p_hs_result || !p_hs_result->trees) {
+        return -EINVAL;
+    }
+
+    if (!p_hs_result->p_simd || !p_hs_result->p_simd->lookup) {
+        return 0;
+    }
+
+    return p_hs_result->p_simd->lanes;
+}
+
+/* Bytes of the trees as searched: their nodes or blocks, and buckets */
+size_t hs_memory(const void *built_result)
 {
     int i;
-    struct hs_result *p_hs_result;
+    size_t size;
+    const struct hs_tree *p_tree;
+    const struct hs_result *p_hs_result;
 
     if (!built_result) {
-        return;
+        return 0;
     }
 
     p_hs_result = *(typeof(p_hs_result) *)built_result;
     if (!p_hs_result || !p_hs_result->trees) {
-        return;
+        return 0;
     }
 
+    size = p_hs_result->tree_num * sizeof(*p_hs_result->trees);
     for (i = 0; i < p_hs_result->tree_num; i++) {
-        free(p_hs_result->trees[i].p_root);
+        p_tree = &p_hs_result->trees[i];
+        size += p_tree->p_pack ? p_tree->pack_num * sizeof(*p_tree->p_pack) :
+            p_tree->inode_num * sizeof(*p_tree->p_root);
+        size += p_tree->bucket_rule_num * sizeof(*p_tree->p_bucket);
     }
 
-    free(p_hs_result->trees);
-    free(p_hs_result);
-
-    return;
+    return size;
 }
 
-static int f_hs_init(struct hs_runtime *p_hs_rt, const struct partition *p_pa)
+/*
+ * Search the flow cache first, and the trees on a miss. With is_batch the
+ * missed packets are gathered and walk the trees in batches.
+ */
+int hs_search_cache(const struct trace *p_t, const void *built_result,
+        struct flow_cache *p_fc, int is_batch)
 {
-    int i, null_flag = 0;
-    struct hs_tree *trees;
-    int64_t **shadow_pnts;
-    struct shadow_range *shadow_rngs;
+    long cache_size;
+    int i, pri, ret, miss_num = 0, miss_id[HS_BATCH_SIZE];
+    struct flow_bucket *p_fb, *buckets[HS_BATCH_SIZE];
+    struct packet misses[HS_BATCH_SIZE];
+    const struct hs_result *p_hs_result;
+    const struct packet *p_pkt;
 
-    shadow_pnts = p_hs_rt->shadow_pnts;
-    shadow_rngs = p_hs_rt->shadow_rngs;
-    for (i = 0; i < DIM_MAX; i++) {
-        shadow_pnts[i] = malloc((p_pa->rule_num << 1) *
-                sizeof(*shadow_pnts[i]));
-        shadow_rngs[i].pnts = malloc((p_pa->rule_num << 2) *
-                sizeof(*shadow_rngs[i].pnts));
-        shadow_rngs[i].cnts = malloc((p_pa->rule_num << 1) *
-                sizeof(*shadow_rngs[i].cnts));
-        if (!shadow_pnts[i] || !shadow_rngs[i].pnts || !shadow_rngs[i].cnts) {
-            null_flag = 1;
-        }
+    if (!p_t || !p_t->pkts || !built_result || !p_fc) {
+        return -EINVAL;
     }
 
-    trees = calloc(p_pa->subset_num, sizeof(*trees));
-    if (null_flag || !trees) {
-        free(trees);
+    p_hs_result = *(typeof(p_hs_result) *)built_result;
+    if (!p_hs_result || !p_hs_result->trees) {
+        return -EINVAL;
+    }
+
+    cache_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (cache_size <= 0) {
+        cache_size = HS_BATCH_CACHE_SIZE;
+    }
+
+    /* For each packet */
+    for (i = 0; i < p_t->pkt_num; i++) {
+        p_pkt = &p_t->pkts[i];
+        p_fb = flow_cache_bucket(p_fc, p_pkt->dims);
+
+        pri = flow_cache_lookup(p_fc, p_fb, p_pkt->dims);
+        if (pri == -1 && is_batch) {
+            buckets[miss_num] = p_fb;
+            misses[miss_num] = *p_pkt;
+            miss_id[miss_num++] = i;
+            if (miss_num == HS_BATCH_SIZE) {
+                ret = f_hs_search_misses(misses, miss_id, buckets, miss_num,
+                        p_hs_result, p_fc, cache_size);
+                if (ret) {
+                    return ret;
+                }
+
+                miss_num = 0;
+            }
+
+            continue;
 
-        for (i = 0; i < DIM_MAX; i++) {
-            free(shadow_rngs[i].cnts);
-            free(shadow_rngs[i].pnts);
-            free(shadow_pnts[i]);
+        } else if (pri == -1) {
+            pri = f_hs_lookup(p_pkt, p_hs_result);
+            flow_cache_insert(p_fc, p_fb, p_pkt->dims, pri);
         }
 
-        return -ENOMEM;
+        if (pri != p_pkt->match_rule &&
+            p_pkt->match_rule != TRACE_MATCH_UNKNOWN) {
+            fprintf(stderr, "packet %d match %d, but should match %d\n",
+                    i, pri, p_pkt->match_rule);
+            return -EFAULT;
+        }
     }
 
-    MPOOL_INIT(&p_hs_rt->node_pool, p2roundup(p_pa->rule_num) << 1);
-    STAILQ_INIT(&p_hs_rt->wqh);
-    p_hs_rt->p_pa = p_pa;
-    p_hs_rt->trees = trees;
+    if (miss_num) {
+        return f_hs_search_misses(misses, miss_id, buckets, miss_num,
+                p_hs_result, p_fc, cache_size);
+    }
 
     return 0;
 }
 
-static void f_hs_term(struct hs_runtime *p_hs_rt)
+int hs_pack(void *built_result)
 {
-    int i;
-    struct hs_queue_head *p_wqh = &p_hs_rt->wqh;
-    int64_t **shadow_pnts = p_hs_rt->shadow_pnts;
-    struct shadow_range *shadow_rngs = p_hs_rt->shadow_rngs;
+    int i, ret, inode_num = 0, pack_num = 0;
+    struct hs_result *p_hs_result;
+
+    if (!built_result) {
+        return -EINVAL;
+    }
 
-    while (!STAILQ_EMPTY(p_wqh)) {
-        struct hs_queue_entry *p_wqe = STAILQ_FIRST(p_wqh);
-        STAILQ_REMOVE_HEAD(p_wqh, e);
-        free(p_wqe->rule_id);
-        free(p_wqe);
+    /* the nodes of a loaded or merged classifier stay where they are */
+    p_hs_result = *(typeof(p_hs_result) *)built_result;
+    if (!p_hs_result || !p_hs_result->trees || p_hs_result->p_map ||
+        p_hs_result->p_block) {
+        return -EINVAL;
     }
 
-    MPOOL_TERM(&p_hs_rt->node_pool);
-    free(p_hs_rt->trees);
+    for (i = 0; i < p_hs_result->tree_num; i++) {
+        struct hs_tree *p_tree = &p_hs_result->trees[i];
+        if (p_tree->p_pack) {
+            continue;
+        }
+
+        ret = f_hs_pack_tree(p_tree,
+                p_hs_result->def_rule + 1 + p_tree->bucket_rule_num);
+        if (ret) {
+            return ret;
+        }
 
-    for (i = 0; i < DIM_MAX; i++) {
-        free(shadow_rngs[i].cnts);
-        free(shadow_rngs[i].pnts);
-        free(shadow_pnts[i]);
+        inode_num += p_tree->inode_num;
+        pack_num += p_tree->pack_num;
     }
 
-    return;
+    fprintf(stderr, "%d nodes (%zu bytes) packed into %d blocks (%zu bytes)\n",
+            inode_num, inode_num * sizeof(struct hs_node),
+            pack_num, pack_num * sizeof(struct hs_pack_node));
+
+    return 0;
 }
 
-static int f_hs_trigger(struct hs_runtime *p_hs_rt)
+/*
+ * Hash-cons each binary tree into a DAG: identical buckets are stored once,
+ * and so are identical subtrees, bottom up. Nodes stay in one array.
+ */
+int hs_dag(void *built_result)
 {
-    ssize_t node_id;
-    struct hs_tree *p_tree;
-    const struct rule_set *p_rs;
-    static uint32_t space[DIM_MAX][2] = {
-        {0, UINT32_MAX}, {0, UINT32_MAX},
-        {0, UINT16_MAX}, {0, UINT16_MAX},
-        {0, UINT8_MAX}
-    };
-
-    assert(p_hs_rt && p_hs_rt->trees);
-    assert(p_hs_rt->p_pa->subsets[p_hs_rt->cur].rules);
-    assert(p_hs_rt->p_pa->subsets[p_hs_rt->cur].rule_num > 1);
+    int i, ret, inode_num = 0, bucket_rule_num = 0;
+    int dag_inode_num = 0, dag_bucket_rule_num = 0;
+    struct hs_result *p_hs_result;
 
-    MPOOL_RESET(&p_hs_rt->node_pool);
-    node_id = MPOOL_MALLOC(hsn_pool, &p_hs_rt->node_pool);
-    if (node_id == -1) {
-        return -ENOMEM;
+    if (!built_result) {
+        return -EINVAL;
     }
 
-    p_tree = &p_hs_rt->trees[p_hs_rt->cur];
-    p_rs = &p_hs_rt->p_pa->subsets[p_hs_rt->cur];
+    /* packed blocks address their children relatively, so are not shared */
+    p_hs_result = *(typeof(p_hs_result) *)built_result;
+    if (!p_hs_result || !p_hs_result->trees || p_hs_result->p_map ||
+        p_hs_result->p_block) {
+        return -EINVAL;
+    }
 
-    /* There is no need to build trees: only the tree root */
-    if (f_space_is_fully_covered(space, p_rs->rules[0].dims)) {
-        struct hs_node *p_root = MPOOL_ADDR(&p_hs_rt->node_pool, node_id);
-        p_root->thresh = UINT32_MAX;
-        p_root->dim = DIM_SIP;
-        p_root->lchild = p_rs->rules[0].pri;
-        p_tree->inode_num = p_tree->enode_num = p_tree->depth_max = 1;
-        p_tree->depth_avg = 1.0;
+    for (i = 0; i < p_hs_result->tree_num; i++) {
+        struct hs_tree *p_tree = &p_hs_result->trees[i];
 
-    /* The tree root needs split */
-    } else {
-        int i, *rule_id = malloc(p_rs->rule_num * sizeof(*rule_id));
-        struct hs_queue_entry *p_wqe = malloc(sizeof(*p_wqe));
-        if (!rule_id || !p_wqe) {
-            free(p_wqe);
-            free(rule_id);
-            return -ENOMEM;
+        if (p_tree->p_pack) {
+            return -EINVAL;
         }
 
-        for (i = 0; i < p_rs->rule_num; i++) {
-            rule_id[i] = i;
+        inode_num += p_tree->inode_num;
+        bucket_rule_num += p_tree->bucket_rule_num;
+
+        ret = f_hs_dag_tree(p_tree, p_hs_result->def_rule);
+        if (ret) {
+            return ret;
         }
-        memcpy(p_wqe->space, space, sizeof(space));
-        p_wqe->node_id = node_id;
-        p_wqe->rule_id = rule_id;
-        p_wqe->rule_num = p_rs->rule_num;
-        p_wqe->depth = 1;
-        p_tree->inode_num++;
-        STAILQ_INSERT_HEAD(&p_hs_rt->wqh, p_wqe, e);
+
+        dag_inode_num += p_tree->inode_num;
+        dag_bucket_rule_num += p_tree->bucket_rule_num;
     }
 
+    fprintf(stderr, "%d nodes and %d bucket rules (%zu bytes) shared as "
+            "%d nodes and %d bucket rules (%zu bytes)\n", inode_num,
+            bucket_rule_num, inode_num * sizeof(struct hs_node) +
+            bucket_rule_num * sizeof(struct hs_bucket_rule), dag_inode_num,
+            dag_bucket_rule_num, dag_inode_num * sizeof(struct hs_node) +
+            dag_bucket_rule_num * sizeof(struct hs_bucket_rule));
+
     return 0;
 }
 
-static int f_hs_process(struct hs_runtime *p_hs_rt)
+/*
+ * Move the node arrays of all trees into one block, in which hs_lookup_simd
+ * addresses them by 32-bit offsets, and keep the descriptor it walks them
+ * with. A loaded classifier is in one block already.
+ */
+int hs_merge(void *built_result)
 {
-    struct hs_queue_head *p_wqh;
-    struct hs_queue_entry *p_wqe;
-
-    /* The loop processes all internal nodes */
-    p_wqh = &p_hs_rt->wqh;
-    while (!STAILQ_EMPTY(p_wqh)) {
-        int split_dim;
-        struct hs_node *p_node;
-        uint32_t split_pnt, orig_end, *split_rng;
-
-        p_wqe = STAILQ_FIRST(p_wqh);
-        STAILQ_REMOVE_HEAD(p_wqh, e);
+    int ret;
+    struct hs_simd *p_simd;
+    struct hs_result *p_hs_result;
 
-        /* choose split dimension */
-        split_dim = f_hs_dim_decision(p_hs_rt, p_wqe);
-        if (split_dim == DIM_INV) {
-            goto err;
-        }
+    if (!built_result) {
+        return -EINVAL;
+    }
 
-        /* choose split point */
-        assert(split_dim > DIM_INV && split_dim < DIM_MAX);
-        split_pnt = f_hs_pnt_decision(&p_hs_rt->shadow_rngs[split_dim]);
+    p_hs_result = *(typeof(p_hs_result) *)built_result;
+    if (!p_hs_result || !p_hs_result->trees) {
+        return -EINVAL;
+    }
 
-        p_node = MPOOL_ADDR(&p_hs_rt->node_pool, p_wqe->node_id);
-        p_node->dim = split_dim;
-        p_node->thresh = split_pnt;
+    if (p_hs_result->p_simd) {
+        return 0;
+    }
 
-        /* process left child: require a new wqe */
-        split_rng = p_wqe->space[split_dim];
-        orig_end = split_rng[1], split_rng[1] = split_pnt;
-        if (f_hs_spawn(p_hs_rt, p_wqe, split_dim, 0)) {
-            goto err;
+    if (!p_hs_result->p_map && !p_hs_result->p_block) {
+        ret = f_hs_merge_block(p_hs_result);
+        if (ret) {
+            return ret;
         }
+    }
 
-        /* process right child: reuse current wqe */
-        split_rng[1] = orig_end, split_rng[0] = split_pnt + 1;
-        if (f_hs_spawn(p_hs_rt, p_wqe, split_dim, 1)) {
-            goto err;
-        }
+    p_simd = malloc(sizeof(*p_simd));
+    if (!p_simd) {
+        return -ENOMEM;
     }
 
-    return 0;
+    ret = f_hs_simd_init(p_simd, p_hs_result);
+    if (ret) {
+        free(p_simd);
+        return ret;
+    }
 
-err:
-    free(p_wqe->rule_id);
-    free(p_wqe);
+    p_hs_result->p_simd = p_simd;
 
-    return -ENOMEM;
+    return 0;
 }
 
-static int f_hs_gather(struct hs_runtime *p_hs_rt)
+int hs_save(const void *built_result, const char *s_file)
 {
-    struct hs_node *p_root;
-    struct hs_tree *p_tree;
-    struct hsn_pool *p_node_pool;
+    int i, ret;
+    FILE *fp;
+    uint64_t off;
+    struct hs_file_header hdr;
+    struct hs_file_tree *ftrees;
+    const struct hs_result *p_hs_result;
 
-    p_node_pool = &p_hs_rt->node_pool;
-    p_root = realloc(MPOOL_BASE(p_node_pool),
-            MPOOL_COUNT(p_node_pool) * sizeof(*p_root));
-    if (!p_root) {
-        return -ENOMEM;
+    if (!built_result || !s_file) {
+        return -EINVAL;
     }
 
-    MPOOL_BASE(p_node_pool) = NULL;
-    p_tree = &p_hs_rt->trees[p_hs_rt->cur];
-    p_tree->p_root = p_root;
-    p_tree->depth_avg /= p_tree->enode_num;
-    assert(p_tree->inode_num == MPOOL_COUNT(p_node_pool));
-    assert(p_tree->enode_num == p_tree->inode_num + 1);
+    p_hs_result = *(typeof(p_hs_result) *)built_result;
+    if (!p_hs_result || !p_hs_result->trees) {
+        return -EINVAL;
+    }
 
-    return 0;
-}
+    fprintf(stderr, "Saving classifier to %s\n", s_file);
 
-static int f_hs_dim_decision(struct hs_runtime *p_hs_rt,
-        const struct hs_queue_entry *p_wqe)
-{
-    int i, dim, pnt_num;
-    int64_t **shadow_pnts;
-    struct shadow_range *shadow_rngs;
-    const struct rule *rules;
-    /* float measure, measure_min = FLT_MAX; */
-    long measure, measure_min = LONG_MAX;
+    ftrees = calloc(p_hs_result->tree_num, sizeof(*ftrees));
+    if (!ftrees) {
+        return -ENOMEM;
+    }
 
-    assert(p_wqe && p_wqe->rule_id && p_wqe->rule_num > 1);
+    /* Lay out: header, tree entries, and then node arrays */
+    off = sizeof(hdr) + p_hs_result->tree_num * sizeof(*ftrees);
+    for (i = 0; i < p_hs_result->tree_num; i++) {
+        const struct hs_tree *p_tree = &p_hs_result->trees[i];
 
-    shadow_pnts = p_hs_rt->shadow_pnts;
-    shadow_rngs = p_hs_rt->shadow_rngs;
-    rules = p_hs_rt->p_pa->subsets[p_hs_rt->cur].rules;
+        if (p_tree->p_pack) {
+            off = ALIGN(off, HS_FILE_ALIGN);
+            ftrees[i].pack_off = off;
+            off += p_tree->pack_num * sizeof(*p_tree->p_pack);
 
-    for (dim = DIM_INV, i = 0; i < DIM_MAX; i++) {
-        if (shadow_rules(&shadow_rngs[i], shadow_pnts[i], p_wqe->space[i],
-            p_wqe->rule_id, p_wqe->rule_num, rules, i)) {
-            return DIM_INV;
+        } else {
+            off = ALIGN(off, HS_FILE_ALIGN);
+            ftrees[i].root_off = off;
+            off += p_tree->inode_num * sizeof(*p_tree->p_root);
         }
 
-        pnt_num = shadow_rngs[i].pnt_num;
-        if (pnt_num <= 2) { /* no more range */
-            continue;
+        if (p_tree->bucket_rule_num) {
+            off = ALIGN(off, HS_FILE_ALIGN);
+            ftrees[i].bucket_off = off;
+            off += p_tree->bucket_rule_num * sizeof(*p_tree->p_bucket);
         }
 
-        /* the former is original measure, and the latter is adapted to rfg */
-        /* measure = shadow_rngs[i].total / (float)(pnt_num >> 1); */
-        measure = shadow_rngs[i].total - (pnt_num >> 1);
-        if (measure < measure_min) { /* the less, the better */
-            measure_min = measure;
-            dim = i;
-        }
+        ftrees[i].bucket_num = p_tree->bucket_num;
+        ftrees[i].bucket_rule_num = p_tree->bucket_rule_num;
+        ftrees[i].pack_num = p_tree->pack_num;
+        ftrees[i].inode_num = p_tree->inode_num;
+        ftrees[i].enode_num = p_tree->enode_num;
+        ftrees[i].depth_max = p_tree->depth_max;
+        ftrees[i].pri_min = p_tree->pri_min;
+        ftrees[i].depth_avg = p_tree->depth_avg;
     }
 
-    return dim;
-}
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = HS_FILE_MAGIC;
+    hdr.version = HS_FILE_VERSION;
+    hdr.node_size = sizeof(struct hs_node);
+    hdr.pack_size = sizeof(struct hs_pack_node);
+    hdr.tree_num = p_hs_result->tree_num;
+    hdr.def_rule = p_hs_result->def_rule;
+    hdr.size = off;
+
+    fp = fopen(s_file, "wb");
+    if (!fp) {
+        fprintf(stderr, "Cannot open file %s\n", s_file);
+        free(ftrees);
+        return -errno;
+    }
 
-static uint32_t f_hs_pnt_decision(const struct shadow_range *p_shadow_rng)
-{
-    int i, measure, measure_max, rng_num_max;
+    off = 0;
+    ret = f_hs_write(fp, &hdr, sizeof(hdr), &off);
+    if (!ret) {
+        ret = f_hs_write(fp, ftrees, hdr.tree_num * sizeof(*ftrees), &off);
+    }
 
-    assert(p_shadow_rng && p_shadow_rng->pnts && p_shadow_rng->cnts);
+    for (i = 0; !ret && i < p_hs_result->tree_num; i++) {
+        const struct hs_tree *p_tree = &p_hs_result->trees[i];
+        static const char pad[HS_FILE_ALIGN];
+
+        ret = f_hs_write(fp, pad, ALIGN(off, HS_FILE_ALIGN) - off, &off);
+        if (!ret && p_tree->p_pack) {
+            ret = f_hs_write(fp, p_tree->p_pack,
+                    p_tree->pack_num * sizeof(*p_tree->p_pack), &off);
+        } else if (!ret) {
+            ret = f_hs_write(fp, p_tree->p_root,
+                    p_tree->inode_num * sizeof(*p_tree->p_root), &off);
+        }
 
-    measure = p_shadow_rng->cnts[0];
-    measure_max = p_shadow_rng->total >> 1; /* binary cut */
-    rng_num_max = (p_shadow_rng->pnt_num >> 1) - 1;
-    assert(rng_num_max > 0);
+        if (!ret && p_tree->bucket_rule_num) {
+            ret = f_hs_write(fp, pad, ALIGN(off, HS_FILE_ALIGN) - off, &off);
+        }
 
-    for (i = 1; i < rng_num_max && measure < measure_max; i++) {
-        measure += p_shadow_rng->cnts[i];
+        if (!ret && p_tree->bucket_rule_num) {
+            ret = f_hs_write(fp, p_tree->p_bucket,
+                    p_tree->bucket_rule_num * sizeof(*p_tree->p_bucket), &off);
+        }
     }
 
-    return p_shadow_rng->pnts[(i << 1) - 1];
-}
+    if (fclose(fp) && !ret) {
+        ret = -errno;
+    }
+
+    if (ret) {
+        fprintf(stderr, "Cannot write file %s\n", s_file);
+    }
+
+    free(ftrees);
+
+    return ret;
+}
+
+int hs_load(void *built_result, const char *s_file)
+{
+    int i, fd, ret;
+    void *p_map;
+    struct stat st;
+    const struct hs_file_header *p_hdr;
+    const struct hs_file_tree *ftrees;
+    struct hs_result *p_hs_result;
+
+    if (!built_result || !s_file) {
+        return -EINVAL;
+    }
+
+    fprintf(stderr, "Loading classifier from %s\n", s_file);
+
+    fd = open(s_file, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Cannot open file %s\n", s_file);
+        return -errno;
+    }
+
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*p_hdr)) {
+        fprintf(stderr, "Invalid classifier file %s\n", s_file);
+        close(fd);
+        return -EINVAL;
+    }
+
+    /* Node arrays are searched in the mapped file, without copies */
+    p_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+            fd, 0);
+    close(fd);
+    if (p_map == MAP_FAILED) {
+        perror("Cannot map classifier file");
+        return -errno;
+    }
+
+    p_hdr = p_map;
+    ftrees = (const struct hs_file_tree *)(p_hdr + 1);
+    if (p_hdr->magic != HS_FILE_MAGIC || p_hdr->version != HS_FILE_VERSION ||
+        p_hdr->node_size != sizeof(struct hs_node) ||
+        p_hdr->pack_size != sizeof(struct hs_pack_node) ||
+        p_hdr->size != (uint64_t)st.st_size || p_hdr->tree_num == 0 ||
+        p_hdr->tree_num > INT_MAX || p_hdr->def_rule < 0 ||
+        sizeof(*p_hdr) + p_hdr->tree_num * sizeof(*ftrees) > p_hdr->size) {
+        goto err;
+    }
+
+    for (i = 0; i < p_hdr->tree_num; i++) {
+        uint64_t off = ftrees[i].pack_off ? ftrees[i].pack_off :
+            ftrees[i].root_off;
+        uint64_t size = ftrees[i].pack_off ?
+            (uint64_t)ftrees[i].pack_num * sizeof(struct hs_pack_node) :
+            (uint64_t)ftrees[i].inode_num * sizeof(struct hs_node);
+
+        uint64_t bucket_size = (uint64_t)ftrees[i].bucket_rule_num *
+            sizeof(struct hs_bucket_rule);
+
+        if (!off || off % HS_FILE_ALIGN || ftrees[i].pack_num < 0 ||
+            ftrees[i].inode_num <= 0 || size == 0 ||
+            off > p_hdr->size || size > p_hdr->size - off ||
+            ftrees[i].pri_min < 0 ||
+            ftrees[i].pri_min > p_hdr->def_rule ||
+            (i && ftrees[i].pri_min < ftrees[i - 1].pri_min)) {
+            goto err;
+        }
+
+        if (ftrees[i].bucket_num < 0 || ftrees[i].bucket_rule_num < 0 ||
+            !ftrees[i].bucket_off != !ftrees[i].bucket_rule_num ||
+            ftrees[i].bucket_off % HS_FILE_ALIGN ||
+            ftrees[i].bucket_off > p_hdr->size ||
+            bucket_size > p_hdr->size - ftrees[i].bucket_off) {
+            goto err;
+        }
+    }
+
+    p_hs_result = malloc(sizeof(*p_hs_result));
+    if (!p_hs_result) {
+        munmap(p_map, st.st_size);
+        return -ENOMEM;
+    }
+
+    p_hs_result->trees = calloc(p_hdr->tree_num, sizeof(*p_hs_result->trees));
+    if (!p_hs_result->trees) {
+        free(p_hs_result);
+        munmap(p_map, st.st_size);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < p_hdr->tree_num; i++) {
+        struct hs_tree *p_tree = &p_hs_result->trees[i];
+
+        if (ftrees[i].pack_off) {
+            p_tree->p_pack = (void *)((char *)p_map + ftrees[i].pack_off);
+        } else {
+            p_tree->p_root = (void *)((char *)p_map + ftrees[i].root_off);
+        }
+
+        if (ftrees[i].bucket_off) {
+            p_tree->p_bucket = (void *)((char *)p_map + ftrees[i].bucket_off);
+        }
+
+        p_tree->bucket_num = ftrees[i].bucket_num;
+        p_tree->bucket_rule_num = ftrees[i].bucket_rule_num;
+
+        p_tree->pack_num = ftrees[i].pack_num;
+        p_tree->inode_num = ftrees[i].inode_num;
+        p_tree->enode_num = ftrees[i].enode_num;
+        p_tree->depth_max = ftrees[i].depth_max;
+        p_tree->pri_min = ftrees[i].pri_min;
+        p_tree->depth_avg = ftrees[i].depth_avg;
+    }
+
+    p_hs_result->tree_num = p_hdr->tree_num;
+    p_hs_result->def_rule = p_hdr->def_rule;
+    p_hs_result->p_map = p_map;
+    p_hs_result->map_size = st.st_size;
+    p_hs_result->p_block = NULL;
+    p_hs_result->p_simd = NULL;
+    p_hs_result->bucket_match = f_hs_bucket_matcher();
+    *(typeof(p_hs_result) *)built_result = p_hs_result;
+
+    /* the nodes are in one block already, so this only adds the descriptor */
+    ret = hs_merge(built_result);
+    if (ret) {
+        hs_destroy(built_result);
+        *(void **)built_result = NULL;
+    }
+
+    return ret;
+
+err:
+    fprintf(stderr, "Invalid classifier file %s\n", s_file);
+    munmap(p_map, st.st_size);
+
+    return -EINVAL;
+}
+
+void hs_destroy(void *built_result)
+{
+    int i;
+    struct hs_result *p_hs_result;
+
+    if (!built_result) {
+        return;
+    }
+
+    p_hs_result = *(typeof(p_hs_result) *)built_result;
+    if (!p_hs_result || !p_hs_result->trees) {
+        return;
+    }
+
+    if (p_hs_result->p_map) {
+        munmap(p_hs_result->p_map, p_hs_result->map_size);
+
+    } else {
+        /* buckets are left out of the merged block */
+        for (i = 0; i < p_hs_result->tree_num; i++) {
+            free(p_hs_result->trees[i].p_bucket);
+            if (!p_hs_result->p_block) {
+                free(p_hs_result->trees[i].p_pack);
+                free(p_hs_result->trees[i].p_root);
+            }
+        }
+
+        free(p_hs_result->p_block);
+    }
+
+    if (p_hs_result->p_simd) {
+        f_hs_simd_term(p_hs_result->p_simd);
+        free(p_hs_result->p_simd);
+    }
+
+    free(p_hs_result->trees);
+    free(p_hs_result);
+
+    return;
+}
+
+static int f_hs_init(struct hs_context *p_ctx, const struct partition *p_pa,
+        int thread_num, int binth, int measure)
+{
+    int i, j, null_flag = 0;
+
+    if (thread_num > p_pa->rule_num) {
+        thread_num = p_pa->rule_num;
+    }
+
+    p_ctx->hs_rts = calloc(thread_num, sizeof(*p_ctx->hs_rts));
+    p_ctx->trees = calloc(p_pa->subset_num, sizeof(*p_ctx->trees));
+    p_ctx->roots = calloc(p_pa->subset_num, sizeof(*p_ctx->roots));
+    p_ctx->pend_nums = calloc(p_pa->subset_num, sizeof(*p_ctx->pend_nums));
+    p_ctx->p_pa = p_pa;
+    p_ctx->pend_num = 0;
+    p_ctx->thread_num = p_ctx->hs_rts ? thread_num : 0;
+    p_ctx->binth = binth;
+    p_ctx->measure = measure;
+    p_ctx->ret = 0;
+
+    if (!p_ctx->hs_rts || !p_ctx->trees || !p_ctx->roots ||
+        !p_ctx->pend_nums) {
+        f_hs_term(p_ctx);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < thread_num; i++) {
+        struct hs_runtime *p_hs_rt = &p_ctx->hs_rts[i];
+        int64_t **shadow_pnts = p_hs_rt->shadow_pnts;
+        struct shadow_range *shadow_rngs = p_hs_rt->shadow_rngs;
+
+        for (j = 0; j < DIM_MAX; j++) {
+            /* the latter half is the buffer of sorting */
+            shadow_pnts[j] = malloc((p_pa->rule_num << 2) *
+                    sizeof(*shadow_pnts[j]));
+            shadow_rngs[j].pnts = malloc((p_pa->rule_num << 2) *
+                    sizeof(*shadow_rngs[j].pnts));
+            shadow_rngs[j].cnts = malloc((p_pa->rule_num << 1) *
+                    sizeof(*shadow_rngs[j].cnts));
+            if (!shadow_pnts[j] || !shadow_rngs[j].pnts ||
+                !shadow_rngs[j].cnts) {
+                null_flag = 1;
+            }
+        }
+
+        p_hs_rt->marks = calloc(p_pa->rule_num, sizeof(*p_hs_rt->marks));
+        if (!p_hs_rt->marks) {
+            null_flag = 1;
+        }
+
+        CMPOOL_INIT(&p_hs_rt->node_pool, p2roundup(p_pa->rule_num) << 1);
+        gsmpool_init(&p_hs_rt->item_pool, HS_ITEM_CHUNK_SIZE);
+        gsmpool_init(&p_hs_rt->bucket_pool, HS_ITEM_CHUNK_SIZE);
+        TAILQ_INIT(&p_hs_rt->wqh);
+        pthread_spin_init(&p_hs_rt->lock, PTHREAD_PROCESS_PRIVATE);
+        p_hs_rt->p_ctx = p_ctx;
+        p_hs_rt->id = i;
+    }
+
+    if (null_flag) {
+        f_hs_term(p_ctx);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static void f_hs_term(struct hs_context *p_ctx)
+{
+    int i, j;
+
+    for (i = 0; i < p_ctx->thread_num; i++) {
+        struct hs_runtime *p_hs_rt = &p_ctx->hs_rts[i];
+
+        /* work items left in queues are released with their pool */
+        pthread_spin_destroy(&p_hs_rt->lock);
+        gsmpool_term(&p_hs_rt->bucket_pool);
+        gsmpool_term(&p_hs_rt->item_pool);
+        CMPOOL_TERM(&p_hs_rt->node_pool);
+        free(p_hs_rt->marks);
+
+        for (j = 0; j < DIM_MAX; j++) {
+            free(p_hs_rt->shadow_rngs[j].cnts);
+            free(p_hs_rt->shadow_rngs[j].pnts);
+            free(p_hs_rt->shadow_pnts[j]);
+        }
+    }
+
+    /* trees are left if the result is not written */
+    if (p_ctx->trees) {
+        for (i = 0; i < p_ctx->p_pa->subset_num; i++) {
+            free(p_ctx->trees[i].p_bucket);
+            free(p_ctx->trees[i].p_root);
+        }
+    }
+
+    free(p_ctx->pend_nums);
+    free(p_ctx->roots);
+    free(p_ctx->trees);
+    free(p_ctx->hs_rts);
+
+    return;
+}
+
+static void *f_hs_worker(void *arg)
+{
+    int cur, ret;
+    struct hs_queue_entry *p_wqe;
+    struct hs_runtime *p_hs_rt = arg;
+    struct hs_context *p_ctx = p_hs_rt->p_ctx;
+
+    /* The loop processes internal nodes until all trees are built */
+    while (!__atomic_load_n(&p_ctx->ret, __ATOMIC_RELAXED)) {
+        p_wqe = f_hs_dequeue(p_hs_rt);
+        if (!p_wqe) {
+            p_wqe = f_hs_steal(p_hs_rt);
+        }
+
+        if (!p_wqe) {
+            if (!__atomic_load_n(&p_ctx->pend_num, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+
+            sched_yield();
+            continue;
+        }
+
+        /* children are counted before their parent is finished */
+        cur = p_wqe->cur;
+        ret = f_hs_process(p_hs_rt, p_wqe);
+
+        /* the last finisher of a tree writes the tree result */
+        if (!ret && !__sync_sub_and_fetch(&p_ctx->pend_nums[cur], 1)) {
+            ret = f_hs_gather(p_ctx, cur);
+        }
+
+        __sync_sub_and_fetch(&p_ctx->pend_num, 1);
+
+        if (ret) {
+            __sync_bool_compare_and_swap(&p_ctx->ret, 0, ret);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void f_hs_enqueue(struct hs_runtime *p_hs_rt,
+        struct hs_queue_entry *p_wqe)
+{
+    pthread_spin_lock(&p_hs_rt->lock);
+    TAILQ_INSERT_HEAD(&p_hs_rt->wqh, p_wqe, e);
+    pthread_spin_unlock(&p_hs_rt->lock);
+
+    return;
+}
+
+static struct hs_queue_entry *f_hs_dequeue(struct hs_runtime *p_hs_rt)
+{
+    struct hs_queue_entry *p_wqe;
+
+    /* depth first on own queue keeps the live work items few */
+    pthread_spin_lock(&p_hs_rt->lock);
+    p_wqe = TAILQ_FIRST(&p_hs_rt->wqh);
+    if (p_wqe) {
+        TAILQ_REMOVE(&p_hs_rt->wqh, p_wqe, e);
+    }
+    pthread_spin_unlock(&p_hs_rt->lock);
+
+    return p_wqe;
+}
+
+static struct hs_queue_entry *f_hs_steal(struct hs_runtime *p_hs_rt)
+{
+    int i;
+    struct hs_queue_entry *p_wqe = NULL;
+    struct hs_context *p_ctx = p_hs_rt->p_ctx;
+
+    /* the oldest item of a victim roots the largest pending subtree */
+    for (i = 1; !p_wqe && i < p_ctx->thread_num; i++) {
+        struct hs_runtime *p_victim =
+            &p_ctx->hs_rts[(p_hs_rt->id + i) % p_ctx->thread_num];
+
+        pthread_spin_lock(&p_victim->lock);
+        p_wqe = TAILQ_LAST(&p_victim->wqh, hs_queue_head);
+        if (p_wqe) {
+            TAILQ_REMOVE(&p_victim->wqh, p_wqe, e);
+        }
+        pthread_spin_unlock(&p_victim->lock);
+    }
+
+    /* Move the item into own pool, or it pins the pool of the victim.
+     * Without memory it is processed in place, the victim reclaims it */
+    if (p_wqe) {
+        int is_sorted = p_wqe->rule_ends[0] != NULL;
+        struct hs_queue_entry *p_copy =
+            f_hs_item_alloc(p_hs_rt, p_wqe->rule_num, is_sorted);
+
+        if (p_copy) {
+            memcpy(p_copy->space, p_wqe->space, sizeof(p_copy->space));
+            memcpy(p_copy->rule_id, p_wqe->rule_id,
+                    p_wqe->rule_num * sizeof(*p_copy->rule_id));
+            for (i = 0; is_sorted && i < DIM_MAX; i++) {
+                memcpy(p_copy->rule_ends[i], p_wqe->rule_ends[i],
+                        (p_wqe->rule_num << 1) * sizeof(*p_copy->rule_ends[i]));
+            }
+            p_copy->p_node = p_wqe->p_node;
+            p_copy->rule_num = p_wqe->rule_num;
+            p_copy->depth = p_wqe->depth;
+            p_copy->cur = p_wqe->cur;
+            gsmpool_free(p_wqe);
+            p_wqe = p_copy;
+        }
+    }
+
+    return p_wqe;
+}
+
+static struct hs_queue_entry *f_hs_item_alloc(struct hs_runtime *p_hs_rt,
+        int rule_num, int is_sorted)
+{
+    int i, blk_size;
+    struct hs_queue_entry *p_wqe;
+
+    blk_size = is_sorted ? HS_RULE_BLK_SIZE(rule_num) : rule_num;
+    p_wqe = gsmpool_malloc(&p_hs_rt->item_pool,
+            sizeof(*p_wqe) + blk_size * sizeof(*p_wqe->rule_id));
+    if (!p_wqe) {
+        return NULL;
+    }
+
+    p_wqe->rule_id = (int *)(p_wqe + 1);
+    for (i = 0; i < DIM_MAX; i++) {
+        p_wqe->rule_ends[i] = !is_sorted ? NULL : p_wqe->rule_id + rule_num +
+            i * (rule_num << 1);
+    }
+
+    return p_wqe;
+}
+
+static int f_hs_trigger(struct hs_context *p_ctx, int cur)
+{
+    int i, *rule_id;
+    struct hs_tree *p_tree;
+    struct hs_runtime *p_hs_rt;
+    struct hs_build_node *p_bnode;
+    struct hs_queue_entry *p_wqe;
+    const struct rule_set *p_rs;
+    static uint32_t space[DIM_MAX][2] = {
+        {0, UINT32_MAX}, {0, UINT32_MAX},
+        {0, UINT16_MAX}, {0, UINT16_MAX},
+        {0, UINT8_MAX}
+    };
+
+    assert(p_ctx && p_ctx->trees && p_ctx->roots);
+    assert(p_ctx->p_pa->subsets[cur].rules);
+    assert(p_ctx->p_pa->subsets[cur].rule_num > 1);
+
+    p_tree = &p_ctx->trees[cur];
+    p_rs = &p_ctx->p_pa->subsets[cur];
+
+    p_tree->pri_min = p_rs->rules[0].pri;
+    for (i = 1; i < p_rs->rule_num; i++) {
+        if (p_rs->rules[i].pri < p_tree->pri_min) {
+            p_tree->pri_min = p_rs->rules[i].pri;
+        }
+    }
+
+    /* There is no need to build trees: only the tree root */
+    if (f_space_is_fully_covered(space, p_rs->rules[0].dims)) {
+        struct hs_node *p_root = malloc(sizeof(*p_root));
+        if (!p_root) {
+            return -ENOMEM;
+        }
+
+        p_root->thresh = UINT32_MAX;
+        p_root->dim = DIM_SIP;
+        p_root->lchild = p_root->rchild = p_rs->rules[0].pri;
+        p_tree->p_root = p_root;
+        p_tree->inode_num = p_tree->enode_num = p_tree->depth_max = 1;
+        p_tree->depth_avg = 1.0;
+
+        return 0;
+    }
+
+    /* The tree root needs split: spread the roots over all threads */
+    p_hs_rt = &p_ctx->hs_rts[cur % p_ctx->thread_num];
+    p_bnode = CMPOOL_MALLOC(hsbn_pool, &p_hs_rt->node_pool);
+    p_wqe = f_hs_item_alloc(p_hs_rt, p_rs->rule_num,
+            p_rs->rule_num > HS_RULE_ENDS_MIN);
+    if (!p_bnode || !p_wqe) {
+        return -ENOMEM;
+    }
+
+    rule_id = p_wqe->rule_id;
+    for (i = 0; i < p_rs->rule_num; i++) {
+        rule_id[i] = i;
+    }
+
+    /* endpoints are sorted only once: children filter them in order */
+    for (i = 0; p_wqe->rule_ends[0] && i < DIM_MAX; i++) {
+        sort_rule_ends(p_wqe->rule_ends[i], p_hs_rt->shadow_pnts[i], rule_id,
+                p_rs->rule_num, p_rs->rules, i);
+    }
+    memcpy(p_wqe->space, space, sizeof(space));
+    p_wqe->p_node = p_bnode;
+    p_wqe->rule_num = p_rs->rule_num;
+    p_wqe->depth = 1;
+    p_wqe->cur = cur;
+    p_tree->inode_num = 1;
+    p_ctx->roots[cur] = p_bnode;
+    p_ctx->pend_nums[cur] = 1;
+    p_ctx->pend_num++;
+    TAILQ_INSERT_HEAD(&p_hs_rt->wqh, p_wqe, e);
+
+    return 0;
+}
+
+static int f_hs_process(struct hs_runtime *p_hs_rt,
+        struct hs_queue_entry *p_wqe)
+{
+    int split_dim;
+    struct hs_build_node *p_bnode;
+    struct hs_queue_entry *p_left, *p_right;
+    uint32_t split_pnt, orig_end, *split_rng;
+
+    /* choose split dimension */
+    split_dim = f_hs_dim_decision(p_hs_rt, p_wqe);
+    if (split_dim == DIM_INV) {
+        goto err;
+    }
+
+    /* choose split point */
+    assert(split_dim > DIM_INV && split_dim < DIM_MAX);
+    split_pnt = f_hs_pnt_decision(&p_hs_rt->shadow_rngs[split_dim]);
+
+    p_bnode = p_wqe->p_node;
+    p_bnode->dim = split_dim;
+    p_bnode->thresh = split_pnt;
+
+    /* process left child: require a new wqe */
+    split_rng = p_wqe->space[split_dim];
+    orig_end = split_rng[1], split_rng[1] = split_pnt;
+    if (f_hs_spawn(p_hs_rt, p_wqe, split_dim, 0, &p_left)) {
+        goto err;
+    }
+
+    /* process right child: reuse current wqe */
+    split_rng[1] = orig_end, split_rng[0] = split_pnt + 1;
+    if (f_hs_spawn(p_hs_rt, p_wqe, split_dim, 1, &p_right)) {
+        goto err;
+    }
+
+    /* the left child is on the top of the pool: it goes first, so the
+     * pool is released in LIFO order */
+    if (p_right) {
+        f_hs_enqueue(p_hs_rt, p_right);
+    }
+    if (p_left) {
+        f_hs_enqueue(p_hs_rt, p_left);
+    }
+
+    return 0;
+
+err:
+    gsmpool_free(p_wqe);
+
+    return -ENOMEM;
+}
+
+static int f_hs_gather(struct hs_context *p_ctx, int cur)
+{
+    uint32_t node_num, offset, bucket_rule_num = 0;
+    size_t top, size = 64;
+    struct hs_node *p_root;
+    struct hs_bucket_rule *p_bucket = NULL;
+    struct hs_tree *p_tree;
+    struct hs_gather_entry *stack;
+    const struct rule_set *p_rs = &p_ctx->p_pa->subsets[cur];
+
+    p_tree = &p_ctx->trees[cur];
+    offset = p_rs->def_rule + 1 + p_tree->bucket_rule_num;
+    if ((uint64_t)offset + p_tree->inode_num > NODE_NUM_MAX) {
+        return -E2BIG;
+    }
+
+    if (p_tree->bucket_rule_num && posix_memalign((void **)&p_bucket,
+        sizeof(*p_bucket), p_tree->bucket_rule_num * sizeof(*p_bucket))) {
+        return -ENOMEM;
+    }
+
+    p_root = malloc(p_tree->inode_num * sizeof(*p_root));
+    stack = malloc(size * sizeof(*stack));
+    if (!p_root || !stack) {
+        free(stack);
+        free(p_root);
+        free(p_bucket);
+        return -ENOMEM;
+    }
+
+    /* Merge nodes of all threads into one array in preorder */
+    stack[0].p_bnode = p_ctx->roots[cur];
+    stack[0].side = -1;
+    stack[0].depth = 1;
+    for (top = 1, node_num = 0; top > 0; node_num++) {
+        int side;
+        struct hs_node *p_node = p_root + node_num;
+        struct hs_gather_entry ge = stack[--top];
+
+        if (ge.side == 0) {
+            p_root[ge.parent].lchild = node_num + offset;
+        } else if (ge.side == 1) {
+            p_root[ge.parent].rchild = node_num + offset;
+        }
+
+        p_node->thresh = ge.p_bnode->thresh;
+        p_node->dim = ge.p_bnode->dim;
+
+        /* push right first, so the left child follows its parent */
+        for (side = 1; side >= 0; side--) {
+            if (ge.p_bnode->leaf[side]) {
+                uint32_t id;
+
+                if (ge.p_bnode->leaf[side] == HS_LEAF_BUCKET) {
+                    const int *rule_id = ge.p_bnode->child[side].rule_id;
+
+                    id = p_rs->def_rule + 1 + bucket_rule_num;
+                    f_hs_bucket_fill(p_bucket + bucket_rule_num, p_rs,
+                            rule_id + 1, rule_id[0]);
+                    bucket_rule_num += rule_id[0];
+
+                } else {
+                    id = ge.p_bnode->child[side].pri;
+                }
+
+                if (side) {
+                    p_node->rchild = id;
+                } else {
+                    p_node->lchild = id;
+                }
+
+                p_tree->enode_num++;
+                p_tree->depth_avg += ge.depth;
+                if (ge.depth > p_tree->depth_max) {
+                    p_tree->depth_max = ge.depth;
+                }
+
+                continue;
+            }
+
+            if (top == size) {
+                struct hs_gather_entry *n_stack = realloc(stack,
+                        (size << 1) * sizeof(*n_stack));
+                if (!n_stack) {
+                    free(stack);
+                    free(p_root);
+                    free(p_bucket);
+                    return -ENOMEM;
+                }
+
+                stack = n_stack;
+                size <<= 1;
+            }
+
+            stack[top].p_bnode = ge.p_bnode->child[side].p_node;
+            stack[top].parent = node_num;
+            stack[top].side = side;
+            stack[top++].depth = ge.depth + 1;
+        }
+    }
+
+    free(stack);
+
+    p_tree->p_root = p_root;
+    p_tree->p_bucket = p_bucket;
+    p_tree->depth_avg /= p_tree->enode_num;
+    assert(p_tree->inode_num == node_num);
+    assert(p_tree->bucket_rule_num == bucket_rule_num);
+    assert(p_tree->enode_num == p_tree->inode_num + 1);
+
+    return 0;
+}
+
+static int f_hs_dim_decision(struct hs_runtime *p_hs_rt,
+        const struct hs_queue_entry *p_wqe)
+{
+    int i, dim, pnt_num;
+    int64_t **shadow_pnts;
+    struct shadow_range *shadow_rngs;
+    const struct rule *rules;
+    double measure, measure_min = DBL_MAX;
+
+    assert(p_wqe && p_wqe->rule_id && p_wqe->rule_num > 1);
+
+    shadow_pnts = p_hs_rt->shadow_pnts;
+    shadow_rngs = p_hs_rt->shadow_rngs;
+    rules = p_hs_rt->p_ctx->p_pa->subsets[p_wqe->cur].rules;
+
+    for (dim = DIM_INV, i = 0; i < DIM_MAX; i++) {
+        if (p_wqe->rule_ends[i] ? shadow_sorted_rules(&shadow_rngs[i],
+            shadow_pnts[i], p_wqe->space[i], p_wqe->rule_ends[i],
+            p_wqe->rule_num << 1, rules, i) : shadow_rules(&shadow_rngs[i],
+            shadow_pnts[i], p_wqe->space[i], p_wqe->rule_id,
+            p_wqe->rule_num, rules, i)) {
+            return DIM_INV;
+        }
+
+        pnt_num = shadow_rngs[i].pnt_num;
+        if (pnt_num <= 2) { /* no more range */
+            continue;
+        }
+
+        /* the original measure, or the one adapted to rfg */
+        if (p_hs_rt->p_ctx->measure == HS_MEASURE_ORIG) {
+            measure = shadow_rngs[i].total / (double)(pnt_num >> 1);
+        } else {
+            measure = shadow_rngs[i].total - (pnt_num >> 1);
+        }
+
+        if (measure < measure_min) { /* the less, the better */
+            measure_min = measure;
+            dim = i;
+        }
+    }
+
+    return dim;
+}
+
+static uint32_t f_hs_pnt_decision(const struct shadow_range *p_shadow_rng)
+{
+    int i, measure, measure_max, rng_num_max;
+
+    assert(p_shadow_rng && p_shadow_rng->pnts && p_shadow_rng->cnts);
+
+    measure = p_shadow_rng->cnts[0];
+    measure_max = p_shadow_rng->total >> 1; /* binary cut */
+    rng_num_max = (p_shadow_rng->pnt_num >> 1) - 1;
+    assert(rng_num_max > 0);
+
+    for (i = 1; i < rng_num_max && measure < measure_max; i++) {
+        measure += p_shadow_rng->cnts[i];
+    }
+
+    return p_shadow_rng->pnts[(i << 1) - 1];
+}
 
 static int f_hs_spawn(struct hs_runtime *p_hs_rt, struct hs_queue_entry *p_wqe,
-        int split_dim, int is_inplace)
+        int split_dim, int is_inplace, struct hs_queue_entry **pp_child)
+{
+    struct hs_build_node *p_bnode;
+    struct hs_queue_entry *p_new_wqe;
+    int d, first, is_sorted;
+    register int i, rid, new_rule_num, *new_rule_id;
+
+    uint8_t *marks = p_hs_rt->marks;
+    struct hs_context *p_ctx = p_hs_rt->p_ctx;
+    struct hs_tree *p_tree = &p_ctx->trees[p_wqe->cur];
+    const struct rule_set *p_rs = &p_ctx->p_pa->subsets[p_wqe->cur];
+    register const uint32_t *split_rng = p_wqe->space[split_dim];
+
+    /* Mark all intersected rules */
+    for (first = -1, new_rule_num = i = 0; i < p_wqe->rule_num; i++) {
+        rid = p_wqe->rule_id[i];
+        if (p_rs->rules[rid].dims[split_dim][0] <= split_rng[1] &&
+            p_rs->rules[rid].dims[split_dim][1] >= split_rng[0]) {
+            if (first == -1) {
+                first = rid;
+            }
+            marks[rid] = 1;
+            new_rule_num++;
+        }
+    }
+
+    /* External node */
+    p_bnode = p_wqe->p_node;
+    if (f_space_is_fully_covered(p_wqe->space, p_rs->rules[first].dims)) {
+        p_bnode->child[is_inplace].pri = p_rs->rules[first].pri;
+        p_bnode->leaf[is_inplace] = HS_LEAF_RULE;
+        for (i = 0; i < p_wqe->rule_num; i++) {
+            marks[p_wqe->rule_id[i]] = 0;
+        }
+        if (is_inplace) {
+            gsmpool_free(p_wqe);
+        }
+
+        *pp_child = NULL;
+        return 0;
+    }
+
+    /* Leaf bucket: few enough rules to be searched linearly */
+    if (new_rule_num <= p_ctx->binth) {
+        new_rule_id = gsmpool_malloc(&p_hs_rt->bucket_pool,
+                (new_rule_num + 1) * sizeof(*new_rule_id));
+        if (!new_rule_id) {
+            goto err;
+        }
+
+        new_rule_id[0] = new_rule_num;
+        for (new_rule_num = i = 0; i < p_wqe->rule_num; i++) {
+            rid = p_wqe->rule_id[i];
+            if (marks[rid]) {
+                new_rule_id[++new_rule_num] = rid;
+                marks[rid] = 0;
+            }
+        }
+
+        p_bnode->child[is_inplace].rule_id = new_rule_id;
+        p_bnode->leaf[is_inplace] = HS_LEAF_BUCKET;
+        __sync_fetch_and_add(&p_tree->bucket_num, 1);
+        __sync_fetch_and_add(&p_tree->bucket_rule_num, new_rule_num);
+        if (is_inplace) {
+            gsmpool_free(p_wqe);
+        }
+
+        *pp_child = NULL;
+        return 0;
+    }
+
+    /* Internal node: allocated from the pool of this thread */
+    p_bnode->child[is_inplace].p_node =
+        CMPOOL_MALLOC(hsbn_pool, &p_hs_rt->node_pool);
+    if (!p_bnode->child[is_inplace].p_node) {
+        goto err;
+    }
+
+    /* small children sort endpoints again, which is cheaper than filtering */
+    is_sorted = p_wqe->rule_ends[0] && new_rule_num > HS_RULE_ENDS_MIN;
+
+    if (is_inplace) {
+        p_new_wqe = p_wqe;
+    } else {
+        p_new_wqe = f_hs_item_alloc(p_hs_rt, new_rule_num, is_sorted);
+        if (!p_new_wqe) {
+            goto err;
+        }
+
+        memcpy(p_new_wqe->space, p_wqe->space, sizeof(p_new_wqe->space));
+        p_new_wqe->cur = p_wqe->cur;
+    }
+
+    /* Filter rules and endpoints in order: the in place writes never
+     * overtake the reads */
+    new_rule_id = p_new_wqe->rule_id;
+    for (new_rule_num = i = 0; i < p_wqe->rule_num; i++) {
+        rid = p_wqe->rule_id[i];
+        if (marks[rid]) {
+            new_rule_id[new_rule_num++] = rid;
+        }
+    }
+
+    for (d = 0; is_sorted && d < DIM_MAX; d++) {
+        register int j, *ends = p_wqe->rule_ends[d];
+        register int *new_ends = p_new_wqe->rule_ends[d];
+
+        for (i = j = 0; i < p_wqe->rule_num << 1; i++) {
+            if (marks[ends[i] >> 1]) {
+                new_ends[j++] = ends[i];
+            }
+        }
+    }
+
+    for (i = 0; i < new_rule_num; i++) {
+        marks[new_rule_id[i]] = 0;
+    }
+
+    if (!is_sorted) {
+        memset(p_new_wqe->rule_ends, 0, sizeof(p_new_wqe->rule_ends));
+    }
+
+    p_new_wqe->p_node = p_bnode->child[is_inplace].p_node;
+    p_bnode->leaf[is_inplace] = HS_LEAF_NONE;
+    p_new_wqe->rule_num = new_rule_num;
+    p_new_wqe->depth = p_wqe->depth + 1;
+    __sync_fetch_and_add(&p_tree->inode_num, 1);
+    __sync_fetch_and_add(&p_ctx->pend_nums[p_new_wqe->cur], 1);
+    __sync_fetch_and_add(&p_ctx->pend_num, 1);
+    *pp_child = p_new_wqe;
+
+    return 0;
+
+err:
+    for (i = 0; i < p_wqe->rule_num; i++) {
+        marks[p_wqe->rule_id[i]] = 0;
+    }
+
+    return -ENOMEM;
+}
+
+static int f_space_is_fully_covered(uint32_t (*left)[2], uint32_t (*right)[2])
+{
+    int i;
+
+    assert(left && right);
+
+    for (i = 0; i < DIM_MAX; i++) {
+        /* left is fully covered by right */
+        if (left[i][0] < right[i][0] || left[i][1] > right[i][1]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Rule ids of a subset are in priority order, and so are the bucket rules */
+static void f_hs_bucket_fill(struct hs_bucket_rule *p_br,
+        const struct rule_set *p_rs, const int *rule_id, int rule_num)
+{
+    int i, d;
+
+    memset(p_br, 0, rule_num * sizeof(*p_br));
+
+    for (i = 0; i < rule_num; i++) {
+        const struct rule *p_rule = &p_rs->rules[rule_id[i]];
+
+        for (d = 0; d < DIM_MAX; d++) {
+            p_br[i].lo[d] = p_rule->dims[d][0];
+            p_br[i].hi[d] = p_rule->dims[d][1];
+        }
+
+        p_br[i].lo[HS_BUCKET_PRI] = p_rule->pri;
+    }
+
+    assert(p_br[rule_num - 1].lo[HS_BUCKET_PRI] == p_rs->def_rule);
+
+    return;
+}
+
+/*
+ * The first rule of the bucket matching the packet, or pri if it is not
+ * better. The default rule ends the bucket, so the scan always stops.
+ */
+static int f_hs_bucket_match(const struct hs_bucket_rule *p_br,
+        const uint32_t *dims, int pri)
+{
+    int d;
+
+    for (; (int)p_br->lo[HS_BUCKET_PRI] < pri; p_br++) {
+        for (d = 0; d < DIM_MAX; d++) {
+            if (dims[d] < p_br->lo[d] || dims[d] > p_br->hi[d]) {
+                break;
+            }
+        }
+
+        if (d == DIM_MAX) {
+            return p_br->lo[HS_BUCKET_PRI];
+        }
+    }
+
+    return pri;
+}
+
+/* All fields of a rule are checked by one compare against each bound */
+__attribute__((target("avx2")))
+static int f_hs_bucket_match_avx2(const struct hs_bucket_rule *p_br,
+        const uint32_t *dims, int pri)
+{
+    __m256i pkt, lo, hi, in;
+
+    pkt = _mm256_maskload_epi32((const int *)dims, _mm256_setr_epi32(
+            -1, -1, -1, -1, -1, 0, 0, 0));
+
+    for (; (int)p_br->lo[HS_BUCKET_PRI] < pri; p_br++) {
+        lo = _mm256_load_si256((const __m256i *)p_br->lo);
+        hi = _mm256_load_si256((const __m256i *)p_br->hi);
+        in = _mm256_and_si256(
+                _mm256_cmpeq_epi32(_mm256_max_epu32(pkt, lo), pkt),
+                _mm256_cmpeq_epi32(_mm256_min_epu32(pkt, hi), pkt));
+
+        if ((_mm256_movemask_ps(_mm256_castsi256_ps(in)) &
+            ((1 << DIM_MAX) - 1)) == (1 << DIM_MAX) - 1) {
+            return p_br->lo[HS_BUCKET_PRI];
+        }
+    }
+
+    return pri;
+}
+
+/* Asked once per classifier, as the bucket scan runs for every leaf */
+static hs_bucket_match_t f_hs_bucket_matcher(void)
+{
+    return __builtin_cpu_supports("avx2") ? f_hs_bucket_match_avx2 :
+        f_hs_bucket_match;
+}
+
+/* The first matched rule of a packet over all trees */
+static inline int f_hs_lookup(const struct packet *p_pkt,
+        const struct hs_result *p_hs_result)
+{
+    int j, pri;
+    const struct hs_tree *p_tree;
+
+    register uint32_t id, offset, def_rule;
+    register const struct hs_node *p_node, *p_root;
+    register const struct hs_pack_node *p_blk;
+
+    /* For each tree, until none of the rest has a better rule */
+    pri = def_rule = p_hs_result->def_rule;
+    for (j = 0; j < p_hs_result->tree_num &&
+        p_hs_result->trees[j].pri_min < pri; j++) {
+        p_tree = &p_hs_result->trees[j];
+        offset = def_rule + 1 + p_tree->bucket_rule_num;
+
+        if (p_tree->p_pack) {
+            /* For each block */
+            p_blk = p_tree->p_pack;
+            while ((id = f_hs_pack_step(p_blk, p_pkt->dims)) >= offset) {
+                p_blk += id - offset;
+            }
+
+        } else {
+            /* For each node */
+            id = offset, p_root = p_tree->p_root;
+            do {
+                p_node = p_root + id - offset;
+                id = p_pkt->dims[p_node->dim] <= p_node->thresh ?
+                    p_node->lchild : p_node->rchild;
+            } while (id >= offset);
+        }
+
+        if (id > def_rule) {
+            id = p_hs_result->bucket_match(
+                    &p_tree->p_bucket[id - def_rule - 1], p_pkt->dims, pri);
+        }
+
+        if (id < pri) {
+            pri = id;
+        }
+    }
+
+    return pri;
+}
+
+static void f_hs_lookup_batch(int *pri, const struct packet *pkts, int pkt_num,
+        const struct hs_result *p_hs_result, long cache_size)
+{
+    int i, j, walk_num, next_num;
+    uint32_t id[HS_BATCH_SIZE];
+    uint8_t walk[HS_BATCH_SIZE]; /* packets still walking the current tree */
+    const struct hs_tree *p_tree;
+
+    register uint32_t cur, offset, def_rule;
+    register const struct hs_node *p_node, *p_root;
+    register const struct hs_pack_node *p_blk;
+    const struct hs_pack_node *blks[HS_BATCH_SIZE];
+
+    assert(pri && pkts && pkt_num > 0 && pkt_num <= HS_BATCH_SIZE);
+
+    /* Cache resident trees: there are no misses for interleaving to hide */
+    def_rule = p_hs_result->def_rule;
+    for (i = 0; i < pkt_num; i++) {
+        pri[i] = def_rule;
+
+        for (j = 0; j < p_hs_result->tree_num &&
+            p_hs_result->trees[j].pri_min < pri[i]; j++) {
+            p_tree = &p_hs_result->trees[j];
+            if (f_hs_tree_size(p_tree) >= cache_size) {
+                continue;
+            }
+
+            offset = def_rule + 1 + p_tree->bucket_rule_num;
+            if (p_tree->p_pack) {
+                p_blk = p_tree->p_pack;
+                while ((cur = f_hs_pack_step(p_blk, pkts[i].dims)) >= offset) {
+                    p_blk += cur - offset;
+                }
+
+            } else {
+                cur = offset, p_root = p_tree->p_root;
+                do {
+                    p_node = p_root + cur - offset;
+                    cur = pkts[i].dims[p_node->dim] <= p_node->thresh ?
+                        p_node->lchild : p_node->rchild;
+                } while (cur >= offset);
+            }
+
+            if (cur > def_rule) {
+                cur = p_hs_result->bucket_match(
+                        &p_tree->p_bucket[cur - def_rule - 1], pkts[i].dims,
+                        pri[i]);
+            }
+
+            if (cur < pri[i]) {
+                pri[i] = cur;
+            }
+        }
+    }
+
+    /* Large trees: all packets of the batch walk in lockstep */
+    for (j = 0; j < p_hs_result->tree_num; j++) {
+        p_tree = &p_hs_result->trees[j];
+        if (f_hs_tree_size(p_tree) < cache_size) {
+            continue;
+        }
+
+        offset = def_rule + 1 + p_tree->bucket_rule_num;
+
+        /* Only packets whose match the tree may beat walk it */
+        for (walk_num = i = 0; i < pkt_num; i++) {
+            if (p_tree->pri_min < pri[i]) {
+                walk[walk_num++] = i;
+            }
+        }
+
+        if (!walk_num) {
+            break; /* nor any of the following trees */
+        }
+
+        if (p_tree->p_pack) {
+            for (i = 0; i < walk_num; i++) {
+                blks[walk[i]] = p_tree->p_pack;
+            }
+
+            /* Same as below, but one round advances HS_PACK_LEVEL levels */
+            for (; walk_num; walk_num = next_num) {
+                for (next_num = i = 0; i < walk_num; i++) {
+                    register int k = walk[i];
+
+                    cur = f_hs_pack_step(blks[k], pkts[k].dims);
+                    if (cur >= offset) {
+                        blks[k] += cur - offset;
+                        __builtin_prefetch(blks[k]);
+                        walk[next_num++] = k;
+                        continue;
+                    }
+
+                    if (cur > def_rule) {
+                        cur = p_hs_result->bucket_match(
+                                &p_tree->p_bucket[cur - def_rule - 1],
+                                pkts[k].dims, pri[k]);
+                    }
+
+                    if (cur < pri[k]) {
+                        pri[k] = cur;
+                    }
+                }
+            }
+
+            continue;
+        }
+
+        p_root = p_tree->p_root;
+        for (i = 0; i < walk_num; i++) {
+            id[walk[i]] = offset;
+        }
+
+        /*
+         * Each round advances every walking packet by one level, and the
+         * next node of each packet is prefetched so that the dependent cache
+         * misses of different packets overlap with each other.
+         */
+        for (; walk_num; walk_num = next_num) {
+            for (next_num = i = 0; i < walk_num; i++) {
+                register int k = walk[i];
+
+                p_node = p_root + id[k] - offset;
+                id[k] = pkts[k].dims[p_node->dim] <= p_node->thresh ?
+                    p_node->lchild : p_node->rchild;
+
+                if (id[k] >= offset) {
+                    __builtin_prefetch(p_root + id[k] - offset);
+                    walk[next_num++] = k;
+                    continue;
+                }
+
+                if (id[k] > def_rule) {
+                    id[k] = p_hs_result->bucket_match(
+                            &p_tree->p_bucket[id[k] - def_rule - 1],
+                            pkts[k].dims, pri[k]);
+                }
+
+                if (id[k] < pri[k]) {
+                    pri[k] = id[k];
+                }
+            }
+        }
+    }
+
+    return;
+}
+
+/* Walk the trees with a batch of packets missed in the flow cache */
+static int f_hs_search_misses(const struct packet *misses, const int *miss_id,
+        struct flow_bucket **buckets, int miss_num,
+        const struct hs_result *p_hs_result, struct flow_cache *p_fc,
+        long cache_size)
 {
-    struct hs_node *p_node;
-    struct hs_queue_entry *p_new_wqe;
-    register int i, rid, new_rule_num, *new_rule_id;
+    int i, pri[HS_BATCH_SIZE];
 
-    struct hs_tree *p_tree = &p_hs_rt->trees[p_hs_rt->cur];
-    const struct rule_set *p_rs = &p_hs_rt->p_pa->subsets[p_hs_rt->cur];
-    register const uint32_t *split_rng = p_wqe->space[split_dim];
+    f_hs_lookup_batch(pri, misses, miss_num, p_hs_result, cache_size);
 
-    /* Get all intersected rules */
-    if (is_inplace) {
-        new_rule_id = p_wqe->rule_id;
+    for (i = 0; i < miss_num; i++) {
+        flow_cache_insert(p_fc, buckets[i], misses[i].dims, pri[i]);
+
+        if (pri[i] != misses[i].match_rule &&
+            misses[i].match_rule != TRACE_MATCH_UNKNOWN) {
+            fprintf(stderr, "packet %d match %d, but should match %d\n",
+                    miss_id[i], pri[i], misses[i].match_rule);
+            return -EFAULT;
+        }
+    }
+
+    return 0;
+}
+
+static inline size_t f_hs_tree_size(const struct hs_tree *p_tree)
+{
+    return p_tree->p_pack ? p_tree->pack_num * sizeof(*p_tree->p_pack) :
+        p_tree->inode_num * sizeof(*p_tree->p_root);
+}
+
+static int f_hs_merge_block(struct hs_result *p_hs_result)
+{
+    int i;
+    size_t size = 0, off = 0;
+    char *p_block;
+
+    for (i = 0; i < p_hs_result->tree_num; i++) {
+        size += ALIGN(f_hs_tree_size(&p_hs_result->trees[i]), HS_FILE_ALIGN);
+        if (p_hs_result->trees[i].p_pack && p_hs_result->trees[i].p_root) {
+            size += ALIGN(p_hs_result->trees[i].inode_num *
+                    sizeof(struct hs_node), HS_FILE_ALIGN);
+        }
+    }
+
+    if (posix_memalign((void **)&p_block, HS_FILE_ALIGN, size)) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < p_hs_result->tree_num; i++) {
+        struct hs_tree *p_tree = &p_hs_result->trees[i];
+
+        if (p_tree->p_pack) {
+            size = p_tree->pack_num * sizeof(*p_tree->p_pack);
+            memcpy(p_block + off, p_tree->p_pack, size);
+            free(p_tree->p_pack);
+            p_tree->p_pack = (void *)(p_block + off);
+            off += ALIGN(size, HS_FILE_ALIGN);
+        }
+
+        if (p_tree->p_root) {
+            size = p_tree->inode_num * sizeof(*p_tree->p_root);
+            memcpy(p_block + off, p_tree->p_root, size);
+            free(p_tree->p_root);
+            p_tree->p_root = (void *)(p_block + off);
+            off += ALIGN(size, HS_FILE_ALIGN);
+        }
+    }
+
+    p_hs_result->p_block = p_block;
+
+    return 0;
+}
+
+static int f_hs_simd_init(struct hs_simd *p_simd,
+        const struct hs_result *p_hs_result)
+{
+    int i, is_packed = 1;
+    size_t off, size;
+    uint32_t word;
+    const char *p_nodes, *p_end;
+    struct hs_node probe;
+
+    assert(p_simd && p_hs_result && p_hs_result->trees);
+
+    memset(p_simd, 0, sizeof(*p_simd));
+    p_simd->def_rule = p_hs_result->def_rule;
+    p_simd->bucket_match = p_hs_result->bucket_match;
+
+    if (__builtin_cpu_supports("avx512f")) {
+        p_simd->lanes = HS_SIMD_LANES_MAX;
+    } else if (__builtin_cpu_supports("avx2")) {
+        p_simd->lanes = HS_SIMD_LANES_MAX >> 1;
     } else {
-        new_rule_id = malloc(p_wqe->rule_num * sizeof(*new_rule_id));
-        if (!new_rule_id) {
-            return -ENOMEM;
+        return 0; /* scalar */
+    }
+
+    /* the kernels read dim and lchild from the word after thresh */
+    memset(&probe, 0, sizeof(probe));
+    probe.dim = DIM_PROTO, probe.lchild = 1;
+    memcpy(&word, (char *)&probe + sizeof(probe.thresh), sizeof(word));
+    if (word != (1 << (32 - NODE_NUM_BITS) | DIM_PROTO)) {
+        return 0;
+    }
+
+    /* All trees in one layout, preferring packed as the scalar walk does */
+    for (i = 0; i < p_hs_result->tree_num; i++) {
+        is_packed &= p_hs_result->trees[i].p_pack != NULL;
+    }
+
+    for (i = 0; i < p_hs_result->tree_num; i++) {
+        const struct hs_tree *p_tree = &p_hs_result->trees[i];
+
+        if (!is_packed && !p_tree->p_root) {
+            return 0;
+        }
+
+        p_nodes = is_packed ? (char *)p_tree->p_pack : (char *)p_tree->p_root;
+        if (!p_simd->base || p_nodes < p_simd->base) {
+            p_simd->base = p_nodes;
         }
     }
 
-    for (new_rule_num = i = 0; i < p_wqe->rule_num; i++) {
-        rid = p_wqe->rule_id[i];
-        if (p_rs->rules[rid].dims[split_dim][0] <= split_rng[1] &&
-            p_rs->rules[rid].dims[split_dim][1] >= split_rng[0]) {
-            new_rule_id[new_rule_num++] = rid;
+    /* Every node must be in reach of a 32-bit gather index */
+    for (i = 0; i < p_hs_result->tree_num; i++) {
+        const struct hs_tree *p_tree = &p_hs_result->trees[i];
+
+        p_nodes = is_packed ? (char *)p_tree->p_pack : (char *)p_tree->p_root;
+        size = is_packed ? p_tree->pack_num * sizeof(*p_tree->p_pack) :
+            p_tree->inode_num * sizeof(*p_tree->p_root);
+        p_end = p_nodes + size;
+        if ((size_t)(p_end - p_simd->base) > INT32_MAX) {
+            p_simd->base = NULL;
+            return 0;
         }
     }
 
-    /* External node */
-    rid = new_rule_id[0];
-    if (f_space_is_fully_covered(p_wqe->space, p_rs->rules[rid].dims)) {
-        p_tree->enode_num++;
-        p_tree->depth_avg += p_wqe->depth;
-        if (p_wqe->depth > p_tree->depth_max) {
-            p_tree->depth_max = p_wqe->depth;
+    p_simd->tree_num = ALIGN(p_hs_result->tree_num, p_simd->lanes);
+    p_simd->roots = calloc(p_simd->tree_num, sizeof(*p_simd->roots));
+    p_simd->pri_mins = malloc(p_simd->tree_num * sizeof(*p_simd->pri_mins));
+    p_simd->offsets = malloc(p_simd->tree_num * sizeof(*p_simd->offsets));
+    p_simd->buckets = calloc(p_simd->tree_num, sizeof(*p_simd->buckets));
+    if (!p_simd->roots || !p_simd->pri_mins || !p_simd->offsets ||
+        !p_simd->buckets) {
+        f_hs_simd_term(p_simd);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < p_simd->tree_num; i++) {
+        if (i >= p_hs_result->tree_num) {
+            p_simd->pri_mins[i] = INT32_MAX;
+            p_simd->offsets[i] = p_simd->def_rule + 1;
+            continue;
         }
 
-        p_node = MPOOL_ADDR(&p_hs_rt->node_pool, p_wqe->node_id);
-        free(new_rule_id);
-        if (is_inplace) {
-            free(p_wqe);
-            p_node->rchild = p_rs->rules[rid].pri;
+        p_simd->offsets[i] = p_simd->def_rule + 1 +
+            p_hs_result->trees[i].bucket_rule_num;
+        p_simd->buckets[i] = p_hs_result->trees[i].p_bucket;
+
+        p_nodes = is_packed ? (char *)p_hs_result->trees[i].p_pack :
+            (char *)p_hs_result->trees[i].p_root;
+        off = p_nodes - p_simd->base;
+        p_simd->roots[i] = off;
+        p_simd->pri_mins[i] = p_hs_result->trees[i].pri_min;
+    }
+
+    if (p_simd->lanes == HS_SIMD_LANES_MAX) {
+        p_simd->lookup = is_packed ? f_hs_lookup_avx512_pack :
+            f_hs_lookup_avx512;
+    } else {
+        p_simd->lookup = is_packed ? f_hs_lookup_avx2_pack : f_hs_lookup_avx2;
+    }
+
+    return 0;
+}
+
+static void f_hs_simd_term(struct hs_simd *p_simd)
+{
+    free(p_simd->buckets);
+    free(p_simd->offsets);
+    free(p_simd->pri_mins);
+    free(p_simd->roots);
+    p_simd->buckets = NULL;
+    p_simd->offsets = NULL;
+    p_simd->pri_mins = NULL;
+    p_simd->roots = NULL;
+    p_simd->lookup = NULL;
+
+    return;
+}
+
+/* The best match of the leaves a group of trees reached, some of buckets */
+static int f_hs_simd_resolve(const struct hs_simd *p_simd,
+        const uint32_t *leaves, int j, int lanes, const uint32_t *dims,
+        int pri)
+{
+    int i;
+    uint32_t id;
+
+    for (i = 0; i < lanes; i++) {
+        id = leaves[i];
+        if (id > p_simd->def_rule) {
+            id = p_simd->bucket_match(
+                    &p_simd->buckets[j + i][id - p_simd->def_rule - 1],
+                    dims, pri);
+        }
+
+        if (id < pri) {
+            pri = id;
+        }
+    }
+
+    return pri;
+}
+
+/*
+ * Each lane walks one tree: the thresholds and child words of the current
+ * nodes are gathered, and the dimension of each node selects its packet
+ * field by a permutation. Lanes leave the walk on reaching a rule, and a
+ * group of trees is skipped if none of them can beat the current match.
+ */
+__attribute__((target("avx512f")))
+static int f_hs_lookup_avx512(const struct packet *p_pkt,
+        const struct hs_simd *p_simd)
+{
+    int j;
+    int pri;
+    __mmask16 walk, is_le, is_node;
+    uint32_t leaves[HS_SIMD_LANES_MAX];
+    __m512i pkt, def_rule, offset, root, node, thresh, lword, rword, child;
+    __m512i leaf;
+
+    pkt = _mm512_maskz_loadu_epi32((1 << DIM_MAX) - 1, p_pkt->dims);
+    def_rule = _mm512_set1_epi32(p_simd->def_rule);
+
+    /* For each group of trees */
+    pri = p_simd->def_rule;
+    for (j = 0; j < p_simd->tree_num && p_simd->pri_mins[j] < pri;
+        j += HS_SIMD_LANES_MAX) {
+        root = _mm512_loadu_si512(&p_simd->roots[j]);
+        offset = _mm512_loadu_si512(&p_simd->offsets[j]);
+        walk = _mm512_cmplt_epi32_mask(
+                _mm512_loadu_si512(&p_simd->pri_mins[j]),
+                _mm512_set1_epi32(pri));
+        node = root, leaf = _mm512_set1_epi32(pri);
+
+        /* For each level */
+        while (walk) {
+            thresh = _mm512_mask_i32gather_epi32(offset, walk, node,
+                    p_simd->base, 1);
+            lword = _mm512_mask_i32gather_epi32(offset, walk,
+                    _mm512_add_epi32(node, _mm512_set1_epi32(8)),
+                    p_simd->base, 1);
+
+            /* the right child is only read by the lanes going right */
+            is_le = _mm512_mask_cmple_epu32_mask(walk, _mm512_permutexvar_epi32(
+                    _mm512_and_si512(lword, _mm512_set1_epi32(
+                    (1 << (32 - NODE_NUM_BITS)) - 1)), pkt), thresh);
+            rword = _mm512_mask_i32gather_epi32(lword, walk & ~is_le,
+                    _mm512_add_epi32(node, _mm512_set1_epi32(12)),
+                    p_simd->base, 1);
+            child = _mm512_srli_epi32(rword, 32 - NODE_NUM_BITS);
+
+            is_node = _mm512_mask_cmpge_epu32_mask(walk, child, offset);
+            leaf = _mm512_mask_mov_epi32(leaf, walk & ~is_node, child);
+            node = _mm512_mask_add_epi32(node, is_node, root,
+                    _mm512_slli_epi32(_mm512_sub_epi32(child, offset), 4));
+            walk = is_node;
+        }
+
+        if (_mm512_cmpgt_epu32_mask(leaf, def_rule)) {
+            _mm512_storeu_si512(leaves, leaf);
+            pri = f_hs_simd_resolve(p_simd, leaves, j, HS_SIMD_LANES_MAX,
+                    p_pkt->dims, pri);
         } else {
-            p_node->lchild = p_rs->rules[rid].pri;
+            pri = _mm512_reduce_min_epu32(leaf);
         }
+    }
 
-    /* Internal node */
-    } else {
-        uint32_t offset = p_rs->def_rule + 1;
-        ssize_t node_id = MPOOL_MALLOC(hsn_pool, &p_hs_rt->node_pool);
-        if (node_id == -1) {
-            goto err;
+    return pri;
+}
+
+/* Same as above, but one round advances HS_PACK_LEVEL levels of a block */
+__attribute__((target("avx512f")))
+static int f_hs_lookup_avx512_pack(const struct packet *p_pkt,
+        const struct hs_simd *p_simd)
+{
+    int i, j;
+    int pri;
+    __mmask16 walk, is_gt, is_node;
+    uint32_t leaves[HS_SIMD_LANES_MAX];
+    __m512i pkt, def_rule, offset, one, blk, dims, slot, thresh, child, leaf;
+
+    pkt = _mm512_maskz_loadu_epi32((1 << DIM_MAX) - 1, p_pkt->dims);
+    def_rule = _mm512_set1_epi32(p_simd->def_rule);
+    one = _mm512_set1_epi32(1);
+
+    /* For each group of trees */
+    pri = p_simd->def_rule;
+    for (j = 0; j < p_simd->tree_num && p_simd->pri_mins[j] < pri;
+        j += HS_SIMD_LANES_MAX) {
+        blk = _mm512_loadu_si512(&p_simd->roots[j]);
+        offset = _mm512_loadu_si512(&p_simd->offsets[j]);
+        walk = _mm512_cmplt_epi32_mask(
+                _mm512_loadu_si512(&p_simd->pri_mins[j]),
+                _mm512_set1_epi32(pri));
+        leaf = _mm512_set1_epi32(pri);
+
+        /* For each block */
+        while (walk) {
+            dims = _mm512_mask_i32gather_epi32(offset, walk,
+                    _mm512_add_epi32(blk, _mm512_set1_epi32(
+                    offsetof(struct hs_pack_node, dims))), p_simd->base, 1);
+
+            slot = _mm512_setzero_si512();
+            for (i = 0; i < HS_PACK_LEVEL; i++) {
+                thresh = _mm512_mask_i32gather_epi32(offset, walk,
+                        _mm512_add_epi32(blk, _mm512_slli_epi32(slot, 2)),
+                        p_simd->base, 1);
+                is_gt = _mm512_mask_cmpgt_epu32_mask(walk,
+                        _mm512_permutexvar_epi32(_mm512_and_si512(
+                        _mm512_srlv_epi32(dims, _mm512_mullo_epi32(slot,
+                        _mm512_set1_epi32(HS_PACK_DIM_BITS))),
+                        _mm512_set1_epi32(HS_PACK_DIM_MASK)), pkt), thresh);
+                slot = _mm512_add_epi32(_mm512_add_epi32(slot, slot), one);
+                slot = _mm512_mask_add_epi32(slot, is_gt, slot, one);
+            }
+
+            child = _mm512_mask_i32gather_epi32(offset, walk,
+                    _mm512_add_epi32(blk, _mm512_slli_epi32(_mm512_add_epi32(
+                    slot, _mm512_set1_epi32(offsetof(struct hs_pack_node,
+                    child) / sizeof(uint32_t) - HS_PACK_INODE)), 2)),
+                    p_simd->base, 1);
+
+            is_node = _mm512_mask_cmpge_epu32_mask(walk, child, offset);
+            leaf = _mm512_mask_mov_epi32(leaf, walk & ~is_node, child);
+            blk = _mm512_mask_add_epi32(blk, is_node, blk,
+                    _mm512_slli_epi32(_mm512_sub_epi32(child, offset), 6));
+            walk = is_node;
         }
 
-        p_node = MPOOL_ADDR(&p_hs_rt->node_pool, p_wqe->node_id);
-        if (is_inplace) {
-            p_new_wqe = p_wqe;
-            p_node->rchild = node_id + offset;
+        if (_mm512_cmpgt_epu32_mask(leaf, def_rule)) {
+            _mm512_storeu_si512(leaves, leaf);
+            pri = f_hs_simd_resolve(p_simd, leaves, j, HS_SIMD_LANES_MAX,
+                    p_pkt->dims, pri);
+        } else {
+            pri = _mm512_reduce_min_epu32(leaf);
+        }
+    }
+
+    return pri;
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t f_hs_reduce_min_avx2(__m256i v)
+{
+    __m128i m = _mm_min_epu32(_mm256_castsi256_si128(v),
+            _mm256_extracti128_si256(v, 1));
+
+    m = _mm_min_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_min_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return _mm_cvtsi128_si32(m);
+}
+
+/* AVX2 has no mask registers: lanes are masked by all-ones vectors */
+__attribute__((target("avx2")))
+static int f_hs_lookup_avx2(const struct packet *p_pkt,
+        const struct hs_simd *p_simd)
+{
+    int j;
+    int pri;
+    uint32_t leaves[HS_SIMD_LANES_MAX >> 1];
+    __m256i pkt, def_rule, offset, root, node, thresh, lword, rword, value;
+    __m256i child, leaf, walk, is_le, is_node;
+
+    pkt = _mm256_maskload_epi32((const int *)p_pkt->dims, _mm256_setr_epi32(
+            -1, -1, -1, -1, -1, 0, 0, 0));
+    def_rule = _mm256_set1_epi32(p_simd->def_rule);
+
+    /* For each group of trees */
+    pri = p_simd->def_rule;
+    for (j = 0; j < p_simd->tree_num && p_simd->pri_mins[j] < pri;
+        j += HS_SIMD_LANES_MAX >> 1) {
+        root = _mm256_loadu_si256((const __m256i *)&p_simd->roots[j]);
+        offset = _mm256_loadu_si256((const __m256i *)&p_simd->offsets[j]);
+        walk = _mm256_cmpgt_epi32(_mm256_set1_epi32(pri),
+                _mm256_loadu_si256((const __m256i *)&p_simd->pri_mins[j]));
+        node = root, leaf = _mm256_set1_epi32(pri);
+
+        /* For each level */
+        while (!_mm256_testz_si256(walk, walk)) {
+            thresh = _mm256_mask_i32gather_epi32(offset,
+                    (const int *)p_simd->base, node, walk, 1);
+            lword = _mm256_mask_i32gather_epi32(offset,
+                    (const int *)p_simd->base,
+                    _mm256_add_epi32(node, _mm256_set1_epi32(8)), walk, 1);
+
+            value = _mm256_permutevar8x32_epi32(pkt, _mm256_and_si256(lword,
+                    _mm256_set1_epi32((1 << (32 - NODE_NUM_BITS)) - 1)));
+            is_le = _mm256_cmpeq_epi32(_mm256_max_epu32(value, thresh),
+                    thresh);
+            rword = _mm256_mask_i32gather_epi32(lword,
+                    (const int *)p_simd->base,
+                    _mm256_add_epi32(node, _mm256_set1_epi32(12)),
+                    _mm256_andnot_si256(is_le, walk), 1);
+            child = _mm256_srli_epi32(rword, 32 - NODE_NUM_BITS);
+
+            /* children and offset are below 2^31 */
+            is_node = _mm256_and_si256(walk, _mm256_cmpgt_epi32(child,
+                    _mm256_sub_epi32(offset, _mm256_set1_epi32(1))));
+            leaf = _mm256_blendv_epi8(leaf, child,
+                    _mm256_andnot_si256(is_node, walk));
+            node = _mm256_blendv_epi8(node, _mm256_add_epi32(root,
+                    _mm256_slli_epi32(_mm256_sub_epi32(child, offset), 4)),
+                    is_node);
+            walk = is_node;
+        }
+
+        /* children and def_rule are below 2^31 */
+        if (!_mm256_testz_si256(_mm256_cmpgt_epi32(leaf, def_rule),
+            _mm256_cmpgt_epi32(leaf, def_rule))) {
+            _mm256_storeu_si256((__m256i *)leaves, leaf);
+            pri = f_hs_simd_resolve(p_simd, leaves, j,
+                    HS_SIMD_LANES_MAX >> 1, p_pkt->dims, pri);
+        } else {
+            pri = f_hs_reduce_min_avx2(leaf);
+        }
+    }
+
+    return pri;
+}
+
+__attribute__((target("avx2")))
+static int f_hs_lookup_avx2_pack(const struct packet *p_pkt,
+        const struct hs_simd *p_simd)
+{
+    int i, j;
+    int pri;
+    uint32_t leaves[HS_SIMD_LANES_MAX >> 1];
+    __m256i pkt, def_rule, offset, one, blk, dims, slot, thresh, value;
+    __m256i child, leaf, walk, is_gt, is_node;
+
+    pkt = _mm256_maskload_epi32((const int *)p_pkt->dims, _mm256_setr_epi32(
+            -1, -1, -1, -1, -1, 0, 0, 0));
+    def_rule = _mm256_set1_epi32(p_simd->def_rule);
+    one = _mm256_set1_epi32(1);
+
+    /* For each group of trees */
+    pri = p_simd->def_rule;
+    for (j = 0; j < p_simd->tree_num && p_simd->pri_mins[j] < pri;
+        j += HS_SIMD_LANES_MAX >> 1) {
+        blk = _mm256_loadu_si256((const __m256i *)&p_simd->roots[j]);
+        offset = _mm256_loadu_si256((const __m256i *)&p_simd->offsets[j]);
+        walk = _mm256_cmpgt_epi32(_mm256_set1_epi32(pri),
+                _mm256_loadu_si256((const __m256i *)&p_simd->pri_mins[j]));
+        leaf = _mm256_set1_epi32(pri);
+
+        /* For each block */
+        while (!_mm256_testz_si256(walk, walk)) {
+            dims = _mm256_mask_i32gather_epi32(offset,
+                    (const int *)p_simd->base, _mm256_add_epi32(blk,
+                    _mm256_set1_epi32(offsetof(struct hs_pack_node, dims))),
+                    walk, 1);
+
+            slot = _mm256_setzero_si256();
+            for (i = 0; i < HS_PACK_LEVEL; i++) {
+                thresh = _mm256_mask_i32gather_epi32(offset,
+                        (const int *)p_simd->base, _mm256_add_epi32(blk,
+                        _mm256_slli_epi32(slot, 2)), walk, 1);
+                value = _mm256_permutevar8x32_epi32(pkt, _mm256_and_si256(
+                        _mm256_srlv_epi32(dims, _mm256_mullo_epi32(slot,
+                        _mm256_set1_epi32(HS_PACK_DIM_BITS))),
+                        _mm256_set1_epi32(HS_PACK_DIM_MASK)));
+                is_gt = _mm256_xor_si256(_mm256_cmpeq_epi32(
+                        _mm256_max_epu32(value, thresh), thresh),
+                        _mm256_set1_epi32(-1));
+
+                /* slot * 2 + 1, plus 1 more on the right */
+                slot = _mm256_sub_epi32(_mm256_add_epi32(
+                        _mm256_add_epi32(slot, slot), one), is_gt);
+            }
+
+            child = _mm256_mask_i32gather_epi32(offset,
+                    (const int *)p_simd->base, _mm256_add_epi32(blk,
+                    _mm256_slli_epi32(_mm256_add_epi32(slot, _mm256_set1_epi32(
+                    offsetof(struct hs_pack_node, child) / sizeof(uint32_t) -
+                    HS_PACK_INODE)), 2)), walk, 1);
+
+            is_node = _mm256_and_si256(walk, _mm256_cmpgt_epi32(child,
+                    _mm256_sub_epi32(offset, one)));
+            leaf = _mm256_blendv_epi8(leaf, child,
+                    _mm256_andnot_si256(is_node, walk));
+            blk = _mm256_blendv_epi8(blk, _mm256_add_epi32(blk,
+                    _mm256_slli_epi32(_mm256_sub_epi32(child, offset), 6)),
+                    is_node);
+            walk = is_node;
+        }
+
+        /* children and def_rule are below 2^31 */
+        if (!_mm256_testz_si256(_mm256_cmpgt_epi32(leaf, def_rule),
+            _mm256_cmpgt_epi32(leaf, def_rule))) {
+            _mm256_storeu_si256((__m256i *)leaves, leaf);
+            pri = f_hs_simd_resolve(p_simd, leaves, j,
+                    HS_SIMD_LANES_MAX >> 1, p_pkt->dims, pri);
         } else {
-            p_new_wqe = malloc(sizeof(*p_new_wqe));
-            if (!p_new_wqe) {
-                goto err;
+            pri = f_hs_reduce_min_avx2(leaf);
+        }
+    }
+
+    return pri;
+}
+
+static inline uint64_t f_hs_dag_hash(uint64_t a, uint64_t b)
+{
+    a = (a ^ b) * 0x9e3779b97f4a7c15ULL;
+
+    return a ^ (a >> 29);
+}
+
+/*
+ * Drop the buckets equal to an earlier one, and map the first rule of each
+ * old bucket to that of the one kept. A rule priority identifies the rule,
+ * so buckets of the same priorities are equal.
+ */
+static int f_hs_dag_buckets(struct hs_tree *p_tree, uint32_t def_rule,
+        uint32_t *bucket_map)
+{
+    int start, end, len, rule_num = 0, bucket_num = 0;
+    uint32_t *slots, mask, pos, cand, pri;
+    uint64_t h;
+    struct hs_bucket_rule *p_bucket, *p_br = p_tree->p_bucket;
+
+    mask = p2roundup(p_tree->bucket_num << 1) - 1;
+    slots = calloc(mask + 1, sizeof(*slots)); /* kept start + 1, 0 if empty */
+    if (posix_memalign((void **)&p_bucket, sizeof(*p_bucket),
+        p_tree->bucket_rule_num * sizeof(*p_bucket)) || !slots) {
+        free(slots);
+        return -ENOMEM;
+    }
+
+    for (start = 0; start < p_tree->bucket_rule_num; start = end) {
+        h = 0;
+        for (end = start; ; end++) {
+            pri = p_br[end].lo[HS_BUCKET_PRI];
+            h = f_hs_dag_hash(h, pri);
+            if (pri == def_rule) {
+                break;
             }
-            p_node->lchild = node_id + offset;
-            memcpy(p_new_wqe->space, p_wqe->space, sizeof(p_new_wqe->space));
-            p_new_wqe->rule_id = new_rule_id;
         }
-        p_new_wqe->node_id = node_id;
-        p_new_wqe->rule_num = new_rule_num;
-        p_new_wqe->depth = p_wqe->depth + 1;
-        p_tree->inode_num++;
-        STAILQ_INSERT_HEAD(&p_hs_rt->wqh, p_new_wqe, e);
+
+        len = ++end - start;
+        for (pos = h & mask; slots[pos]; pos = (pos + 1) & mask) {
+            cand = slots[pos] - 1;
+            if (cand + len <= (uint32_t)rule_num && !memcmp(&p_bucket[cand], &p_br[start],
+                    len * sizeof(*p_br))) {
+                break;
+            }
+        }
+
+        if (!slots[pos]) {
+            memcpy(&p_bucket[rule_num], &p_br[start], len * sizeof(*p_br));
+            slots[pos] = rule_num + 1;
+            rule_num += len, bucket_num++;
+        }
+
+        bucket_map[start] = slots[pos] - 1;
     }
 
+    free(slots);
+    free(p_tree->p_bucket);
+
+    p_tree->p_bucket = p_bucket;
+    p_tree->bucket_num = bucket_num;
+    p_tree->bucket_rule_num = rule_num;
+
     return 0;
+}
 
-err:
-    if (!is_inplace) {
-        free(new_rule_id);
+/*
+ * Children come after their parents in the node array, so a backward pass
+ * meets the children of a node first. Each node is put in the class of an
+ * equal node met before, if any, and the class keeps its first node in the
+ * array. The kept nodes are then renumbered in their old order.
+ */
+static int f_hs_dag_tree(struct hs_tree *p_tree, uint32_t def_rule)
+{
+    int i, side, node_num = 0, ret = 0;
+    uint32_t offset, dag_offset, id, mask, pos, cls;
+    uint32_t *bucket_map, *classes, *heads, *children, *slots, *new_ids;
+    uint64_t h;
+    struct hs_node *p_root = p_tree->p_root, *p_dag;
+
+    assert(p_tree && p_tree->p_root && !p_tree->p_pack);
+
+    offset = def_rule + 1 + p_tree->bucket_rule_num;
+    mask = p2roundup(p_tree->inode_num << 1) - 1;
+
+    bucket_map = malloc((p_tree->bucket_rule_num + 1) * sizeof(*bucket_map));
+    classes = malloc(p_tree->inode_num * sizeof(*classes));
+    heads = malloc(p_tree->inode_num * sizeof(*heads));
+    children = malloc((p_tree->inode_num << 1) * sizeof(*children));
+    new_ids = malloc(p_tree->inode_num * sizeof(*new_ids));
+    slots = calloc(mask + 1, sizeof(*slots)); /* class + 1, 0 if empty */
+    if (!bucket_map || !classes || !heads || !children || !new_ids ||
+        !slots) {
+        ret = -ENOMEM;
+        goto out;
     }
 
-    return -ENOMEM;
+    if (p_tree->bucket_rule_num) {
+        ret = f_hs_dag_buckets(p_tree, def_rule, bucket_map);
+        if (ret) {
+            goto out;
+        }
+    }
+
+    /* Children are canonical: kept buckets, and node classes past dag_offset */
+    dag_offset = def_rule + 1 + p_tree->bucket_rule_num;
+    for (i = p_tree->inode_num - 1; i >= 0; i--) {
+        for (side = 0; side < 2; side++) {
+            id = side ? p_root[i].rchild : p_root[i].lchild;
+            if (id >= offset) {
+                id = dag_offset + classes[id - offset];
+            } else if (id > def_rule) {
+                id = def_rule + 1 + bucket_map[id - def_rule - 1];
+            }
+
+            children[(i << 1) + side] = id;
+        }
+
+        h = f_hs_dag_hash(p_root[i].thresh, p_root[i].dim);
+        h = f_hs_dag_hash(h, (uint64_t)children[i << 1] << 32 |
+                children[(i << 1) + 1]);
+        for (pos = h & mask; slots[pos]; pos = (pos + 1) & mask) {
+            cls = slots[pos] - 1;
+            if (p_root[cls].thresh == p_root[i].thresh &&
+                p_root[cls].dim == p_root[i].dim &&
+                children[cls << 1] == children[i << 1] &&
+                children[(cls << 1) + 1] == children[(i << 1) + 1]) {
+                break;
+            }
+        }
+
+        if (!slots[pos]) {
+            slots[pos] = i + 1;
+        }
+
+        classes[i] = slots[pos] - 1;
+        heads[classes[i]] = i;
+    }
+
+    /* The root is the first node of its class, and stays the first */
+    for (i = 0; i < p_tree->inode_num; i++) {
+        if (heads[classes[i]] == (uint32_t)i) {
+            new_ids[classes[i]] = node_num++;
+        }
+    }
+
+    p_dag = malloc(node_num * sizeof(*p_dag));
+    if (!p_dag) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for (i = 0; i < p_tree->inode_num; i++) {
+        if (heads[classes[i]] != (uint32_t)i) {
+            continue;
+        }
+
+        cls = new_ids[classes[i]];
+        p_dag[cls] = p_root[i];
+        for (side = 0; side < 2; side++) {
+            id = children[(i << 1) + side];
+            if (id >= dag_offset) {
+                id = dag_offset + new_ids[id - dag_offset];
+            }
+
+            if (side) {
+                p_dag[cls].rchild = id;
+            } else {
+                p_dag[cls].lchild = id;
+            }
+        }
+    }
+
+    free(p_tree->p_root);
+    p_tree->p_root = p_dag;
+    p_tree->inode_num = node_num;
+
+out:
+    free(slots);
+    free(new_ids);
+    free(children);
+    free(heads);
+    free(classes);
+    free(bucket_map);
+
+    return ret;
 }
 
-static int f_space_is_fully_covered(uint32_t (*left)[2], uint32_t (*right)[2])
+static int f_hs_write(FILE *fp, const void *p, size_t size, uint64_t *p_off)
 {
-    int i;
+    if (size && fwrite(p, size, 1, fp) != 1) {
+        return -EIO;
+    }
 
-    assert(left && right);
+    *p_off += size;
 
-    for (i = 0; i < DIM_MAX; i++) {
-        /* left is fully covered by right */
-        if (left[i][0] < right[i][0] || left[i][1] > right[i][1]) {
-            return 0;
+    return 0;
+}
+
+static int f_hs_pack_tree(struct hs_tree *p_tree, uint32_t offset)
+{
+    int top, blk_num, *depths;
+    uint32_t *ids;
+    void *blks;
+    struct hs_pack_runtime pack_rt;
+
+    assert(p_tree && p_tree->p_root && !p_tree->p_pack);
+
+    /* DFS stack: at most one pending sibling per level */
+    ids = malloc((p_tree->depth_max + 1) * sizeof(*ids));
+    depths = malloc((p_tree->depth_max + 1) * sizeof(*depths));
+    if (!ids || !depths) {
+        free(depths);
+        free(ids);
+        return -ENOMEM;
+    }
+
+    /* Each block is rooted at an internal node of depth HS_PACK_LEVEL * k */
+    ids[0] = 0, depths[0] = 0, top = 1;
+    for (blk_num = 0; top > 0; ) {
+        const struct hs_node *p_node;
+        int depth;
+
+        top--;
+        p_node = p_tree->p_root + ids[top];
+        depth = depths[top];
+        if (depth % HS_PACK_LEVEL == 0) {
+            blk_num++;
+        }
+
+        if (p_node->lchild >= offset) {
+            ids[top] = p_node->lchild - offset, depths[top++] = depth + 1;
+        }
+
+        /* the root of an unsplit tree never goes right */
+        if (p_node->thresh < UINT32_MAX && p_node->rchild >= offset) {
+            ids[top] = p_node->rchild - offset, depths[top++] = depth + 1;
         }
     }
 
-    return 1;
+    free(depths);
+    free(ids);
+
+    if (posix_memalign(&blks, sizeof(struct hs_pack_node),
+        blk_num * sizeof(struct hs_pack_node))) {
+        return -ENOMEM;
+    }
+
+    pack_rt.blk_node = malloc(blk_num * sizeof(*pack_rt.blk_node));
+    if (!pack_rt.blk_node) {
+        free(blks);
+        return -ENOMEM;
+    }
+
+    /* Blocks are laid out in BFS order, so child offsets are positive */
+    pack_rt.p_root = p_tree->p_root;
+    pack_rt.blks = blks;
+    pack_rt.offset = offset;
+    pack_rt.blk_node[0] = 0;
+    pack_rt.blk_num = 1;
+
+    for (top = 0; top < pack_rt.blk_num; top++) {
+        pack_rt.blks[top].dims = 0;
+        f_hs_pack_fill(&pack_rt, top, 0, pack_rt.blk_node[top] + offset);
+    }
+
+    assert(pack_rt.blk_num == blk_num);
+    free(pack_rt.blk_node);
+
+    free(p_tree->p_root);
+    p_tree->p_root = NULL;
+    p_tree->p_pack = blks;
+    p_tree->pack_num = blk_num;
+
+    return 0;
+}
+
+static void f_hs_pack_fill(struct hs_pack_runtime *p_pack_rt, int blk,
+        int slot, uint32_t ref)
+{
+    const struct hs_node *p_node;
+    struct hs_pack_node *p_blk = &p_pack_rt->blks[blk];
+    uint32_t offset = p_pack_rt->offset;
+
+    /* Children of the block: a rule or the root of a new block */
+    if (slot >= HS_PACK_INODE) {
+        if (ref < offset) {
+            p_blk->child[slot - HS_PACK_INODE] = ref;
+        } else {
+            p_pack_rt->blk_node[p_pack_rt->blk_num] = ref - offset;
+            p_blk->child[slot - HS_PACK_INODE] =
+                p_pack_rt->blk_num++ - blk + offset;
+        }
+
+        return;
+    }
+
+    /* A rule above the last level: pad with a node that always goes left */
+    if (ref < offset) {
+        p_blk->thresh[slot] = UINT32_MAX;
+        f_hs_pack_fill(p_pack_rt, blk, (slot << 1) + 1, ref);
+        f_hs_pack_fill(p_pack_rt, blk, (slot << 1) + 2, ref);
+        return;
+    }
+
+    p_node = p_pack_rt->p_root + ref - offset;
+    p_blk->thresh[slot] = p_node->thresh;
+    p_blk->dims |= p_node->dim << (slot * HS_PACK_DIM_BITS);
+    f_hs_pack_fill(p_pack_rt, blk, (slot << 1) + 1, p_node->lchild);
+    f_hs_pack_fill(p_pack_rt, blk, (slot << 1) + 2,
+            p_node->thresh < UINT32_MAX ? p_node->rchild : p_node->lchild);
+
+    return;
 }
 
+static inline uint32_t f_hs_pack_step(const struct hs_pack_node *p_blk,
+        const uint32_t *dims)
+{
+    register int i, slot, dim;
+
+    for (slot = i = 0; i < HS_PACK_LEVEL; i++) {
+        dim = (p_blk->dims >> (slot * HS_PACK_DIM_BITS)) & HS_PACK_DIM_MASK;
+        slot = (slot << 1) + 1 + (dims[dim] > p_blk->thresh[slot]);
+    }
+
+    return p_blk->child[slot - HS_PACK_INODE];
+}
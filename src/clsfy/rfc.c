@@ -0,0 +1,721 @@
+/*
+ *     Filename: rfc.c
+ *  Description: Source file for Recursive Flow Classification
+ *
+ *       Author: Xiang Wang (xiang.wang.s@gmail.com)
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "common/impl.h"
+#include "common/utils.h"
+#include "clsfy/rfc.h"
+
+
+/* The distinct rule bitmaps of a table, hashed to their class ids */
+struct rfc_classes {
+    uint64_t *bms;
+    int *spans; /* first and last nonzero words of each bitmap */
+    int num;
+    int cap;
+    int *slots;
+    uint32_t slot_mask;
+};
+
+struct rfc_context {
+    const struct rule_set *p_rs;
+    struct rfc_set *p_set;
+    int *rule_id; /* rules of the set, in priority order */
+    int rule_num;
+    int word_num; /* of a bitmap, a bit per piece */
+    struct rule *pieces; /* the rules cut to chunks, pri is the bit */
+    int *pris; /* of the rule of each piece */
+    int piece_num;
+    struct rfc_classes classes[RFC_TABLE_NUM - 1];
+};
+
+
+static const struct {
+    int dim;
+    int shift;
+    uint32_t max;
+} s_rfc_chunks[RFC_CHUNK_NUM] = {
+    {DIM_SIP, 16, UINT16_MAX}, {DIM_SIP, 0, UINT16_MAX},
+    {DIM_DIP, 16, UINT16_MAX}, {DIM_DIP, 0, UINT16_MAX},
+    {DIM_SPORT, 0, UINT16_MAX}, {DIM_DPORT, 0, UINT16_MAX},
+    {DIM_PROTO, 0, UINT8_MAX}
+};
+
+/* The tables each phase table combines, -1 past the last */
+static const int s_rfc_inputs[RFC_TABLE_NUM][3] = {
+    [7] = {0, 1, -1}, [8] = {2, 3, -1}, [9] = {4, 5, 6},
+    [10] = {7, 8, -1}, [11] = {10, 9, -1}
+};
+
+
+static int f_rfc_set(struct rfc_context *p_ctx, int cur);
+static int f_rfc_pieces(struct rfc_context *p_ctx);
+static int f_rfc_cut(uint32_t lo, uint32_t hi, uint32_t (*cuts)[2]);
+static int f_rfc_chunk(struct rfc_context *p_ctx, int t);
+static int f_rfc_phase(struct rfc_context *p_ctx, int t);
+static int f_rfc_interval(const uint32_t *pnts, int num, uint32_t value);
+static int f_rfc_class(struct rfc_classes *p_cls, const uint64_t *bm,
+        int lo, int hi, int word_num);
+static void f_rfc_trim(const uint64_t *bm, int *p_lo, int *p_hi);
+static inline uint64_t f_rfc_hash(const uint64_t *bm, int lo, int hi);
+
+static inline int f_rfc_lookup(const struct packet *p_pkt,
+        const struct rfc_result *p_rfc_result);
+
+
+int rfc_build(void *built_result, const struct partition *p_pa)
+{
+    int i, t, ret = 0;
+    size_t chunk_num = 0, phase_num = 0;
+    struct rfc_context ctx;
+    struct rfc_result *p_rfc_result;
+
+    if (!built_result || !p_pa || !p_pa->subsets || p_pa->subset_num <= 0 ||
+        p_pa->rule_num <= 1) {
+        return -EINVAL;
+    }
+
+    p_rfc_result = malloc(sizeof(*p_rfc_result));
+    if (!p_rfc_result) {
+        return -ENOMEM;
+    }
+
+    p_rfc_result->sets = calloc(p_pa->subset_num,
+            sizeof(*p_rfc_result->sets));
+    p_rfc_result->set_num = p_pa->subset_num;
+    p_rfc_result->def_rule = p_pa->subsets[0].def_rule;
+    if (!p_rfc_result->sets) {
+        free(p_rfc_result);
+        return -ENOMEM;
+    }
+
+    *(typeof(p_rfc_result) *)built_result = p_rfc_result;
+
+    for (i = 0; i < p_pa->subset_num; i++) {
+        ctx.p_rs = &p_pa->subsets[i];
+        ctx.p_set = &p_rfc_result->sets[i];
+        ret = f_rfc_set(&ctx, i);
+        if (ret) {
+            rfc_destroy(built_result);
+            *(typeof(p_rfc_result) *)built_result = NULL;
+            return ret;
+        }
+
+        for (t = 0; t < RFC_TABLE_NUM; t++) {
+            if (t < RFC_CHUNK_NUM) {
+                chunk_num += ctx.p_set->tables[t].entry_num;
+            } else {
+                phase_num += ctx.p_set->tables[t].entry_num;
+            }
+        }
+    }
+
+    fprintf(stderr, "%zu chunk entries (%zu bytes), %zu phase entries "
+            "(%zu bytes)\n", chunk_num, chunk_num * sizeof(uint32_t),
+            phase_num, phase_num * sizeof(uint32_t));
+
+    /* by pri_min, so the sets after a good enough match are never read */
+    QSORT(rfc_set, p_rfc_result->sets, p_rfc_result->set_num);
+
+    return 0;
+}
+
+/* The best rule a packet matches, reading the 12 tables of each set */
+int rfc_lookup(const struct packet *p_pkt, const void *built_result)
+{
+    const struct rfc_result *p_rfc_result;
+
+    assert(p_pkt && built_result);
+
+    p_rfc_result = *(typeof(p_rfc_result) *)built_result;
+
+    return f_rfc_lookup(p_pkt, p_rfc_result);
+}
+
+/* Bytes of the sets: the entries of all their tables */
+size_t rfc_memory(const void *built_result)
+{
+    int i, t;
+    size_t size;
+    const struct rfc_result *p_rfc_result;
+
+    if (!built_result) {
+        return 0;
+    }
+
+    p_rfc_result = *(typeof(p_rfc_result) *)built_result;
+    if (!p_rfc_result || !p_rfc_result->sets) {
+        return 0;
+    }
+
+    size = p_rfc_result->set_num * sizeof(*p_rfc_result->sets);
+    for (i = 0; i < p_rfc_result->set_num; i++) {
+        for (t = 0; t < RFC_TABLE_NUM; t++) {
+            size += p_rfc_result->sets[i].tables[t].entry_num *
+                sizeof(uint32_t);
+        }
+    }
+
+    return size;
+}
+
+void rfc_destroy(void *built_result)
+{
+    int i, t;
+    struct rfc_result *p_rfc_result;
+
+    if (!built_result) {
+        return;
+    }
+
+    p_rfc_result = *(typeof(p_rfc_result) *)built_result;
+    if (!p_rfc_result || !p_rfc_result->sets) {
+        return;
+    }
+
+    for (i = 0; i < p_rfc_result->set_num; i++) {
+        for (t = 0; t < RFC_TABLE_NUM; t++) {
+            free(p_rfc_result->sets[i].tables[t].ids);
+        }
+    }
+
+    free(p_rfc_result->sets);
+    free(p_rfc_result);
+
+    return;
+}
+
+static int f_rfc_set(struct rfc_context *p_ctx, int cur)
+{
+    int i, t, ret = 0;
+    struct rfc_set *p_set = p_ctx->p_set;
+    const struct rule_set *p_rs = p_ctx->p_rs;
+
+    assert(p_rs->rules && p_rs->rule_num > 0);
+
+    p_ctx->rule_id = malloc(p_rs->rule_num * sizeof(*p_ctx->rule_id));
+    if (!p_ctx->rule_id) {
+        return -ENOMEM;
+    }
+
+    /* The default rule has no bit: table 11 maps an empty class to it */
+    p_set->pri_min = p_rs->def_rule;
+    for (p_ctx->rule_num = i = 0; i < p_rs->rule_num; i++) {
+        if (p_rs->rules[i].pri != p_rs->def_rule) {
+            p_set->pri_min = MIN(p_set->pri_min, p_rs->rules[i].pri);
+            p_ctx->rule_id[p_ctx->rule_num++] = i;
+        }
+    }
+
+    /* a set of the default rule alone is never searched */
+    if (!p_ctx->rule_num) {
+        free(p_ctx->rule_id);
+        return 0;
+    }
+
+    memset(p_ctx->classes, 0, sizeof(p_ctx->classes));
+
+    ret = f_rfc_pieces(p_ctx);
+    p_ctx->word_num = (p_ctx->piece_num + 63) / 64;
+    for (t = 0; !ret && t < RFC_TABLE_NUM; t++) {
+        ret = t < RFC_CHUNK_NUM ? f_rfc_chunk(p_ctx, t) :
+            f_rfc_phase(p_ctx, t);
+    }
+
+    if (ret) {
+        fprintf(stderr, "Cannot build the tables of subset %d\n", cur);
+    }
+
+    for (t = 0; t < RFC_TABLE_NUM - 1; t++) {
+        free(p_ctx->classes[t].bms);
+        free(p_ctx->classes[t].spans);
+        free(p_ctx->classes[t].slots);
+    }
+
+    free(p_ctx->pieces);
+    free(p_ctx->pris);
+    free(p_ctx->rule_id);
+
+    return ret;
+}
+
+/*
+ * An address range spanning several values of its high chunk is the cross
+ * product of its chunk projections only if it is aligned to them, so the
+ * others are cut into up to 3 aligned pieces. Each piece has a bit of its
+ * own, or phase 1 would pair the high chunk of one piece with the low chunk
+ * of another. The bits follow the rules, so the first is still the best.
+ */
+static int f_rfc_pieces(struct rfc_context *p_ctx)
+{
+    int i, j, k, d, sip_num, dip_num;
+    uint32_t sips[3][2], dips[3][2];
+    struct rule *p_rule;
+    const struct rule *p_orig;
+
+    p_ctx->piece_num = 0;
+    p_ctx->pieces = malloc(p_ctx->rule_num * 9 * sizeof(*p_ctx->pieces));
+    p_ctx->pris = malloc(p_ctx->rule_num * 9 * sizeof(*p_ctx->pris));
+    if (!p_ctx->pieces || !p_ctx->pris) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < p_ctx->rule_num; i++) {
+        p_orig = &p_ctx->p_rs->rules[p_ctx->rule_id[i]];
+        sip_num = f_rfc_cut(p_orig->dims[DIM_SIP][0],
+                p_orig->dims[DIM_SIP][1], sips);
+        dip_num = f_rfc_cut(p_orig->dims[DIM_DIP][0],
+                p_orig->dims[DIM_DIP][1], dips);
+
+        for (j = 0; j < sip_num; j++) {
+            for (k = 0; k < dip_num; k++) {
+                p_rule = &p_ctx->pieces[p_ctx->piece_num++];
+                for (d = 0; d < DIM_MAX; d++) {
+                    p_rule->dims[d][0] = p_orig->dims[d][0];
+                    p_rule->dims[d][1] = p_orig->dims[d][1];
+                }
+
+                p_rule->dims[DIM_SIP][0] = sips[j][0];
+                p_rule->dims[DIM_SIP][1] = sips[j][1];
+                p_rule->dims[DIM_DIP][0] = dips[k][0];
+                p_rule->dims[DIM_DIP][1] = dips[k][1];
+                p_rule->pri = p_ctx->piece_num - 1;
+                p_ctx->pris[p_rule->pri] = p_orig->pri;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int f_rfc_cut(uint32_t lo, uint32_t hi, uint32_t (*cuts)[2])
+{
+    int num = 0;
+    uint32_t tail = hi;
+
+    if ((lo ^ hi) <= UINT16_MAX || ((lo & UINT16_MAX) == 0 &&
+        (hi & UINT16_MAX) == UINT16_MAX)) {
+        cuts[0][0] = lo, cuts[0][1] = hi;
+        return 1;
+    }
+
+    /* lo and hi are in different high chunks: no overflow below */
+    if (lo & UINT16_MAX) {
+        cuts[num][0] = lo, cuts[num++][1] = lo | UINT16_MAX;
+        lo = (lo | UINT16_MAX) + 1;
+    }
+
+    if ((hi & UINT16_MAX) != UINT16_MAX) {
+        hi = (hi & ~UINT16_MAX) - 1;
+    }
+
+    if (lo <= hi) {
+        cuts[num][0] = lo, cuts[num++][1] = hi;
+    }
+
+    if (hi != tail) {
+        cuts[num][0] = hi + 1, cuts[num++][1] = tail;
+    }
+
+    return num;
+}
+
+/*
+ * The values of a chunk are cut at the endpoints of the rule projections,
+ * and each piece maps to the class of the rules covering it
+ */
+static int f_rfc_chunk(struct rfc_context *p_ctx, int t)
+{
+    int i, k, e, ret, num, pnt_num, id, empty, first, last;
+    int *rule_id = NULL, *cnts = NULL;
+    int64_t *spnts = NULL, *keys = NULL;
+    uint32_t v, lo, hi, rng[2];
+    uint64_t *bm = NULL;
+    struct rule *projs = NULL;
+    struct shadow_range srng = {NULL, NULL, 0, 0};
+    struct rfc_table *p_table = &p_ctx->p_set->tables[t];
+    struct rfc_classes *p_cls = &p_ctx->classes[t];
+    int dim = s_rfc_chunks[t].dim, shift = s_rfc_chunks[t].shift;
+    int piece_num = p_ctx->piece_num;
+
+    rng[0] = 0;
+    rng[1] = s_rfc_chunks[t].max;
+
+    ret = -ENOMEM;
+    p_table->ids = malloc((rng[1] + 1) * sizeof(*p_table->ids));
+    projs = malloc(piece_num * sizeof(*projs));
+    rule_id = malloc(piece_num * sizeof(*rule_id));
+    /* piece endpoints, which shadow_rules radix sorts in twice their room */
+    spnts = malloc(piece_num * 4 * sizeof(*spnts));
+    keys = malloc(piece_num * 4 * sizeof(*keys));
+    srng.pnts = malloc(piece_num * 4 * sizeof(*srng.pnts));
+    cnts = calloc(piece_num, sizeof(*cnts));
+    bm = calloc(p_ctx->word_num, sizeof(*bm));
+    if (!p_table->ids || !projs || !rule_id || !spnts || !keys ||
+        !srng.pnts || !cnts || !bm) {
+        goto err;
+    }
+
+    p_table->entry_num = rng[1] + 1;
+
+    for (k = 0; k < piece_num; k++) {
+        lo = p_ctx->pieces[k].dims[dim][0] >> shift;
+        hi = p_ctx->pieces[k].dims[dim][1] >> shift;
+        if ((lo ^ hi) > rng[1]) {
+            lo = 0, hi = rng[1];
+        }
+
+        projs[k].dims[DIM_SIP][0] = lo & rng[1];
+        projs[k].dims[DIM_SIP][1] = hi & rng[1];
+        rule_id[k] = k;
+    }
+
+    ret = shadow_rules(&srng, spnts, rng, rule_id, piece_num, projs,
+            DIM_SIP);
+    if (ret) {
+        goto err;
+    }
+
+    /* each piece opens its bit at its first interval, closes past its last */
+    num = srng.pnt_num >> 1;
+    for (pnt_num = k = 0; k < piece_num; k++) {
+        i = f_rfc_interval(srng.pnts, num, projs[k].dims[DIM_SIP][0]);
+        keys[pnt_num++] = (int64_t)i << 32 | p_ctx->pieces[k].pri;
+        i = f_rfc_interval(srng.pnts, num, projs[k].dims[DIM_SIP][1]);
+        keys[pnt_num++] = (int64_t)(i + 1) << 32 | 1U << 31 |
+            p_ctx->pieces[k].pri;
+    }
+
+    SORT(int64, keys, keys + pnt_num, pnt_num);
+
+    empty = f_rfc_class(p_cls, bm, 0, -1, p_ctx->word_num);
+    if (empty < 0) {
+        ret = empty;
+        goto err;
+    }
+
+    for (v = 0; v <= rng[1]; v++) {
+        p_table->ids[v] = empty;
+    }
+
+    for (e = i = 0; i < num; i++) {
+        for (; e < pnt_num && (keys[e] >> 32) == i; e++) {
+            k = keys[e] & INT32_MAX;
+            if (keys[e] & (1U << 31)) {
+                if (!--cnts[k]) {
+                    bm[k >> 6] &= ~(1ULL << (k & 63));
+                }
+            } else if (!cnts[k]++) {
+                bm[k >> 6] |= 1ULL << (k & 63);
+            }
+        }
+
+        first = 0, last = p_ctx->word_num - 1;
+        f_rfc_trim(bm, &first, &last);
+        id = f_rfc_class(p_cls, bm, first, last, p_ctx->word_num);
+        if (id < 0) {
+            ret = id;
+            goto err;
+        }
+
+        for (v = srng.pnts[i << 1]; v <= srng.pnts[(i << 1) + 1]; v++) {
+            p_table->ids[v] = id;
+        }
+    }
+
+    p_table->class_num = p_cls->num;
+    ret = 0;
+
+err:
+    free(projs);
+    free(rule_id);
+    free(spnts);
+    free(keys);
+    free(srng.pnts);
+    free(cnts);
+    free(bm);
+
+    return ret;
+}
+
+/*
+ * Each combination of the input classes maps to the class of their common
+ * rules, or in the last table to the best of them. Only the words between
+ * the first and last nonzero ones of both inputs are intersected.
+ */
+static int f_rfc_phase(struct rfc_context *p_ctx, int t)
+{
+    int i, j, k, w, id, lo, hi, lo_ab, hi_ab, ret = 0;
+    int word_num = p_ctx->word_num;
+    uint64_t entry_num;
+    uint64_t *bm, *bm_ab;
+    const uint64_t *bm_a, *bm_b, *bm_c;
+    const int *in = s_rfc_inputs[t];
+    const struct rfc_classes *p_a = &p_ctx->classes[in[0]];
+    const struct rfc_classes *p_b = &p_ctx->classes[in[1]];
+    const struct rfc_classes *p_c = in[2] < 0 ? NULL :
+        &p_ctx->classes[in[2]];
+    struct rfc_table *p_table = &p_ctx->p_set->tables[t];
+
+    entry_num = (uint64_t)p_a->num * p_b->num * (p_c ? p_c->num : 1);
+    if (entry_num * sizeof(*p_table->ids) > RFC_BYTES_MAX) {
+        fprintf(stderr, "Table %d of %llu entries is too large\n", t,
+                (unsigned long long)entry_num);
+        return -E2BIG;
+    }
+
+    p_table->ids = malloc(entry_num * sizeof(*p_table->ids));
+    bm = calloc(word_num * 2, sizeof(*bm));
+    if (!p_table->ids || !bm) {
+        free(bm);
+        return -ENOMEM;
+    }
+
+    p_table->entry_num = entry_num;
+    bm_ab = bm + word_num;
+
+    for (entry_num = i = 0; i < p_a->num; i++) {
+        bm_a = p_a->bms + (size_t)i * word_num;
+        for (j = 0; j < p_b->num; j++) {
+            bm_b = p_b->bms + (size_t)j * word_num;
+            lo_ab = MAX(p_a->spans[i << 1], p_b->spans[j << 1]);
+            hi_ab = MIN(p_a->spans[(i << 1) + 1], p_b->spans[(j << 1) + 1]);
+
+            /* the last table only needs the first rule in common */
+            if (t == RFC_TABLE_NUM - 1) {
+                for (w = lo_ab; w <= hi_ab && !(bm_a[w] & bm_b[w]); w++);
+                p_table->ids[entry_num++] = w > hi_ab ?
+                    (uint32_t)p_ctx->p_rs->def_rule :
+                    (uint32_t)p_ctx->pris[(w << 6) +
+                    __builtin_ctzll(bm_a[w] & bm_b[w])];
+                continue;
+            }
+
+            for (w = lo_ab; w <= hi_ab; w++) {
+                bm_ab[w] = bm_a[w] & bm_b[w];
+            }
+
+            f_rfc_trim(bm_ab, &lo_ab, &hi_ab);
+
+            for (k = 0; k < (p_c ? p_c->num : 1); k++) {
+                lo = lo_ab, hi = hi_ab;
+                if (p_c) {
+                    bm_c = p_c->bms + (size_t)k * word_num;
+                    lo = MAX(lo, p_c->spans[k << 1]);
+                    hi = MIN(hi, p_c->spans[(k << 1) + 1]);
+                    for (w = lo; w <= hi; w++) {
+                        bm[w] = bm_ab[w] & bm_c[w];
+                    }
+
+                    f_rfc_trim(bm, &lo, &hi);
+                }
+
+                id = f_rfc_class(&p_ctx->classes[t], p_c ? bm : bm_ab,
+                        lo, hi, word_num);
+                if (id < 0) {
+                    if (id == -E2BIG) {
+                        fprintf(stderr, "Table %d of over %d classes is too "
+                                "large\n", t, p_ctx->classes[t].num);
+                    }
+
+                    ret = id;
+                    goto out;
+                }
+
+                p_table->ids[entry_num++] = id;
+
+                /* the words past the span are kept zero */
+                if (p_c && lo <= hi) {
+                    memset(bm + lo, 0, (hi - lo + 1) * sizeof(*bm));
+                }
+            }
+
+            if (lo_ab <= hi_ab) {
+                memset(bm_ab + lo_ab, 0, (hi_ab - lo_ab + 1) * sizeof(*bm));
+            }
+        }
+    }
+
+    if (t < RFC_TABLE_NUM - 1) {
+        p_table->class_num = p_ctx->classes[t].num;
+    }
+
+out:
+    free(bm);
+
+    return ret;
+}
+
+/* The interval of pnts holding value, the intervals covering value */
+static int f_rfc_interval(const uint32_t *pnts, int num, uint32_t value)
+{
+    int lo = 0, hi = num - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi + 1) >> 1;
+        if (pnts[mid << 1] <= value) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return lo;
+}
+
+/*
+ * The class id of bitmap bm, added if new. Its words are zero out of the
+ * span [lo, hi] of its first and last nonzero ones, which is [0, -1] if all
+ * are zero, so only the span is hashed and compared.
+ */
+static int f_rfc_class(struct rfc_classes *p_cls, const uint64_t *bm,
+        int lo, int hi, int word_num)
+{
+    int i, id, cap, *slots, *spans;
+    uint32_t slot, slot_mask;
+    uint64_t *bms;
+    const int *span;
+    size_t size = word_num * sizeof(*bm);
+
+    /* the slots are kept at most half full */
+    if (!p_cls->slots || (uint32_t)p_cls->num * 2 >= p_cls->slot_mask) {
+        slot_mask = p_cls->slots ? (p_cls->slot_mask << 1) | 1 : 255;
+        slots = malloc((slot_mask + 1) * sizeof(*slots));
+        if (!slots) {
+            return -ENOMEM;
+        }
+
+        memset(slots, -1, (slot_mask + 1) * sizeof(*slots));
+        for (i = 0; i < p_cls->num; i++) {
+            span = &p_cls->spans[i << 1];
+            for (slot = f_rfc_hash(p_cls->bms + (size_t)i * word_num,
+                span[0], span[1]) & slot_mask; slots[slot] >= 0;
+                slot = (slot + 1) & slot_mask);
+            slots[slot] = i;
+        }
+
+        free(p_cls->slots);
+        p_cls->slots = slots;
+        p_cls->slot_mask = slot_mask;
+    }
+
+    for (slot = f_rfc_hash(bm, lo, hi) & p_cls->slot_mask;
+        p_cls->slots[slot] >= 0; slot = (slot + 1) & p_cls->slot_mask) {
+        id = p_cls->slots[slot];
+        span = &p_cls->spans[id << 1];
+        if (span[0] == lo && span[1] == hi && (lo > hi ||
+            !memcmp(p_cls->bms + (size_t)id * word_num + lo, bm + lo,
+                (hi - lo + 1) * sizeof(*bm)))) {
+            return id;
+        }
+    }
+
+    if (p_cls->num == p_cls->cap) {
+        cap = p_cls->cap ? p_cls->cap << 1 : 64;
+        if (cap * size > RFC_BYTES_MAX) {
+            return -E2BIG;
+        }
+
+        bms = realloc(p_cls->bms, cap * size);
+        if (bms) {
+            p_cls->bms = bms;
+        }
+
+        spans = realloc(p_cls->spans, cap * 2 * sizeof(*spans));
+        if (spans) {
+            p_cls->spans = spans;
+        }
+
+        if (!bms || !spans) {
+            return -ENOMEM;
+        }
+
+        p_cls->cap = cap;
+    }
+
+    memcpy(p_cls->bms + (size_t)p_cls->num * word_num, bm, size);
+    p_cls->spans[p_cls->num << 1] = lo;
+    p_cls->spans[(p_cls->num << 1) + 1] = hi;
+    p_cls->slots[slot] = p_cls->num;
+
+    return p_cls->num++;
+}
+
+/* Narrow [*p_lo, *p_hi] to the nonzero words of bm, or [0, -1] */
+static void f_rfc_trim(const uint64_t *bm, int *p_lo, int *p_hi)
+{
+    int lo = *p_lo, hi = *p_hi;
+
+    for (; lo <= hi && !bm[lo]; lo++);
+    for (; hi >= lo && !bm[hi]; hi--);
+
+    if (lo > hi) {
+        lo = 0, hi = -1;
+    }
+
+    *p_lo = lo;
+    *p_hi = hi;
+
+    return;
+}
+
+/* The words are multiplied apart, so they are hashed in parallel */
+static inline uint64_t f_rfc_hash(const uint64_t *bm, int lo, int hi)
+{
+    int i;
+    uint64_t h = (uint64_t)lo * 0xc2b2ae3d27d4eb4fULL;
+
+    for (i = lo; i <= hi; i++) {
+        h = (h << 5 | h >> 59) ^ (bm[i] * 0x9e3779b97f4a7c15ULL);
+    }
+
+    return h ^ (h >> 29);
+}
+
+static inline int f_rfc_lookup(const struct packet *p_pkt,
+        const struct rfc_result *p_rfc_result)
+{
+    int i, t, pri = p_rfc_result->def_rule, cur;
+    uint32_t entry, classes[RFC_TABLE_NUM];
+    const int *in;
+    const struct rfc_table *tables;
+
+    for (i = 0; i < p_rfc_result->set_num &&
+        p_rfc_result->sets[i].pri_min < pri; i++) {
+        tables = p_rfc_result->sets[i].tables;
+
+        for (t = 0; t < RFC_CHUNK_NUM; t++) {
+            classes[t] = tables[t].ids[(p_pkt->dims[s_rfc_chunks[t].dim] >>
+                    s_rfc_chunks[t].shift) & s_rfc_chunks[t].max];
+        }
+
+        for (; t < RFC_TABLE_NUM; t++) {
+            in = s_rfc_inputs[t];
+            entry = classes[in[0]] * tables[in[1]].class_num +
+                classes[in[1]];
+            if (in[2] >= 0) {
+                entry = entry * tables[in[2]].class_num + classes[in[2]];
+            }
+
+            classes[t] = tables[t].ids[entry];
+        }
+
+        cur = classes[RFC_TABLE_NUM - 1];
+        pri = MIN(pri, cur);
+    }
+
+    return pri;
+}
@@ -0,0 +1,624 @@
+/*
+ *     Filename: tuplemerge.c
+ *  Description: Source file for Tuple Space Search and TupleMerge
+ *
+ *       Author: Xiang Wang (xiang.wang.s@gmail.com)
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "common/impl.h"
+#include "common/utils.h"
+#include "common/point_range.h"
+#include "clsfy/tuplemerge.h"
+
+
+static const int s_tm_bits[DIM_MAX] = {32, 32, 16, 16, 8};
+
+
+static int f_tm_place(struct tm_result *p_tm, const struct rule *p_rule);
+static int f_tm_remove(struct tm_result *p_tm, const struct rule *p_rule);
+static void f_tm_lens(const struct rule *p_rule, int *lens);
+static int f_tm_table_find(const struct tm_result *p_tm, const int *lens);
+static int f_tm_table_add(struct tm_result *p_tm, const int *lens);
+static void f_tm_table_drop(struct tm_result *p_tm, int i);
+static int f_tm_table_insert(struct tm_table *p_table,
+        const struct rule *p_rule);
+static int f_tm_table_rehash(struct tm_table *p_table);
+static int f_tm_slot_insert(struct tm_slot *p_slot, const struct tm_rule *p_tr);
+static void f_tm_sort(struct tm_result *p_tm, int i);
+
+static inline uint32_t f_tm_hash(const uint32_t *dims, const uint32_t *masks);
+static inline int f_tm_lookup(const struct packet *p_pkt,
+        const struct tm_result *p_tm);
+
+
+int tm_build(void *built_result, const struct partition *p_pa,
+        int is_relaxed)
+{
+    int i, j, ret, rule_num = 0, slot_num = 0, collide_max = 0;
+    struct tm_result *p_tm;
+    const struct rule_set *p_rs;
+
+    if (!built_result || !p_pa || !p_pa->subsets || p_pa->subset_num <= 0 ||
+        p_pa->rule_num <= 1) {
+        return -EINVAL;
+    }
+
+    p_tm = calloc(1, sizeof(*p_tm));
+    if (!p_tm) {
+        return -ENOMEM;
+    }
+
+    p_tm->def_rule = p_pa->subsets[0].def_rule;
+    p_tm->is_relaxed = is_relaxed;
+    *(typeof(p_tm) *)built_result = p_tm;
+
+    /* Tables hold the rules of all subsets: grouping brings nothing here */
+    for (i = 0; i < p_pa->subset_num; i++) {
+        p_rs = &p_pa->subsets[i];
+        for (j = 0; j < p_rs->rule_num; j++) {
+            if (p_rs->rules[j].pri == p_rs->def_rule) {
+                continue;
+            }
+
+            ret = tm_insert(built_result, &p_rs->rules[j]);
+            if (ret) {
+                tm_destroy(built_result);
+                *(typeof(p_tm) *)built_result = NULL;
+                return ret;
+            }
+        }
+    }
+
+    for (i = 0; i < p_tm->table_num; i++) {
+        rule_num += p_tm->tables[i].rule_num;
+        slot_num += p_tm->tables[i].slot_mask + 1;
+        for (j = 0; j <= (int)p_tm->tables[i].slot_mask; j++) {
+            collide_max = MAX(collide_max,
+                    p_tm->tables[i].slots[j].rule_num);
+        }
+    }
+
+    fprintf(stderr, "%d rules in %d tables of %d slots, %d rules in the "
+            "fullest slot\n", rule_num, p_tm->table_num, slot_num,
+            collide_max);
+
+    return 0;
+}
+
+/*
+ * Add a rule: TupleMerge puts it whole in a table of shorter prefixes,
+ * while Tuple Space Search splits its ranges into prefixes first
+ */
+int tm_insert(void *built_result, const struct rule *p_rule)
+{
+    int i, d, ret = 0;
+    struct tm_result *p_tm;
+    struct rule_vector prefixes;
+
+    if (!built_result || !p_rule) {
+        return -EINVAL;
+    }
+
+    p_tm = *(typeof(p_tm) *)built_result;
+    if (!p_tm) {
+        return -EINVAL;
+    }
+
+    for (d = 0; d < DIM_MAX; d++) {
+        if (p_rule->dims[d][0] > p_rule->dims[d][1]) {
+            return -EINVAL;
+        }
+    }
+
+    if (p_tm->is_relaxed) {
+        return f_tm_place(p_tm, p_rule);
+    }
+
+    VECTOR_INIT(&prefixes);
+    ret = split_range_rule(&prefixes, p_rule);
+    for (i = 0; !ret && i < VECTOR_LEN(&prefixes); i++) {
+        ret = f_tm_place(p_tm, VECTOR_ADDR(&prefixes, i));
+    }
+
+    VECTOR_TERM(&prefixes);
+
+    return ret;
+}
+
+/* Remove a rule added before, given as it was added */
+int tm_delete(void *built_result, const struct rule *p_rule)
+{
+    int i, ret = 0;
+    struct tm_result *p_tm;
+    struct rule_vector prefixes;
+
+    if (!built_result || !p_rule) {
+        return -EINVAL;
+    }
+
+    p_tm = *(typeof(p_tm) *)built_result;
+    if (!p_tm) {
+        return -EINVAL;
+    }
+
+    if (p_tm->is_relaxed) {
+        return f_tm_remove(p_tm, p_rule);
+    }
+
+    VECTOR_INIT(&prefixes);
+    ret = split_range_rule(&prefixes, p_rule);
+    for (i = 0; !ret && i < VECTOR_LEN(&prefixes); i++) {
+        ret = f_tm_remove(p_tm, VECTOR_ADDR(&prefixes, i));
+    }
+
+    VECTOR_TERM(&prefixes);
+
+    return ret;
+}
+
+/* The best rule a packet matches, hashing it into one table after another */
+int tm_lookup(const struct packet *p_pkt, const void *built_result)
+{
+    const struct tm_result *p_tm;
+
+    assert(p_pkt && built_result);
+
+    p_tm = *(typeof(p_tm) *)built_result;
+
+    return f_tm_lookup(p_pkt, p_tm);
+}
+
+/* Bytes of the tables: their slots and the rules room of the slots */
+size_t tm_memory(const void *built_result)
+{
+    int i, j;
+    size_t size;
+    const struct tm_table *p_table;
+    const struct tm_result *p_tm;
+
+    if (!built_result) {
+        return 0;
+    }
+
+    p_tm = *(typeof(p_tm) *)built_result;
+    if (!p_tm) {
+        return 0;
+    }
+
+    size = p_tm->table_num * sizeof(*p_tm->tables);
+    for (i = 0; i < p_tm->table_num; i++) {
+        p_table = &p_tm->tables[i];
+        size += (p_table->slot_mask + 1) * sizeof(*p_table->slots);
+        for (j = 0; j <= (int)p_table->slot_mask; j++) {
+            size += p_table->slots[j].rule_cap * sizeof(struct tm_rule);
+        }
+    }
+
+    return size;
+}
+
+void tm_destroy(void *built_result)
+{
+    int i, j;
+    struct tm_result *p_tm;
+
+    if (!built_result) {
+        return;
+    }
+
+    p_tm = *(typeof(p_tm) *)built_result;
+    if (!p_tm) {
+        return;
+    }
+
+    for (i = 0; i < p_tm->table_num; i++) {
+        for (j = 0; j <= (int)p_tm->tables[i].slot_mask; j++) {
+            free(p_tm->tables[i].slots[j].rules);
+        }
+
+        free(p_tm->tables[i].slots);
+    }
+
+    free(p_tm->tables);
+    free(p_tm);
+
+    return;
+}
+
+/*
+ * Put a rule in the most specific table it fits whose slot has room, or
+ * else in a new table of its relaxed lengths. If that one is full too, the
+ * rule goes in the table of its own lengths even if its slot is full: no
+ * table it fits is more specific, so only there may a slot pass the limit
+ */
+static int f_tm_place(struct tm_result *p_tm, const struct rule *p_rule)
+{
+    int i, d, ret, best = -1, best_len = -1, len;
+    int lens[DIM_MAX], relaxed[DIM_MAX];
+    uint32_t lo[DIM_MAX];
+    const struct tm_table *p_table;
+
+    f_tm_lens(p_rule, lens);
+    for (d = 0; d < DIM_MAX; d++) {
+        lo[d] = p_rule->dims[d][0];
+    }
+
+    if (!p_tm->is_relaxed) {
+        best = f_tm_table_find(p_tm, lens);
+
+    } else {
+        for (i = 0; i < p_tm->table_num; i++) {
+            p_table = &p_tm->tables[i];
+            for (len = d = 0; d < DIM_MAX && p_table->lens[d] <= lens[d];
+                d++) {
+                len += p_table->lens[d];
+            }
+
+            if (d < DIM_MAX || len <= best_len || p_table->slots[f_tm_hash(lo,
+                p_table->masks) & p_table->slot_mask].rule_num >=
+                TM_COLLIDE_MAX) {
+                continue;
+            }
+
+            best = i;
+            best_len = len;
+        }
+
+        if (best < 0) {
+            relaxed[DIM_SIP] = lens[DIM_SIP] - lens[DIM_SIP] % TM_IP_STEP;
+            relaxed[DIM_DIP] = lens[DIM_DIP] - lens[DIM_DIP] % TM_IP_STEP;
+            for (d = DIM_SPORT; d < DIM_MAX; d++) {
+                relaxed[d] = lens[d] == s_tm_bits[d] ? lens[d] : 0;
+            }
+
+            if (f_tm_table_find(p_tm, relaxed) < 0) {
+                memcpy(lens, relaxed, sizeof(lens));
+            }
+
+            best = f_tm_table_find(p_tm, lens);
+        }
+    }
+
+    if (best < 0) {
+        best = f_tm_table_add(p_tm, lens);
+        if (best < 0) {
+            return best;
+        }
+    }
+
+    ret = f_tm_table_insert(&p_tm->tables[best], p_rule);
+    if (ret) {
+        return ret;
+    }
+
+    f_tm_sort(p_tm, best);
+
+    return 0;
+}
+
+/*
+ * A table left empty is dropped, and one that lost its best rule takes the
+ * best of the first rules of its slots and moves back among the tables
+ */
+static int f_tm_remove(struct tm_result *p_tm, const struct rule *p_rule)
+{
+    int i, j, d, lens[DIM_MAX];
+    uint32_t lo[DIM_MAX];
+    struct tm_table *p_table;
+    struct tm_slot *p_slot;
+    struct tm_rule *p_tr;
+
+    f_tm_lens(p_rule, lens);
+    for (d = 0; d < DIM_MAX; d++) {
+        lo[d] = p_rule->dims[d][0];
+    }
+
+    for (i = 0; i < p_tm->table_num; i++) {
+        p_table = &p_tm->tables[i];
+        for (d = 0; d < DIM_MAX && p_table->lens[d] <= lens[d]; d++);
+        if (d < DIM_MAX) {
+            continue;
+        }
+
+        p_slot = &p_table->slots[f_tm_hash(lo, p_table->masks) &
+            p_table->slot_mask];
+        for (j = 0; j < p_slot->rule_num; j++) {
+            p_tr = &p_slot->rules[j];
+            for (d = 0; d < DIM_MAX; d++) {
+                if (p_tr->lo[d] != p_rule->dims[d][0] ||
+                    p_tr->hi[d] != p_rule->dims[d][1]) {
+                    break;
+                }
+            }
+
+            if (d < DIM_MAX || p_tr->pri != p_rule->pri) {
+                continue;
+            }
+
+            memmove(p_tr, p_tr + 1,
+                    (--p_slot->rule_num - j) * sizeof(*p_tr));
+            p_table->rule_num--;
+
+            if (!p_table->rule_num) {
+                f_tm_table_drop(p_tm, i);
+
+            } else if (p_rule->pri == p_table->pri_min) {
+                p_table->pri_min = INT_MAX;
+                for (j = 0; j <= (int)p_table->slot_mask; j++) {
+                    if (p_table->slots[j].rule_num) {
+                        p_table->pri_min = MIN(p_table->pri_min,
+                                p_table->slots[j].rules[0].pri);
+                    }
+                }
+
+                f_tm_sort(p_tm, i);
+            }
+
+            return 0;
+        }
+    }
+
+    return -ENOENT;
+}
+
+/* The lengths of the shortest prefixes holding each field of a rule */
+static void f_tm_lens(const struct rule *p_rule, int *lens)
+{
+    int d;
+    uint32_t diff;
+
+    for (d = 0; d < DIM_MAX; d++) {
+        diff = p_rule->dims[d][0] ^ p_rule->dims[d][1];
+        lens[d] = diff ? __builtin_clz(diff) - (32 - s_tm_bits[d]) :
+            s_tm_bits[d];
+    }
+
+    return;
+}
+
+static int f_tm_table_find(const struct tm_result *p_tm, const int *lens)
+{
+    int i;
+
+    for (i = 0; i < p_tm->table_num; i++) {
+        if (!memcmp(p_tm->tables[i].lens, lens,
+            sizeof(p_tm->tables[i].lens))) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* Append an empty table, which f_tm_sort moves once it holds a rule */
+static int f_tm_table_add(struct tm_result *p_tm, const int *lens)
+{
+    int d, cap;
+    union point mask;
+    struct tm_table *p_table;
+
+    if (p_tm->table_num == p_tm->table_cap) {
+        cap = p_tm->table_cap ? p_tm->table_cap << 1 : 16;
+        p_table = realloc(p_tm->tables, cap * sizeof(*p_table));
+        if (!p_table) {
+            return -ENOMEM;
+        }
+
+        p_tm->tables = p_table;
+        p_tm->table_cap = cap;
+    }
+
+    p_table = &p_tm->tables[p_tm->table_num];
+    p_table->slots = calloc(TM_SLOT_NUM_MIN, sizeof(*p_table->slots));
+    if (!p_table->slots) {
+        return -ENOMEM;
+    }
+
+    for (d = 0; d < DIM_MAX; d++) {
+        gen_prefix_mask(&mask, s_tm_bits[d], lens[d]);
+        p_table->masks[d] = mask.u32;
+        p_table->lens[d] = lens[d];
+    }
+
+    p_table->slot_mask = TM_SLOT_NUM_MIN - 1;
+    p_table->rule_num = 0;
+    p_table->pri_min = INT_MAX;
+
+    return p_tm->table_num++;
+}
+
+static void f_tm_table_drop(struct tm_result *p_tm, int i)
+{
+    int j;
+    struct tm_table *p_table = &p_tm->tables[i];
+
+    for (j = 0; j <= (int)p_table->slot_mask; j++) {
+        free(p_table->slots[j].rules);
+    }
+
+    free(p_table->slots);
+    memmove(p_table, p_table + 1,
+            (--p_tm->table_num - i) * sizeof(*p_table));
+
+    return;
+}
+
+static int f_tm_table_insert(struct tm_table *p_table,
+        const struct rule *p_rule)
+{
+    int d, ret;
+    struct tm_rule tr;
+
+    /* the slots double once they hold a rule each on average */
+    if (p_table->rule_num > (int)p_table->slot_mask) {
+        ret = f_tm_table_rehash(p_table);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    for (d = 0; d < DIM_MAX; d++) {
+        tr.lo[d] = p_rule->dims[d][0];
+        tr.hi[d] = p_rule->dims[d][1];
+    }
+
+    tr.pri = p_rule->pri;
+
+    ret = f_tm_slot_insert(&p_table->slots[f_tm_hash(tr.lo,
+                p_table->masks) & p_table->slot_mask], &tr);
+    if (ret) {
+        return ret;
+    }
+
+    p_table->rule_num++;
+    p_table->pri_min = MIN(p_table->pri_min, tr.pri);
+
+    return 0;
+}
+
+static int f_tm_table_rehash(struct tm_table *p_table)
+{
+    int i, j, ret = 0;
+    uint32_t slot_mask = (p_table->slot_mask << 1) | 1;
+    struct tm_slot *slots;
+
+    slots = calloc(slot_mask + 1, sizeof(*slots));
+    if (!slots) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; !ret && i <= (int)p_table->slot_mask; i++) {
+        for (j = 0; !ret && j < p_table->slots[i].rule_num; j++) {
+            const struct tm_rule *p_tr = &p_table->slots[i].rules[j];
+
+            ret = f_tm_slot_insert(&slots[f_tm_hash(p_tr->lo,
+                        p_table->masks) & slot_mask], p_tr);
+        }
+    }
+
+    /* the old slots are kept on failure, and the new ones dropped */
+    if (ret) {
+        SWAP(slots, p_table->slots);
+        SWAP(slot_mask, p_table->slot_mask);
+    }
+
+    for (i = 0; i <= (int)p_table->slot_mask; i++) {
+        free(p_table->slots[i].rules);
+    }
+
+    free(p_table->slots);
+    p_table->slots = slots;
+    p_table->slot_mask = slot_mask;
+
+    return ret;
+}
+
+static int f_tm_slot_insert(struct tm_slot *p_slot, const struct tm_rule *p_tr)
+{
+    int i, cap;
+    struct tm_rule *rules;
+
+    if (p_slot->rule_num == p_slot->rule_cap) {
+        cap = p_slot->rule_cap ? p_slot->rule_cap << 1 : 2;
+        rules = realloc(p_slot->rules, cap * sizeof(*rules));
+        if (!rules) {
+            return -ENOMEM;
+        }
+
+        p_slot->rules = rules;
+        p_slot->rule_cap = cap;
+    }
+
+    for (i = p_slot->rule_num; i > 0 && p_slot->rules[i - 1].pri > p_tr->pri;
+        i--) {
+        p_slot->rules[i] = p_slot->rules[i - 1];
+    }
+
+    p_slot->rules[i] = *p_tr;
+    p_slot->rule_num++;
+
+    return 0;
+}
+
+/* Move table i between the tables of better and worse rules */
+static void f_tm_sort(struct tm_result *p_tm, int i)
+{
+    struct tm_table table = p_tm->tables[i];
+
+    for (; i > 0 && p_tm->tables[i - 1].pri_min > table.pri_min; i--) {
+        p_tm->tables[i] = p_tm->tables[i - 1];
+    }
+
+    for (; i < p_tm->table_num - 1 &&
+        p_tm->tables[i + 1].pri_min < table.pri_min; i++) {
+        p_tm->tables[i] = p_tm->tables[i + 1];
+    }
+
+    p_tm->tables[i] = table;
+
+    return;
+}
+
+static inline uint32_t f_tm_hash(const uint32_t *dims, const uint32_t *masks)
+{
+    uint64_t h = ((uint64_t)(dims[DIM_SIP] & masks[DIM_SIP]) << 32 |
+            (dims[DIM_DIP] & masks[DIM_DIP])) * 0x9e3779b97f4a7c15ULL;
+
+    h ^= ((uint64_t)(dims[DIM_SPORT] & masks[DIM_SPORT]) << 24 |
+            (dims[DIM_DPORT] & masks[DIM_DPORT]) << 8 |
+            (dims[DIM_PROTO] & masks[DIM_PROTO])) * 0xc2b2ae3d27d4eb4fULL;
+
+    /* the low bits pick the slot, so fold the high ones down into them */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+
+    return h ^ (h >> 33);
+}
+
+static inline int f_tm_lookup(const struct packet *p_pkt,
+        const struct tm_result *p_tm)
+{
+    int i, j, d, pri = p_tm->def_rule;
+    const uint32_t *dims = p_pkt->dims;
+    const struct tm_table *p_table;
+    const struct tm_slot *p_slot;
+    const struct tm_rule *p_tr;
+
+    for (i = 0; i < p_tm->table_num && p_tm->tables[i].pri_min < pri; i++) {
+        p_table = &p_tm->tables[i];
+        p_slot = &p_table->slots[f_tm_hash(dims, p_table->masks) &
+            p_table->slot_mask];
+
+        /* the rules are in priority order: the first match is the best */
+        for (j = 0; j < p_slot->rule_num; j++) {
+            p_tr = &p_slot->rules[j];
+            if (p_tr->pri >= pri) {
+                break;
+            }
+
+            for (d = 0; d < DIM_MAX; d++) {
+                if (dims[d] < p_tr->lo[d] || dims[d] > p_tr->hi[d]) {
+                    break;
+                }
+            }
+
+            if (d == DIM_MAX) {
+                pri = p_tr->pri;
+                break;
+            }
+        }
+    }
+
+    return pri;
+}
@@ -0,0 +1,58 @@
+/*
+ *     Filename: flow_cache.c
+ *  Description: Source file for exact-match flow cache
+ *
+ *       Author: Xiang Wang (xiang.wang.s@gmail.com)
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "common/utils.h"
+#include "common/flow_cache.h"
+
+
+/* Round entry_num up to a power of 2 of buckets */
+int flow_cache_init(struct flow_cache *p_fc, size_t entry_num, int evict)
+{
+    uint64_t bucket_num;
+
+    if (!p_fc || !entry_num || evict <= FLOW_EVICT_INV ||
+        evict >= FLOW_EVICT_MAX) {
+        return -EINVAL;
+    }
+
+    bucket_num = p2roundup((entry_num + FLOW_CACHE_WAYS - 1) /
+            FLOW_CACHE_WAYS);
+
+    if (posix_memalign((void **)&p_fc->buckets, sizeof(*p_fc->buckets),
+        bucket_num * sizeof(*p_fc->buckets))) {
+        perror("Cannot allocate memory for flow cache");
+        return -ENOMEM;
+    }
+
+    memset(p_fc->buckets, 0, bucket_num * sizeof(*p_fc->buckets));
+    p_fc->bucket_mask = bucket_num - 1;
+    p_fc->evict = evict;
+    p_fc->hit_num = p_fc->miss_num = p_fc->evict_num = 0;
+
+    return 0;
+}
+
+void flow_cache_term(struct flow_cache *p_fc)
+{
+    if (!p_fc) {
+        return;
+    }
+
+    free(p_fc->buckets);
+    p_fc->buckets = NULL;
+
+    return;
+}
@@ -16,8 +16,14 @@ VECTOR_GENERATE(extern, prefix_vector, struct prefix)
 
 VECTOR_GENERATE(extern, rule_vector, struct rule)
 
+VECTOR_GENERATE(extern, rule_set_vector, struct rule_set)
+
+VECTOR_GENERATE(extern, packet_vector, struct packet)
+
+RING_GENERATE(extern, trace_ring, struct trace)
+
 /* mpool */
-MPOOL_GENERATE(extern, hsn_pool)
+CMPOOL_GENERATE(extern, hsbn_pool)
 
 /* sort */
 static inline long int_cmp(const int *p_left, const int *p_right)
@@ -36,6 +42,14 @@ static inline long int64_cmp(const int64_t *p_left, const int64_t *p_right)
 ISORT_GENERATE(extern, int64, int64_t, int64_cmp)
 QSORT_GENERATE(extern, int64, int64_t, int64_cmp)
 
+/* flip the sign bit, so that unsigned order matches signed order */
+static inline uint64_t int64_key(const int64_t *p)
+{
+    return (uint64_t)*p ^ (1ULL << 63);
+}
+
+RSORT_GENERATE(extern, int64, int64_t, int64_key)
+
 static inline long rfg_rng_rid_cmp(const struct rfg_rng_rid *p_left,
         const struct rfg_rng_rid *p_right)
 {
@@ -45,6 +59,40 @@ static inline long rfg_rng_rid_cmp(const struct rfg_rng_rid *p_left,
 ISORT_GENERATE(extern, rng_rid, struct rfg_rng_rid, rfg_rng_rid_cmp)
 QSORT_GENERATE(extern, rng_rid, struct rfg_rng_rid, rfg_rng_rid_cmp)
 
+static inline uint64_t rfg_rng_rid_key(const struct rfg_rng_rid *p)
+{
+    return p->value;
+}
+
+RSORT_GENERATE(extern, rng_rid, struct rfg_rng_rid, rfg_rng_rid_key)
+
+static inline long hs_tree_cmp(const struct hs_tree *p_left,
+        const struct hs_tree *p_right)
+{
+    return p_left->pri_min - p_right->pri_min;
+}
+
+ISORT_GENERATE(extern, hs_tree, struct hs_tree, hs_tree_cmp)
+QSORT_GENERATE(extern, hs_tree, struct hs_tree, hs_tree_cmp)
+
+static inline long hc_tree_cmp(const struct hc_tree *p_left,
+        const struct hc_tree *p_right)
+{
+    return p_left->pri_min - p_right->pri_min;
+}
+
+ISORT_GENERATE(extern, hc_tree, struct hc_tree, hc_tree_cmp)
+QSORT_GENERATE(extern, hc_tree, struct hc_tree, hc_tree_cmp)
+
+static inline long rfc_set_cmp(const struct rfc_set *p_left,
+        const struct rfc_set *p_right)
+{
+    return p_left->pri_min - p_right->pri_min;
+}
+
+ISORT_GENERATE(extern, rfc_set, struct rfc_set, rfc_set_cmp)
+QSORT_GENERATE(extern, rfc_set, struct rfc_set, rfc_set_cmp)
+
 static inline long rfg_rng_idx_cmp(const struct rfg_rng_idx *p_left,
         const struct rfg_rng_idx *p_right)
 {
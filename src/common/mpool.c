@@ -193,3 +193,71 @@ void gcmpool_free(struct gcmpool *mp, void *p)
     mp->flist_num++;
 }
 
+void gsmpool_init(struct gsmpool *mp, size_t chunk_size)
+{
+    mp->chunk_size = chunk_size;
+    mp->top = NULL;
+    mp->last = NULL;
+    mp->cur = mp->chunks = NULL;
+}
+
+void gsmpool_term(struct gsmpool *mp)
+{
+    struct gsmpool_chunk *chunk, *next;
+
+    for (chunk = mp->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+}
+
+void *gsmpool_malloc(struct gsmpool *mp, size_t size)
+{
+    struct gsmpool_block *block;
+    struct gsmpool_chunk *chunk, **pp_next;
+
+    /* reclaim the freed blocks on the top */
+    while (mp->last && __atomic_load_n(&mp->last->is_free, __ATOMIC_ACQUIRE)) {
+        mp->top = (char *)mp->last;
+        mp->cur = mp->last->chunk;
+        mp->last = mp->last->prev;
+    }
+
+    size = sizeof(*block) + ALIGN(size, sizeof(*block));
+    if (!mp->cur || mp->top + size > mp->cur->end) {
+        /* the chunks after cur are empty: reuse the next one if it fits */
+        pp_next = mp->cur ? &mp->cur->next : &mp->chunks;
+        chunk = *pp_next;
+        if (!chunk || chunk->data + size > chunk->end) {
+            size_t chunk_size = MAX(mp->chunk_size, size);
+
+            chunk = malloc(sizeof(*chunk) + chunk_size);
+            if (!chunk) {
+                return NULL;
+            }
+
+            chunk->end = chunk->data + chunk_size;
+            chunk->next = *pp_next;
+            *pp_next = chunk;
+        }
+
+        mp->cur = chunk;
+        mp->top = chunk->data;
+    }
+
+    block = (struct gsmpool_block *)mp->top;
+    block->prev = mp->last;
+    block->chunk = mp->cur;
+    block->is_free = 0;
+    mp->last = block;
+    mp->top += size;
+
+    return block + 1;
+}
+
+void gsmpool_free(void *p)
+{
+    struct gsmpool_block *block = (struct gsmpool_block *)p - 1;
+
+    __atomic_store_n(&block->is_free, 1, __ATOMIC_RELEASE);
+}
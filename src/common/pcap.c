@@ -0,0 +1,339 @@
+/*
+ *     Filename: pcap.c
+ *  Description: Source file for pcap and pcapng trace parsing
+ *
+ *       Author: Xiang Wang (xiang.wang.s@gmail.com)
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "common/pcap.h"
+#include "common/rule_trace.h"
+
+#define PCAPNG_IDB_TYPE 0x00000001
+#define PCAPNG_OPB_TYPE 0x00000002 /* obsolete packet block */
+#define PCAPNG_SPB_TYPE 0x00000003
+#define PCAPNG_EPB_TYPE 0x00000006
+
+#define ETH_HDR_SIZE 14
+#define SLL_HDR_SIZE 16
+#define VLAN_HDR_SIZE 4
+#define IPV4_HDR_SIZE 20
+
+#define ETH_TYPE_IPV4 0x0800
+#define ETH_TYPE_VLAN 0x8100
+#define ETH_TYPE_QINQ 0x88a8
+#define ETH_TYPE_QINQ_OLD 0x9100
+
+#define IP_PROTO_TCP 6
+#define IP_PROTO_UDP 17
+
+
+static int f_pcap_extract(int linktype, const uint8_t *p, size_t len,
+        struct packet *p_pkt);
+
+
+int pcap_detect(const void *p_data, size_t len)
+{
+    uint32_t magic;
+
+    if (!p_data || len < sizeof(magic)) {
+        return 0;
+    }
+
+    memcpy(&magic, p_data, sizeof(magic));
+
+    return magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC ||
+        magic == __builtin_bswap32(PCAP_MAGIC) ||
+        magic == __builtin_bswap32(PCAP_MAGIC_NSEC) ||
+        magic == PCAPNG_SHB_TYPE;
+}
+
+void pcap_init(struct pcap_parser *p_pp)
+{
+    if (!p_pp) {
+        return;
+    }
+
+    memset(p_pp, 0, sizeof(*p_pp));
+
+    return;
+}
+
+static inline uint16_t f_pcap_u16(const struct pcap_parser *p_pp,
+        const uint8_t *p)
+{
+    uint16_t value;
+
+    memcpy(&value, p, sizeof(value));
+
+    return p_pp->is_swapped ? __builtin_bswap16(value) : value;
+}
+
+static inline uint32_t f_pcap_u32(const struct pcap_parser *p_pp,
+        const uint8_t *p)
+{
+    uint32_t value;
+
+    memcpy(&value, p, sizeof(value));
+
+    return p_pp->is_swapped ? __builtin_bswap32(value) : value;
+}
+
+static inline uint16_t f_net_u16(const uint8_t *p)
+{
+    return (uint16_t)p[0] << 8 | p[1];
+}
+
+static inline uint32_t f_net_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+        (uint32_t)p[2] << 8 | p[3];
+}
+
+/*
+ * Parse the record at p_data: the file header, a packet record, or a
+ * pcapng block. Return the bytes consumed, 0 if len does not hold the
+ * whole record, or -errno for an illegal one. *p_is_pkt tells whether an
+ * IPv4 packet was extracted into p_pkt.
+ */
+ssize_t pcap_parse(struct pcap_parser *p_pp, const void *p_data, size_t len,
+        struct packet *p_pkt, int *p_is_pkt)
+{
+    const uint8_t *p = p_data;
+    uint32_t magic, type, size, cap_len, if_id;
+
+    if (!p_pp || !p_data || !p_pkt || !p_is_pkt) {
+        return -EINVAL;
+    }
+
+    *p_is_pkt = 0;
+
+    /* classic: "magic ver ver zone sigfigs snaplen linktype" */
+    if (!p_pp->is_started) {
+        if (len < sizeof(magic)) {
+            return 0;
+        }
+
+        memcpy(&magic, p, sizeof(magic));
+        if (magic == PCAPNG_SHB_TYPE) {
+            p_pp->is_ng = 1;
+
+        } else if (len < PCAP_FILE_HDR_SIZE) {
+            return 0;
+
+        } else {
+            if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC) {
+                p_pp->is_swapped = 0;
+
+            } else if (__builtin_bswap32(magic) == PCAP_MAGIC ||
+                __builtin_bswap32(magic) == PCAP_MAGIC_NSEC) {
+                p_pp->is_swapped = 1;
+
+            } else {
+                return -EINVAL;
+            }
+
+            /* the upper bits of the linktype field carry FCS info */
+            p_pp->linktypes[0] = f_pcap_u32(p_pp, p + 20) & 0xffff;
+            p_pp->if_num = 1;
+            p_pp->is_started = 1;
+
+            return PCAP_FILE_HDR_SIZE;
+        }
+
+        p_pp->is_started = 1;
+    }
+
+    /* classic: "sec usec cap_len len" and then cap_len bytes */
+    if (!p_pp->is_ng) {
+        if (len < PCAP_REC_HDR_SIZE) {
+            return 0;
+        }
+
+        cap_len = f_pcap_u32(p_pp, p + 8);
+        if (len - PCAP_REC_HDR_SIZE < cap_len) {
+            return 0;
+        }
+
+        if (f_pcap_extract(p_pp->linktypes[0], p + PCAP_REC_HDR_SIZE,
+            cap_len, p_pkt)) {
+            p_pp->skip_num++;
+        } else {
+            *p_is_pkt = 1;
+        }
+
+        return PCAP_REC_HDR_SIZE + cap_len;
+    }
+
+    /* pcapng: "type size body size", a section header sets byte order */
+    if (len < 3 * sizeof(uint32_t)) {
+        return 0;
+    }
+
+    memcpy(&type, p, sizeof(type));
+    if (type == PCAPNG_SHB_TYPE) {
+        memcpy(&magic, p + 8, sizeof(magic));
+        if (magic == PCAPNG_BYTE_ORDER) {
+            p_pp->is_swapped = 0;
+
+        } else if (__builtin_bswap32(magic) == PCAPNG_BYTE_ORDER) {
+            p_pp->is_swapped = 1;
+
+        } else {
+            return -EINVAL;
+        }
+
+        p_pp->if_num = 0;
+    }
+
+    type = f_pcap_u32(p_pp, p);
+    size = f_pcap_u32(p_pp, p + 4);
+    if (size < 3 * sizeof(uint32_t) || size % sizeof(uint32_t)) {
+        return -EINVAL;
+    }
+
+    if (len < size) {
+        return 0;
+    }
+
+    switch (type) {
+    case PCAPNG_IDB_TYPE:
+        if (size < 20) {
+            return -EINVAL;
+
+        } else if (p_pp->if_num == PCAP_IF_MAX) {
+            fprintf(stderr, "Too many pcapng interfaces\n");
+            return -ENOTSUP;
+        }
+
+        p_pp->linktypes[p_pp->if_num++] = f_pcap_u16(p_pp, p + 8);
+        break;
+
+    case PCAPNG_EPB_TYPE:
+    case PCAPNG_OPB_TYPE:
+        if (size < 32) {
+            return -EINVAL;
+        }
+
+        if_id = type == PCAPNG_EPB_TYPE ? f_pcap_u32(p_pp, p + 8) :
+            f_pcap_u16(p_pp, p + 8);
+        cap_len = f_pcap_u32(p_pp, p + 20);
+        if (if_id >= p_pp->if_num || cap_len > size - 32) {
+            return -EINVAL;
+        }
+
+        if (f_pcap_extract(p_pp->linktypes[if_id], p + 28, cap_len, p_pkt)) {
+            p_pp->skip_num++;
+        } else {
+            *p_is_pkt = 1;
+        }
+
+        break;
+
+    case PCAPNG_SPB_TYPE:
+        if (size < 16 || !p_pp->if_num) {
+            return -EINVAL;
+        }
+
+        cap_len = f_pcap_u32(p_pp, p + 8);
+        if (cap_len > size - 16) {
+            cap_len = size - 16;
+        }
+
+        if (f_pcap_extract(p_pp->linktypes[0], p + 12, cap_len, p_pkt)) {
+            p_pp->skip_num++;
+        } else {
+            *p_is_pkt = 1;
+        }
+
+        break;
+
+    default:
+        break;
+    }
+
+    return size;
+}
+
+/* The 5-tuple in host order, the ports are 0 unless TCP or UDP */
+static int f_pcap_extract(int linktype, const uint8_t *p, size_t len,
+        struct packet *p_pkt)
+{
+    size_t ihl;
+    uint16_t type;
+
+    switch (linktype) {
+    case PCAP_LINK_ETHERNET:
+        if (len < ETH_HDR_SIZE) {
+            return -EINVAL;
+        }
+
+        type = f_net_u16(p + 12);
+        p += ETH_HDR_SIZE, len -= ETH_HDR_SIZE;
+
+        while (type == ETH_TYPE_VLAN || type == ETH_TYPE_QINQ ||
+            type == ETH_TYPE_QINQ_OLD) {
+            if (len < VLAN_HDR_SIZE) {
+                return -EINVAL;
+            }
+
+            type = f_net_u16(p + 2);
+            p += VLAN_HDR_SIZE, len -= VLAN_HDR_SIZE;
+        }
+
+        break;
+
+    case PCAP_LINK_LINUX_SLL:
+        if (len < SLL_HDR_SIZE) {
+            return -EINVAL;
+        }
+
+        type = f_net_u16(p + 14);
+        p += SLL_HDR_SIZE, len -= SLL_HDR_SIZE;
+        break;
+
+    case PCAP_LINK_RAW:
+    case PCAP_LINK_IPV4:
+        type = ETH_TYPE_IPV4;
+        break;
+
+    default:
+        return -ENOTSUP;
+    }
+
+    if (type != ETH_TYPE_IPV4 || len < IPV4_HDR_SIZE || p[0] >> 4 != 4) {
+        return -ENOTSUP;
+    }
+
+    ihl = (p[0] & 0xf) << 2;
+    if (ihl < IPV4_HDR_SIZE || len < ihl) {
+        return -EINVAL;
+    }
+
+    p_pkt->dims[DIM_SIP] = f_net_u32(p + 12);
+    p_pkt->dims[DIM_DIP] = f_net_u32(p + 16);
+    p_pkt->dims[DIM_SPORT] = 0;
+    p_pkt->dims[DIM_DPORT] = 0;
+    p_pkt->dims[DIM_PROTO] = p[9];
+    p_pkt->match_rule = TRACE_MATCH_UNKNOWN;
+
+    /* later fragments carry no transport header */
+    if ((p[9] == IP_PROTO_TCP || p[9] == IP_PROTO_UDP) &&
+        !(f_net_u16(p + 6) & 0x1fff)) {
+        if (len < ihl + 4) {
+            return -EINVAL;
+        }
+
+        p_pkt->dims[DIM_SPORT] = f_net_u16(p + ihl);
+        p_pkt->dims[DIM_DPORT] = f_net_u16(p + ihl + 2);
+    }
+
+    return 0;
+}
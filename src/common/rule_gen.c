@@ -0,0 +1,729 @@
+/*
+ *     Filename: rule_gen.c
+ *  Description: Source file for synthetic rule and trace generation
+ *
+ *       Author: Xiang Wang (xiang.wang.s@gmail.com)
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "common/utils.h"
+#include "common/rule_gen.h"
+
+#define GEN_RETRY_MAX 64 /* tries for a rule that is not a duplicate */
+#define GEN_POOL_RATIO 16 /* rules per address in the locality pools */
+#define GEN_BURST_SCALE 0.1 /* Pareto scale of header repeats, shape 1 */
+#define GEN_BURST_MAX 1024
+
+#define GEN_EXACT_SPORT 0x1
+#define GEN_EXACT_DPORT 0x2
+#define GEN_EXACT_PROTO 0x4
+#define GEN_TUPLE_MAX (33 * 33 * 8)
+
+#define IP_PROTO_TCP 6
+#define IP_PROTO_UDP 17
+
+
+/* Rules of the same prefix lengths and exact fields share a tuple */
+struct gen_tuple {
+    uint32_t sip_mask;
+    uint32_t dip_mask;
+    int flags;
+    int min_rule; /* tuples are created in this order */
+};
+
+/* Rules with the same tuple and key are chained in priority order */
+struct gen_slot {
+    uint64_t ips; /* masked sip << 32 | masked dip */
+    uint64_t rest; /* tuple << 40 | sport << 24 | dport << 8 | proto */
+    int head;
+    int tail;
+};
+
+/*
+ * Hash index over the prefix tuples of a rule set. A packet probes one
+ * slot per tuple, so it finds its first matching rule without a linear
+ * scan of all the rules. The keys are also set in a bit filter of 8 bits
+ * per rule, which stays in cache and saves most probes of empty slots.
+ */
+struct gen_index {
+    struct gen_slot *slots;
+    uint64_t *filter;
+    uint32_t slot_mask; /* the filter has 4 bits per slot */
+    int *nexts;
+    int *tuple_ids;
+    struct gen_tuple *tuples;
+    int tuple_num;
+};
+
+
+static const struct gen_profile s_gen_profiles[GEN_PROFILE_MAX] = {
+    /* weights in 1/1000 of acl1, fw1 and ipc1 in rule_trace/rules/origin */
+    [GEN_PROFILE_ACL] = {
+        .sip_lens = {[0] = 4, [8] = 1, [23] = 73, [30] = 16, [31] = 37,
+            [32] = 869},
+        .dip_lens = {[0] = 4, [8] = 3, [16] = 16, [22] = 52, [24] = 21,
+            [28] = 3, [30] = 7, [31] = 13, [32] = 867},
+        .sport_cls = {[GEN_PORT_WC] = 1000},
+        .dport_cls = {[GEN_PORT_WC] = 216, [GEN_PORT_EM] = 564,
+            [GEN_PORT_AR] = 219},
+        .protos = {[1] = 31, [6] = 875, [17] = 12, [GEN_PROTO_WC] = 82}
+    },
+    [GEN_PROFILE_FW] = {
+        .sip_lens = {[0] = 630, [8] = 4, [12] = 4, [16] = 4, [21] = 4,
+            [23] = 4, [26] = 7, [27] = 15, [28] = 30, [29] = 7, [30] = 33,
+            [32] = 259},
+        .dip_lens = {[0] = 285, [21] = 22, [27] = 4, [28] = 22, [30] = 15,
+            [32] = 652},
+        .sport_cls = {[GEN_PORT_WC] = 774, [GEN_PORT_HI] = 78,
+            [GEN_PORT_EM] = 144, [GEN_PORT_AR] = 4},
+        .dport_cls = {[GEN_PORT_WC] = 289, [GEN_PORT_HI] = 78,
+            [GEN_PORT_EM] = 630, [GEN_PORT_AR] = 4},
+        .protos = {[1] = 11, [6] = 578, [17] = 337, [47] = 59,
+            [GEN_PROTO_WC] = 15}
+    },
+    [GEN_PROFILE_IPC] = {
+        .sip_lens = {[0] = 83, [15] = 3, [16] = 41, [17] = 14, [22] = 14,
+            [23] = 102, [24] = 251, [25] = 17, [26] = 53, [27] = 2,
+            [28] = 21, [30] = 5, [31] = 5, [32] = 390},
+        .dip_lens = {[0] = 55, [16] = 66, [22] = 10, [23] = 14, [24] = 250,
+            [25] = 22, [26] = 72, [28] = 23, [29] = 3, [30] = 2, [31] = 2,
+            [32] = 479},
+        .sport_cls = {[GEN_PORT_WC] = 812, [GEN_PORT_HI] = 4,
+            [GEN_PORT_EM] = 163, [GEN_PORT_AR] = 22},
+        .dport_cls = {[GEN_PORT_WC] = 511, [GEN_PORT_HI] = 72,
+            [GEN_PORT_EM] = 390, [GEN_PORT_AR] = 28},
+        .protos = {[1] = 8, [6] = 287, [17] = 414, [47] = 3, [50] = 1,
+            [51] = 1, [GEN_PROTO_WC] = 285}
+    }
+};
+
+/* exact ports are mostly well known services */
+static const uint16_t s_gen_ports[] = {
+    20, 21, 22, 23, 25, 53, 80, 88, 110, 123, 135, 137, 139, 143, 161, 389,
+    443, 445, 514, 750, 1433, 1521, 1723, 3306, 3389, 5060, 5530, 8080
+};
+
+
+static uint64_t f_seed(uint64_t seed);
+static uint64_t f_rand(uint64_t *p_state);
+static uint32_t f_rand_range(uint64_t *p_state, uint32_t lo, uint32_t hi);
+static uint32_t f_accumulate(uint32_t *weights, int num);
+static int f_pick(uint64_t *p_state, const uint32_t *cums, int num);
+static int f_prefix_len(const uint32_t rng[2]);
+static int f_port_class(const uint32_t rng[2]);
+
+static void f_gen_ip(uint64_t *p_state, uint32_t rng[2], int len,
+        const uint32_t *pool, int pool_num);
+static void f_gen_port(uint64_t *p_state, uint32_t rng[2], int cls);
+static void f_gen_rule(uint64_t *p_state, struct rule *p_rule,
+        const struct gen_profile *p_cums, const uint32_t *pools[2],
+        int pool_num);
+
+static int f_index_init(struct gen_index *p_idx, int rule_num);
+static void f_index_term(struct gen_index *p_idx);
+static int f_index_add(struct gen_index *p_idx, const struct rule *rules,
+        int rule_id, int is_unique);
+static int f_index_match(const struct gen_index *p_idx,
+        const struct rule *rules, const uint32_t *dims, int best);
+
+
+int gen_profile_init(struct gen_profile *p_gp, int profile)
+{
+    if (!p_gp || profile <= GEN_PROFILE_INV || profile >= GEN_PROFILE_MAX) {
+        return -EINVAL;
+    }
+
+    *p_gp = s_gen_profiles[profile];
+
+    return 0;
+}
+
+/* Take the seed parameters from the rules except the default one */
+int gen_profile_learn(struct gen_profile *p_gp, const struct rule_set *p_rs)
+{
+    int i, sip_len, dip_len;
+    const struct rule *p_rule;
+
+    if (!p_gp || !p_rs || !p_rs->rules || p_rs->rule_num < 2) {
+        return -EINVAL;
+    }
+
+    memset(p_gp, 0, sizeof(*p_gp));
+
+    for (i = 0; i < p_rs->rule_num - 1; i++) {
+        p_rule = &p_rs->rules[i];
+
+        sip_len = f_prefix_len(p_rule->dims[DIM_SIP]);
+        dip_len = f_prefix_len(p_rule->dims[DIM_DIP]);
+        if (sip_len < 0 || dip_len < 0) {
+            fprintf(stderr, "Cannot learn from non-prefix addresses\n");
+            return -ENOTSUP;
+        }
+
+        p_gp->sip_lens[sip_len]++;
+        p_gp->dip_lens[dip_len]++;
+        p_gp->sport_cls[f_port_class(p_rule->dims[DIM_SPORT])]++;
+        p_gp->dport_cls[f_port_class(p_rule->dims[DIM_DPORT])]++;
+
+        if (p_rule->dims[DIM_PROTO][0] == p_rule->dims[DIM_PROTO][1]) {
+            p_gp->protos[p_rule->dims[DIM_PROTO][0] & 0xff]++;
+        } else {
+            p_gp->protos[GEN_PROTO_WC]++;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Draw rule_num - 1 distinct rules from the profile and append the default
+ * rule. Addresses are drawn around a pool of base addresses, so that rules
+ * share prefixes and overlap as in real rule sets.
+ */
+int gen_rules(struct rule_set *p_rs, const struct gen_profile *p_gp,
+        int rule_num, uint64_t seed)
+{
+    int i, d, try, ret, pool_num;
+    uint64_t state = f_seed(seed);
+    struct gen_profile cums;
+    struct gen_index idx;
+    struct rule *rules;
+    uint32_t *pools[2];
+
+    if (!p_rs || !p_gp || rule_num < 2) {
+        return -EINVAL;
+    }
+
+    cums = *p_gp;
+    if (!f_accumulate(cums.sip_lens, ARRAY_SIZE(cums.sip_lens)) ||
+        !f_accumulate(cums.dip_lens, ARRAY_SIZE(cums.dip_lens)) ||
+        !f_accumulate(cums.sport_cls, ARRAY_SIZE(cums.sport_cls)) ||
+        !f_accumulate(cums.dport_cls, ARRAY_SIZE(cums.dport_cls)) ||
+        !f_accumulate(cums.protos, ARRAY_SIZE(cums.protos))) {
+        fprintf(stderr, "Empty distribution in the profile\n");
+        return -EINVAL;
+    }
+
+    fprintf(stderr, "Generating %d rules\n", rule_num);
+
+    pool_num = rule_num / GEN_POOL_RATIO + 1;
+    rules = calloc(rule_num, sizeof(*rules));
+    pools[0] = malloc(pool_num * sizeof(*pools[0]));
+    pools[1] = malloc(pool_num * sizeof(*pools[1]));
+    if (!rules || !pools[0] || !pools[1] || f_index_init(&idx, rule_num)) {
+        perror("Cannot allocate memory for rules");
+        free(pools[1]);
+        free(pools[0]);
+        free(rules);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < pool_num; i++) {
+        pools[0][i] = f_rand(&state) >> 32;
+        pools[1][i] = f_rand(&state) >> 32;
+    }
+
+    for (ret = i = 0; i < rule_num - 1; i++) {
+        for (try = 0; try < GEN_RETRY_MAX; try++) {
+            f_gen_rule(&state, &rules[i], &cums,
+                    (const uint32_t **)pools, pool_num);
+            rules[i].pri = i;
+
+            ret = f_index_add(&idx, rules, i, 1);
+            if (ret != -EEXIST) {
+                break;
+            }
+        }
+
+        if (ret) {
+            fprintf(stderr, "Cannot generate %d distinct rules\n", rule_num);
+            ret = -ENOTSUP;
+            goto err;
+        }
+    }
+
+    for (d = 0; d < DIM_MAX; d++) {
+        rules[i].dims[d][0] = 0;
+    }
+
+    rules[i].dims[DIM_SIP][1] = rules[i].dims[DIM_DIP][1] = UINT32_MAX;
+    rules[i].dims[DIM_SPORT][1] = rules[i].dims[DIM_DPORT][1] = UINT16_MAX;
+    rules[i].dims[DIM_PROTO][1] = UINT8_MAX;
+    rules[i].pri = i;
+
+    p_rs->rules = rules;
+    p_rs->rule_num = rule_num;
+    p_rs->def_rule = rule_num - 1;
+
+    fprintf(stderr, "%d rules generated in %d tuples\n", rule_num,
+            idx.tuple_num);
+    f_index_term(&idx);
+    free(pools[1]);
+    free(pools[0]);
+
+    return 0;
+
+err:
+    f_index_term(&idx);
+    free(pools[1]);
+    free(pools[0]);
+    free(rules);
+
+    return ret;
+}
+
+/*
+ * Draw headers from uniformly chosen rules, each repeated a Pareto number
+ * of times for locality, and label them with the first matching rule
+ */
+int gen_trace(struct trace *p_t, const struct rule_set *p_rs, int pkt_num,
+        uint64_t seed)
+{
+    int i, j, d, rid, burst, ret;
+    uint64_t state = f_seed(~seed);
+    struct gen_index idx;
+    struct packet *pkts;
+    const struct rule *p_rule;
+    double x;
+
+    if (!p_t || !p_rs || !p_rs->rules || p_rs->rule_num < 1 || pkt_num < 1) {
+        return -EINVAL;
+    }
+
+    fprintf(stderr, "Generating %d packets\n", pkt_num);
+
+    pkts = calloc(pkt_num, sizeof(*pkts));
+    if (!pkts || f_index_init(&idx, p_rs->rule_num)) {
+        perror("Cannot allocate memory for packets");
+        free(pkts);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < p_rs->rule_num; i++) {
+        ret = f_index_add(&idx, p_rs->rules, i, 0);
+        if (ret) {
+            fprintf(stderr, "Cannot label non-prefix addresses\n");
+            f_index_term(&idx);
+            free(pkts);
+            return ret;
+        }
+    }
+
+    for (i = 0; i < pkt_num; i += burst) {
+        /* the default rule is left for headers matching nothing else */
+        rid = p_rs->rule_num > 1 ?
+            f_rand_range(&state, 0, p_rs->rule_num - 2) : 0;
+        p_rule = &p_rs->rules[rid];
+
+        for (d = 0; d < DIM_MAX; d++) {
+            pkts[i].dims[d] = f_rand_range(&state, p_rule->dims[d][0],
+                    p_rule->dims[d][1]);
+        }
+
+        if (p_rule->dims[DIM_PROTO][0] == 0 &&
+            p_rule->dims[DIM_PROTO][1] == UINT8_MAX) {
+            pkts[i].dims[DIM_PROTO] = f_rand(&state) & 1 ?
+                IP_PROTO_TCP : IP_PROTO_UDP;
+        }
+
+        rid = f_index_match(&idx, p_rs->rules, pkts[i].dims, rid);
+        pkts[i].match_rule = p_rs->rules[rid].pri;
+
+        x = GEN_BURST_SCALE / (1.0 - (f_rand(&state) >> 11) * 0x1.0p-53);
+        burst = x >= GEN_BURST_MAX ? GEN_BURST_MAX : 1 + (int)x;
+        burst = MIN(burst, pkt_num - i);
+
+        for (j = 1; j < burst; j++) {
+            pkts[i + j] = pkts[i];
+        }
+    }
+
+    p_t->pkts = pkts;
+    p_t->pkt_num = pkt_num;
+    p_t->p_map = NULL;
+    p_t->map_size = 0;
+
+    f_index_term(&idx);
+    fprintf(stderr, "%d packets generated\n", pkt_num);
+
+    return 0;
+}
+
+/* splitmix64, so that close seeds give unrelated states */
+static uint64_t f_seed(uint64_t seed)
+{
+    seed += 0x9e3779b97f4a7c15ULL;
+    seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+
+    return (seed ^ (seed >> 31)) | 1;
+}
+
+/* xorshift64*, the state is never 0 */
+static uint64_t f_rand(uint64_t *p_state)
+{
+    uint64_t x = *p_state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *p_state = x;
+
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static uint32_t f_rand_range(uint64_t *p_state, uint32_t lo, uint32_t hi)
+{
+    uint64_t span = (uint64_t)hi - lo + 1;
+
+    return lo + (uint32_t)(((f_rand(p_state) >> 32) * span) >> 32);
+}
+
+/* Turn weights into cumulative weights, return the total */
+static uint32_t f_accumulate(uint32_t *weights, int num)
+{
+    int i;
+
+    for (i = 1; i < num; i++) {
+        weights[i] += weights[i - 1];
+    }
+
+    return weights[num - 1];
+}
+
+static int f_pick(uint64_t *p_state, const uint32_t *cums, int num)
+{
+    int i;
+    uint32_t r = f_rand_range(p_state, 0, cums[num - 1] - 1);
+
+    for (i = 0; cums[i] <= r; i++);
+
+    return i;
+}
+
+/* The prefix length of an address range, or -1 if not a prefix */
+static int f_prefix_len(const uint32_t rng[2])
+{
+    uint32_t span = rng[1] - rng[0];
+
+    if (rng[0] > rng[1] || (span & (span + 1)) || (rng[0] & span)) {
+        return -1;
+    }
+
+    return 32 - popcount(span);
+}
+
+static int f_port_class(const uint32_t rng[2])
+{
+    if (rng[0] == rng[1]) {
+        return GEN_PORT_EM;
+
+    } else if (rng[0] == 0 && rng[1] == UINT16_MAX) {
+        return GEN_PORT_WC;
+
+    } else if (rng[0] == 1024 && rng[1] == UINT16_MAX) {
+        return GEN_PORT_HI;
+
+    } else if (rng[0] == 0 && rng[1] == 1023) {
+        return GEN_PORT_LO;
+    }
+
+    return GEN_PORT_AR;
+}
+
+/* Keep a random part of the prefix from a base address of the pool */
+static void f_gen_ip(uint64_t *p_state, uint32_t rng[2], int len,
+        const uint32_t *pool, int pool_num)
+{
+    uint32_t base, addr, keep_mask, mask;
+    int keep;
+
+    base = pool[f_rand_range(p_state, 0, pool_num - 1)];
+    keep = f_rand_range(p_state, len >> 1, len);
+    keep_mask = keep ? UINT32_MAX << (32 - keep) : 0;
+    mask = len ? UINT32_MAX << (32 - len) : 0;
+
+    addr = (base & keep_mask) | ((f_rand(p_state) >> 32) & ~keep_mask);
+    rng[0] = addr & mask;
+    rng[1] = addr | ~mask;
+
+    return;
+}
+
+static void f_gen_port(uint64_t *p_state, uint32_t rng[2], int cls)
+{
+    switch (cls) {
+    case GEN_PORT_WC:
+        rng[0] = 0, rng[1] = UINT16_MAX;
+        break;
+
+    case GEN_PORT_HI:
+        rng[0] = 1024, rng[1] = UINT16_MAX;
+        break;
+
+    case GEN_PORT_LO:
+        rng[0] = 0, rng[1] = 1023;
+        break;
+
+    case GEN_PORT_EM:
+        if (f_rand(p_state) & 3) {
+            rng[0] = s_gen_ports[f_rand_range(p_state, 0,
+                    ARRAY_SIZE(s_gen_ports) - 1)];
+        } else {
+            rng[0] = f_rand_range(p_state, 1, UINT16_MAX);
+        }
+
+        rng[1] = rng[0];
+        break;
+
+    default:
+        rng[0] = f_rand_range(p_state, 0, UINT16_MAX - 1);
+        rng[1] = rng[0] + (1U << f_rand_range(p_state, 1, 12)) - 1;
+        rng[1] = MIN(rng[1], UINT16_MAX);
+        break;
+    }
+
+    return;
+}
+
+static void f_gen_rule(uint64_t *p_state, struct rule *p_rule,
+        const struct gen_profile *p_cums, const uint32_t *pools[2],
+        int pool_num)
+{
+    int proto;
+
+    f_gen_ip(p_state, p_rule->dims[DIM_SIP], f_pick(p_state,
+            p_cums->sip_lens, ARRAY_SIZE(p_cums->sip_lens)),
+            pools[0], pool_num);
+    f_gen_ip(p_state, p_rule->dims[DIM_DIP], f_pick(p_state,
+            p_cums->dip_lens, ARRAY_SIZE(p_cums->dip_lens)),
+            pools[1], pool_num);
+
+    proto = f_pick(p_state, p_cums->protos, ARRAY_SIZE(p_cums->protos));
+    if (proto == GEN_PROTO_WC) {
+        p_rule->dims[DIM_PROTO][0] = 0;
+        p_rule->dims[DIM_PROTO][1] = UINT8_MAX;
+    } else {
+        p_rule->dims[DIM_PROTO][0] = p_rule->dims[DIM_PROTO][1] = proto;
+    }
+
+    /* only TCP and UDP have ports */
+    if (proto == GEN_PROTO_WC || proto == IP_PROTO_TCP ||
+        proto == IP_PROTO_UDP) {
+        f_gen_port(p_state, p_rule->dims[DIM_SPORT], f_pick(p_state,
+                p_cums->sport_cls, ARRAY_SIZE(p_cums->sport_cls)));
+        f_gen_port(p_state, p_rule->dims[DIM_DPORT], f_pick(p_state,
+                p_cums->dport_cls, ARRAY_SIZE(p_cums->dport_cls)));
+    } else {
+        f_gen_port(p_state, p_rule->dims[DIM_SPORT], GEN_PORT_WC);
+        f_gen_port(p_state, p_rule->dims[DIM_DPORT], GEN_PORT_WC);
+    }
+
+    return;
+}
+
+static int f_index_init(struct gen_index *p_idx, int rule_num)
+{
+    uint32_t i, slot_num = p2roundup((uint64_t)rule_num << 1);
+
+    p_idx->slots = malloc(slot_num * sizeof(*p_idx->slots));
+    p_idx->filter = calloc(slot_num >> 4 ? slot_num >> 4 : 1,
+            sizeof(*p_idx->filter));
+    p_idx->nexts = malloc(rule_num * sizeof(*p_idx->nexts));
+    p_idx->tuple_ids = malloc(GEN_TUPLE_MAX * sizeof(*p_idx->tuple_ids));
+    p_idx->tuples = malloc(GEN_TUPLE_MAX * sizeof(*p_idx->tuples));
+    if (!p_idx->slots || !p_idx->filter || !p_idx->nexts ||
+        !p_idx->tuple_ids || !p_idx->tuples) {
+        f_index_term(p_idx);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < slot_num; i++) {
+        p_idx->slots[i].head = -1;
+    }
+
+    for (i = 0; i < GEN_TUPLE_MAX; i++) {
+        p_idx->tuple_ids[i] = -1;
+    }
+
+    p_idx->slot_mask = slot_num - 1;
+    p_idx->tuple_num = 0;
+
+    return 0;
+}
+
+static void f_index_term(struct gen_index *p_idx)
+{
+    free(p_idx->tuples);
+    free(p_idx->tuple_ids);
+    free(p_idx->nexts);
+    free(p_idx->filter);
+    free(p_idx->slots);
+
+    return;
+}
+
+/* The key of the header in the tuple */
+static void f_index_key(const struct gen_index *p_idx, int tuple_id,
+        const uint32_t *dims, struct gen_slot *p_key)
+{
+    const struct gen_tuple *p_tuple = &p_idx->tuples[tuple_id];
+
+    p_key->ips = (uint64_t)(dims[DIM_SIP] & p_tuple->sip_mask) << 32 |
+        (dims[DIM_DIP] & p_tuple->dip_mask);
+    p_key->rest = (uint64_t)tuple_id << 40;
+    if (p_tuple->flags & GEN_EXACT_SPORT) {
+        p_key->rest |= (uint64_t)dims[DIM_SPORT] << 24;
+    }
+    if (p_tuple->flags & GEN_EXACT_DPORT) {
+        p_key->rest |= (uint64_t)dims[DIM_DPORT] << 8;
+    }
+    if (p_tuple->flags & GEN_EXACT_PROTO) {
+        p_key->rest |= dims[DIM_PROTO];
+    }
+
+    return;
+}
+
+static uint64_t f_index_hash(const struct gen_slot *p_key)
+{
+    uint64_t h = p_key->ips * 0x9e3779b97f4a7c15ULL ^
+        p_key->rest * 0xc2b2ae3d27d4eb4fULL;
+
+    return h ^ (h >> 29);
+}
+
+/* The filter bit of the key, taken from the high bits of the hash */
+static inline uint64_t *f_index_filter(const struct gen_index *p_idx,
+        uint64_t h, uint64_t *p_bit)
+{
+    uint64_t pos = (h >> 32) & ((((uint64_t)p_idx->slot_mask + 1) << 2) - 1);
+
+    *p_bit = 1ULL << (pos & 63);
+
+    return &p_idx->filter[pos >> 6];
+}
+
+/* The slot of the key, or the empty slot to insert it */
+static struct gen_slot *f_index_probe(const struct gen_index *p_idx,
+        const struct gen_slot *p_key, uint64_t h)
+{
+    struct gen_slot *p_slot;
+
+    for (p_slot = &p_idx->slots[h & p_idx->slot_mask]; p_slot->head != -1 &&
+        (p_slot->ips != p_key->ips || p_slot->rest != p_key->rest);
+        p_slot = &p_idx->slots[++h & p_idx->slot_mask]);
+
+    return p_slot;
+}
+
+/*
+ * Chain the rule to its key, rules must be added in priority order.
+ * With is_unique, a rule identical to one added is refused by -EEXIST.
+ */
+static int f_index_add(struct gen_index *p_idx, const struct rule *rules,
+        int rule_id, int is_unique)
+{
+    const struct rule *p_rule = &rules[rule_id];
+    struct gen_tuple *p_tuple;
+    struct gen_slot *p_slot, key;
+    uint64_t h, bit;
+    uint32_t dims[DIM_MAX];
+    int d, rid, sip_len, dip_len, flags, *p_tuple_id;
+
+    sip_len = f_prefix_len(p_rule->dims[DIM_SIP]);
+    dip_len = f_prefix_len(p_rule->dims[DIM_DIP]);
+    if (sip_len < 0 || dip_len < 0) {
+        return -ENOTSUP;
+    }
+
+    flags = (p_rule->dims[DIM_SPORT][0] == p_rule->dims[DIM_SPORT][1] ?
+            GEN_EXACT_SPORT : 0) |
+        (p_rule->dims[DIM_DPORT][0] == p_rule->dims[DIM_DPORT][1] ?
+            GEN_EXACT_DPORT : 0) |
+        (p_rule->dims[DIM_PROTO][0] == p_rule->dims[DIM_PROTO][1] ?
+            GEN_EXACT_PROTO : 0);
+
+    p_tuple_id = &p_idx->tuple_ids[(sip_len * 33 + dip_len) * 8 + flags];
+    if (*p_tuple_id == -1) {
+        p_tuple = &p_idx->tuples[p_idx->tuple_num];
+        p_tuple->sip_mask = sip_len ? UINT32_MAX << (32 - sip_len) : 0;
+        p_tuple->dip_mask = dip_len ? UINT32_MAX << (32 - dip_len) : 0;
+        p_tuple->flags = flags;
+        p_tuple->min_rule = rule_id;
+        *p_tuple_id = p_idx->tuple_num++;
+    }
+
+    for (d = 0; d < DIM_MAX; d++) {
+        dims[d] = p_rule->dims[d][0];
+    }
+
+    f_index_key(p_idx, *p_tuple_id, dims, &key);
+    h = f_index_hash(&key);
+    *f_index_filter(p_idx, h, &bit) |= bit;
+
+    p_slot = f_index_probe(p_idx, &key, h);
+    if (p_slot->head == -1) {
+        *p_slot = key;
+        p_slot->head = rule_id;
+
+    } else {
+        for (rid = p_slot->head; is_unique && rid != -1;
+            rid = p_idx->nexts[rid]) {
+            if (!memcmp(rules[rid].dims, p_rule->dims,
+                sizeof(p_rule->dims))) {
+                return -EEXIST;
+            }
+        }
+
+        p_idx->nexts[p_slot->tail] = rule_id;
+    }
+
+    p_idx->nexts[rule_id] = -1;
+    p_slot->tail = rule_id;
+
+    return 0;
+}
+
+/* The first rule matching the header, best is a rule known to match.
+ * Rule ids are taken as priorities. */
+static int f_index_match(const struct gen_index *p_idx,
+        const struct rule *rules, const uint32_t *dims, int best)
+{
+    const struct gen_slot *p_slot;
+    struct gen_slot key;
+    uint64_t h, bit;
+    int t, d, rid;
+
+    for (t = 0; t < p_idx->tuple_num &&
+        p_idx->tuples[t].min_rule < best; t++) {
+        f_index_key(p_idx, t, dims, &key);
+        h = f_index_hash(&key);
+        if (!(*f_index_filter(p_idx, h, &bit) & bit)) {
+            continue;
+        }
+
+        p_slot = f_index_probe(p_idx, &key, h);
+
+        for (rid = p_slot->head; rid != -1 && rid < best;
+            rid = p_idx->nexts[rid]) {
+            for (d = 0; d < DIM_MAX && dims[d] >= rules[rid].dims[d][0] &&
+                dims[d] <= rules[rid].dims[d][1]; d++);
+
+            if (d == DIM_MAX) {
+                best = rid;
+                break;
+            }
+        }
+    }
+
+    return best;
+}
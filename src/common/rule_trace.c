@@ -10,22 +10,54 @@
  *               Tsinghua University (THU)
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "common/impl.h"
 #include "common/point_range.h"
 #include "common/rule_trace.h"
 
 
+/* A text file mapped into memory and scanned in place */
+struct text_scan {
+    const char *cur;
+    const char *end;
+    void *p_map;
+    size_t size;
+};
+
+static int f_scan_open(struct text_scan *p_scan, const char *s_file);
+static void f_scan_close(struct text_scan *p_scan);
+static int f_scan_more(struct text_scan *p_scan);
+static int f_scan_char(struct text_scan *p_scan, char c);
+static int f_scan_u32(struct text_scan *p_scan, uint32_t *p_value);
+static int f_scan_x32(struct text_scan *p_scan, uint32_t *p_value);
+static int f_scan_d32(struct text_scan *p_scan, int32_t *p_value);
+static int f_scan_ip(struct text_scan *p_scan, uint32_t *p_ip,
+        uint32_t *p_mask);
+static int f_scan_packet(struct text_scan *p_scan, struct packet *p_pkt);
+static int f_map_trace(struct trace *p_t, struct text_scan *p_scan);
+static int f_load_pcap(struct trace *p_t, struct text_scan *p_scan);
+
+static void f_shadow_ranges(struct shadow_range *srngs,
+        const int64_t *spnts, int spnt_num);
+
+
 int load_rules(struct rule_set *p_rs, const char *s_rf)
 {
-    FILE *fp_rule;
-    struct rule *rules;
-
-    uint32_t src_ip_0, src_ip_1, src_ip_2, src_ip_3, src_ip_mask;
-    uint32_t dst_ip_0, dst_ip_1, dst_ip_2, dst_ip_3, dst_ip_mask;
-    int ret, i = 0;
+    struct text_scan scan;
+    struct rule_vector rules;
+    struct rule *p_rule;
+    uint32_t src_ip, src_ip_mask, dst_ip, dst_ip_mask;
+    int ret;
 
     if (!p_rs || !s_rf) {
         return -EINVAL;
@@ -33,77 +65,80 @@ int load_rules(struct rule_set *p_rs, const char *s_rf)
 
     fprintf(stderr, "Loading rules from %s\n", s_rf);
 
-    fp_rule = fopen(s_rf, "r");
-    if (!fp_rule) {
+    if (f_scan_open(&scan, s_rf)) {
         fprintf(stderr, "Cannot open file %s", s_rf);
         return -errno;
     }
 
-    rules = calloc(RULE_MAX, sizeof(*rules));
-    if (!rules) {
-        perror("Cannot allocate memory for rules");
-        fclose(fp_rule);
-        return -ENOMEM;
-    }
+    VECTOR_INIT(&rules);
 
-    /* scan rule file */
-    while (!feof(fp_rule)) {
-        if (i >= RULE_MAX) {
+    /* scan rule file: "@ip/mask ip/mask port : port port : port hex/hex" */
+    do {
+        if (VECTOR_LEN(&rules) >= INT_MAX) {
             fprintf(stderr, "Too many rules\n");
             ret = -ENOTSUP;
             goto err;
         }
 
-        if (fscanf(fp_rule, WUSTL_RULE_FMT_SCN,
-            &src_ip_0, &src_ip_1, &src_ip_2, &src_ip_3, &src_ip_mask,
-            &dst_ip_0, &dst_ip_1, &dst_ip_2, &dst_ip_3, &dst_ip_mask,
-            &rules[i].dims[DIM_SPORT][0], &rules[i].dims[DIM_SPORT][1],
-            &rules[i].dims[DIM_DPORT][0], &rules[i].dims[DIM_DPORT][1],
-            &rules[i].dims[DIM_PROTO][0], &rules[i].dims[DIM_PROTO][1]) != 16) {
+        if (VECTOR_FULL(&rules) && VECTOR_EXTEND(rule_vector, &rules,
+            VECTOR_LEN(&rules) + 1)) {
+            perror("Cannot allocate memory for rules");
+            ret = -ENOMEM;
+            goto err;
+        }
+
+        p_rule = VECTOR_ADDR(&rules, VECTOR_LEN(&rules));
+        if (f_scan_char(&scan, '@') ||
+            f_scan_ip(&scan, &src_ip, &src_ip_mask) ||
+            f_scan_ip(&scan, &dst_ip, &dst_ip_mask) ||
+            f_scan_u32(&scan, &p_rule->dims[DIM_SPORT][0]) ||
+            f_scan_char(&scan, ':') ||
+            f_scan_u32(&scan, &p_rule->dims[DIM_SPORT][1]) ||
+            f_scan_u32(&scan, &p_rule->dims[DIM_DPORT][0]) ||
+            f_scan_char(&scan, ':') ||
+            f_scan_u32(&scan, &p_rule->dims[DIM_DPORT][1]) ||
+            f_scan_x32(&scan, &p_rule->dims[DIM_PROTO][0]) ||
+            f_scan_char(&scan, '/') ||
+            f_scan_x32(&scan, &p_rule->dims[DIM_PROTO][1])) {
             fprintf(stderr, "Illegal rule format\n");
             ret = -ENOTSUP;
             goto err;
         }
 
         /* src ip */
-        src_ip_0 = (src_ip_0 << 24) | (src_ip_1 << 16) |
-            (src_ip_2 << 8) | src_ip_3;
         src_ip_mask = (uint32_t)(~((1ULL << (32 - src_ip_mask)) - 1));
-        rules[i].dims[DIM_SIP][0] = src_ip_0 & src_ip_mask;
-        rules[i].dims[DIM_SIP][1] = src_ip_0 | (~src_ip_mask);
+        p_rule->dims[DIM_SIP][0] = src_ip & src_ip_mask;
+        p_rule->dims[DIM_SIP][1] = src_ip | (~src_ip_mask);
 
         /* dst ip */
-        dst_ip_0 = (dst_ip_0 << 24) | (dst_ip_1 << 16) |
-            (dst_ip_2 << 8) | dst_ip_3;
         dst_ip_mask = (uint32_t)(~((1ULL << (32 - dst_ip_mask)) - 1));
-        rules[i].dims[DIM_DIP][0] = dst_ip_0 & dst_ip_mask;
-        rules[i].dims[DIM_DIP][1] = dst_ip_0 | (~dst_ip_mask);
+        p_rule->dims[DIM_DIP][0] = dst_ip & dst_ip_mask;
+        p_rule->dims[DIM_DIP][1] = dst_ip | (~dst_ip_mask);
 
         /* proto */
-        if (rules[i].dims[DIM_PROTO][1] == 0xff) {
-            rules[i].dims[DIM_PROTO][1] = rules[i].dims[DIM_PROTO][0];
+        if (p_rule->dims[DIM_PROTO][1] == 0xff) {
+            p_rule->dims[DIM_PROTO][1] = p_rule->dims[DIM_PROTO][0];
 
-        } else if (!rules[i].dims[DIM_PROTO][1]) {
-            rules[i].dims[DIM_PROTO][0] = 0;
-            rules[i].dims[DIM_PROTO][1] = 0xff;
+        } else if (!p_rule->dims[DIM_PROTO][1]) {
+            p_rule->dims[DIM_PROTO][0] = 0;
+            p_rule->dims[DIM_PROTO][1] = 0xff;
         }
 
-        rules[i].pri = i;
-        i++;
-    }
+        p_rule->pri = VECTOR_LEN(&rules)++;
+    } while (f_scan_more(&scan));
 
-    p_rs->rules = rules;
-    p_rs->rule_num = i;
-    p_rs->def_rule = i - 1;
+    p_rs->rules = VECTOR_BASE(&rules);
+    p_rs->rule_num = VECTOR_LEN(&rules);
+    p_rs->def_rule = p_rs->rule_num - 1;
 
-    fclose(fp_rule);
-    fprintf(stderr, "%d rules loaded\n", i);
+    f_scan_close(&scan);
+    fprintf(stderr, "%d rules loaded\n", p_rs->rule_num);
 
     return 0;
 
 err:
-    free(rules);
-    fclose(fp_rule);
+    VECTOR_TERM(&rules);
+    f_scan_close(&scan);
 
     return ret;
 }
@@ -119,11 +154,75 @@ void unload_rules(struct rule_set *p_rs)
     return;
 }
 
+/* Write the rules in the format read by load_rules, addresses must be
+ * prefixes */
+int dump_rules(const char *s_rf, const struct rule_set *p_rs)
+{
+    FILE *fp;
+    int i, d, lens[2];
+    const struct rule *p_rule;
+
+    if (!s_rf || !p_rs || !p_rs->rules) {
+        return -EINVAL;
+    }
+
+    fprintf(stderr, "Dumping rules to %s\n", s_rf);
+
+    fp = fopen(s_rf, "w");
+    if (!fp) {
+        fprintf(stderr, "Cannot open file %s\n", s_rf);
+        return -errno;
+    }
+
+    for (i = 0; i < p_rs->rule_num; i++) {
+        p_rule = &p_rs->rules[i];
+
+        for (d = DIM_SIP; d <= DIM_DIP; d++) {
+            uint32_t span = p_rule->dims[d][1] - p_rule->dims[d][0];
+
+            if (p_rule->dims[d][0] > p_rule->dims[d][1] ||
+                (span & (span + 1)) || (p_rule->dims[d][0] & span)) {
+                fprintf(stderr, "Cannot dump non-prefix addresses\n");
+                fclose(fp);
+                return -ENOTSUP;
+            }
+
+            lens[d] = 32 - popcount(span);
+        }
+
+        fprintf(fp, "@%u.%u.%u.%u/%d %u.%u.%u.%u/%d %u : %u %u : %u ",
+                p_rule->dims[DIM_SIP][0] >> 24,
+                (p_rule->dims[DIM_SIP][0] >> 16) & 0xff,
+                (p_rule->dims[DIM_SIP][0] >> 8) & 0xff,
+                p_rule->dims[DIM_SIP][0] & 0xff, lens[DIM_SIP],
+                p_rule->dims[DIM_DIP][0] >> 24,
+                (p_rule->dims[DIM_DIP][0] >> 16) & 0xff,
+                (p_rule->dims[DIM_DIP][0] >> 8) & 0xff,
+                p_rule->dims[DIM_DIP][0] & 0xff, lens[DIM_DIP],
+                p_rule->dims[DIM_SPORT][0], p_rule->dims[DIM_SPORT][1],
+                p_rule->dims[DIM_DPORT][0], p_rule->dims[DIM_DPORT][1]);
+
+        if (p_rule->dims[DIM_PROTO][0] == p_rule->dims[DIM_PROTO][1]) {
+            fprintf(fp, "0x%02X/0xFF\n", p_rule->dims[DIM_PROTO][0]);
+        } else {
+            fprintf(fp, "0x00/0x00\n");
+        }
+    }
+
+    if (ferror(fp) | fclose(fp)) {
+        perror("Cannot write rules");
+        return -EIO;
+    }
+
+    return 0;
+}
+
 int load_trace(struct trace *p_t, const char *s_tf)
 {
-    FILE *fp_trace;
-    struct packet *pkts;
-    int ret, i = 0;
+    struct text_scan scan;
+    struct packet_vector pkts;
+    struct packet *p_pkt;
+    int ret;
 
     if (!p_t || !s_tf) {
         return -EINVAL;
@@ -131,51 +230,59 @@ int load_trace(struct trace *p_t, const char *s_tf)
 
     fprintf(stderr, "Loading trace from %s\n", s_tf);
 
-    fp_trace = fopen(s_tf, "r");
-    if (!fp_trace) {
+    if (f_scan_open(&scan, s_tf)) {
         fprintf(stderr, "Cannot open file %s", s_tf);
         return -errno;
     }
 
-    pkts = calloc(PKT_MAX, sizeof(*pkts));
-    if (!pkts) {
-        perror("Cannot allocate memory for packets");
-        fclose(fp_trace);
-        return -ENOMEM;
+    if (scan.size >= sizeof(struct trace_file_header) &&
+        ((struct trace_file_header *)scan.p_map)->magic == TRACE_FILE_MAGIC) {
+        return f_map_trace(p_t, &scan);
+
+    } else if (pcap_detect(scan.p_map, scan.size)) {
+        return f_load_pcap(p_t, &scan);
     }
 
-    /* scan trace file */
-    while (!feof(fp_trace)) {
-        if (i >= PKT_MAX) {
+    VECTOR_INIT(&pkts);
+
+    /* scan trace file: "sip dip sport dport proto match" */
+    do {
+        if (VECTOR_LEN(&pkts) >= INT_MAX) {
             fprintf(stderr, "Too many packets\n");
             ret = -ENOTSUP;
             goto err;
         }
 
-        if (fscanf(fp_trace, WUSTL_PKT_FMT_SCN,
-            &pkts[i].dims[DIM_SIP], &pkts[i].dims[DIM_DIP],
-            &pkts[i].dims[DIM_SPORT], &pkts[i].dims[DIM_DPORT],
-            &pkts[i].dims[DIM_PROTO], &pkts[i].match_rule) != 6) {
+        if (VECTOR_FULL(&pkts) && VECTOR_EXTEND(packet_vector, &pkts,
+            VECTOR_LEN(&pkts) + 1)) {
+            perror("Cannot allocate memory for packets");
+            ret = -ENOMEM;
+            goto err;
+        }
+
+        p_pkt = VECTOR_ADDR(&pkts, VECTOR_LEN(&pkts));
+        if (f_scan_packet(&scan, p_pkt)) {
             fprintf(stderr, "Illegal packet format\n");
             ret = -ENOTSUP;
             goto err;
         }
 
-        pkts[i].match_rule--;
-        i++;
-    }
+        VECTOR_LEN(&pkts)++;
+    } while (f_scan_more(&scan));
 
-    p_t->pkts = pkts;
-    p_t->pkt_num = i;
+    p_t->pkts = VECTOR_BASE(&pkts);
+    p_t->pkt_num = VECTOR_LEN(&pkts);
+    p_t->p_map = NULL;
+    p_t->map_size = 0;
 
-    fclose(fp_trace);
-    fprintf(stderr, "%d packets loaded\n", i);
+    f_scan_close(&scan);
+    fprintf(stderr, "%d packets loaded\n", p_t->pkt_num);
 
     return 0;
 
 err:
-    free(pkts);
-    fclose(fp_trace);
+    VECTOR_TERM(&pkts);
+    f_scan_close(&scan);
 
     return ret;
 }
@@ -186,18 +293,308 @@ void unload_trace(struct trace *p_t)
         return;
     }
 
-    free(p_t->pkts);
+    if (p_t->p_map) {
+        munmap(p_t->p_map, p_t->map_size);
+    } else {
+        free(p_t->pkts);
+    }
+
+    return;
+}
+
+/* Linear scan reference: the first rule in priority over all subsets */
+void label_trace(struct trace *p_t, const struct partition *p_pa)
+{
+    int i, j, k, d, pri;
+
+    if (!p_t || !p_t->pkts || !p_pa || !p_pa->subsets) {
+        return;
+    }
+
+    for (i = 0; i < p_t->pkt_num; i++) {
+        const uint32_t *dims = p_t->pkts[i].dims;
+
+        for (pri = INT_MAX, j = 0; j < p_pa->subset_num; j++) {
+            const struct rule_set *p_rs = &p_pa->subsets[j];
+
+            for (k = 0; k < p_rs->rule_num; k++) {
+                const struct rule *p_rule = &p_rs->rules[k];
+
+                if (p_rule->pri >= pri) {
+                    continue;
+                }
+
+                for (d = 0; d < DIM_MAX && dims[d] >= p_rule->dims[d][0] &&
+                    dims[d] <= p_rule->dims[d][1]; d++);
+
+                if (d == DIM_MAX) {
+                    pri = p_rule->pri;
+                }
+            }
+        }
+
+        p_t->pkts[i].match_rule = pri == INT_MAX ? TRACE_MATCH_UNKNOWN : pri;
+    }
+
+    return;
+}
+
+int dump_trace(const char *s_tf, const struct trace *p_t)
+{
+    FILE *fp;
+    struct trace_file_header hdr;
+
+    if (!s_tf || !p_t || !p_t->pkts || p_t->pkt_num <= 0) {
+        return -EINVAL;
+    }
+
+    if (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__) {
+        fprintf(stderr, "Binary trace needs a little-endian host\n");
+        return -ENOTSUP;
+    }
+
+    fprintf(stderr, "Dumping trace to %s\n", s_tf);
+
+    fp = fopen(s_tf, "wb");
+    if (!fp) {
+        fprintf(stderr, "Cannot open file %s\n", s_tf);
+        return -errno;
+    }
+
+    hdr.magic = TRACE_FILE_MAGIC;
+    hdr.version = TRACE_FILE_VERSION;
+    hdr.pkt_size = sizeof(*p_t->pkts);
+    hdr.pkt_num = p_t->pkt_num;
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        fwrite(p_t->pkts, sizeof(*p_t->pkts), p_t->pkt_num, fp) !=
+        p_t->pkt_num) {
+        perror("Cannot write trace");
+        fclose(fp);
+        return -EIO;
+    }
+
+    if (fclose(fp)) {
+        perror("Cannot write trace");
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/* Write the trace in the text format, with match_rule counted from 1 */
+int print_trace(const char *s_tf, const struct trace *p_t)
+{
+    FILE *fp;
+    int i;
+
+    if (!s_tf || !p_t || !p_t->pkts) {
+        return -EINVAL;
+    }
+
+    fprintf(stderr, "Printing trace to %s\n", s_tf);
+
+    fp = fopen(s_tf, "w");
+    if (!fp) {
+        fprintf(stderr, "Cannot open file %s\n", s_tf);
+        return -errno;
+    }
+
+    for (i = 0; i < p_t->pkt_num; i++) {
+        const struct packet *p_pkt = &p_t->pkts[i];
+
+        fprintf(fp, "%"PRIu32" %"PRIu32" %"PRIu32" %"PRIu32" %"PRIu32" %d\n",
+                p_pkt->dims[DIM_SIP], p_pkt->dims[DIM_DIP],
+                p_pkt->dims[DIM_SPORT], p_pkt->dims[DIM_DPORT],
+                p_pkt->dims[DIM_PROTO], p_pkt->match_rule + 1);
+    }
+
+    if (ferror(fp) | fclose(fp)) {
+        perror("Cannot write trace");
+        return -EIO;
+    }
+
+    return 0;
+}
+
+int open_trace(struct trace_stream *p_ts, const char *s_tf)
+{
+    struct trace_file_header hdr;
+    struct stat st;
+    ssize_t n;
+
+    if (!p_ts || !s_tf) {
+        return -EINVAL;
+    }
+
+    fprintf(stderr, "Streaming trace from %s\n", s_tf);
+
+    p_ts->fd = open(s_tf, O_RDONLY);
+    if (p_ts->fd == -1) {
+        fprintf(stderr, "Cannot open file %s", s_tf);
+        return -errno;
+    }
+
+    p_ts->buf = malloc(TRACE_STREAM_BUF_SIZE);
+    if (!p_ts->buf) {
+        perror("Cannot allocate memory for trace buffer");
+        close(p_ts->fd);
+        return -ENOMEM;
+    }
+
+    posix_fadvise(p_ts->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    p_ts->len = p_ts->cur = 0;
+    p_ts->is_eof = p_ts->is_binary = p_ts->is_pcap = 0;
+
+    /* packets of a binary trace are copied as they are after the header */
+    n = pread(p_ts->fd, &hdr, sizeof(hdr), 0);
+    if (n == sizeof(hdr) && hdr.magic == TRACE_FILE_MAGIC) {
+        if (hdr.version != TRACE_FILE_VERSION ||
+            hdr.pkt_size != sizeof(struct packet) || fstat(p_ts->fd, &st) ||
+            st.st_size != sizeof(hdr) + (off_t)hdr.pkt_num * hdr.pkt_size ||
+            __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__ ||
+            lseek(p_ts->fd, sizeof(hdr), SEEK_SET) == -1) {
+            fprintf(stderr, "Illegal binary trace format\n");
+            close_trace(p_ts);
+            return -ENOTSUP;
+        }
+
+        p_ts->is_binary = 1;
+
+    } else if (n > 0 && pcap_detect(&hdr, n)) {
+        pcap_init(&p_ts->pcap);
+        p_ts->is_pcap = 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Parse up to pkt_num packets, return the number parsed and 0 at the end
+ * of the trace. Only complete lines (or records of a binary trace) are
+ * taken before the end of file, the partial one left is moved to the
+ * buffer front and read again.
+ */
+int read_trace(struct trace_stream *p_ts, struct packet *pkts, int pkt_num)
+{
+    int i = 0, is_pkt;
+    ssize_t n;
+    struct text_scan scan;
+
+    if (!p_ts || !pkts || pkt_num <= 0) {
+        return -EINVAL;
+    }
+
+    while (1) {
+        if (p_ts->is_binary) {
+            n = (p_ts->len - p_ts->cur) / sizeof(*pkts);
+            if (n > pkt_num - i) {
+                n = pkt_num - i;
+            }
+
+            memcpy(pkts + i, p_ts->buf + p_ts->cur, n * sizeof(*pkts));
+            p_ts->cur += n * sizeof(*pkts);
+            i += n;
+
+            if (p_ts->is_eof && i < pkt_num && p_ts->cur < p_ts->len) {
+                fprintf(stderr, "Illegal binary trace format\n");
+                return -ENOTSUP;
+            }
+
+        } else if (p_ts->is_pcap) {
+            while (i < pkt_num) {
+                n = pcap_parse(&p_ts->pcap, p_ts->buf + p_ts->cur,
+                        p_ts->len - p_ts->cur, &pkts[i], &is_pkt);
+                if (n < 0) {
+                    fprintf(stderr, "Illegal pcap format\n");
+                    return -ENOTSUP;
+
+                } else if (!n && p_ts->is_eof && p_ts->cur < p_ts->len) {
+                    /* a capture cut short keeps the records before */
+                    fprintf(stderr, "Warning: pcap truncated, last %zu "
+                            "bytes ignored\n", p_ts->len - p_ts->cur);
+                    p_ts->cur = p_ts->len;
+                    break;
+
+                } else if (!n) {
+                    break;
+                }
+
+                p_ts->cur += n;
+                i += is_pkt;
+            }
+
+        } else {
+            scan.cur = p_ts->buf + p_ts->cur;
+            scan.end = p_ts->buf + p_ts->len;
+            if (!p_ts->is_eof) {
+                const char *p_eol = memrchr(scan.cur, '\n',
+                        scan.end - scan.cur);
+                scan.end = p_eol ? p_eol + 1 : scan.cur;
+            }
+
+            while (i < pkt_num && f_scan_more(&scan)) {
+                if (f_scan_packet(&scan, &pkts[i])) {
+                    fprintf(stderr, "Illegal packet format\n");
+                    return -ENOTSUP;
+                }
+
+                i++;
+            }
+
+            p_ts->cur = scan.cur - p_ts->buf;
+        }
+
+        if (i == pkt_num || p_ts->is_eof) {
+            return i;
+        }
+
+        /* refill after the unparsed bytes */
+        p_ts->len -= p_ts->cur;
+        memmove(p_ts->buf, p_ts->buf + p_ts->cur, p_ts->len);
+        p_ts->cur = 0;
+        if (p_ts->len == TRACE_STREAM_BUF_SIZE) {
+            fprintf(stderr, "Illegal packet format\n");
+            return -ENOTSUP;
+        }
+
+        n = read(p_ts->fd, p_ts->buf + p_ts->len,
+                TRACE_STREAM_BUF_SIZE - p_ts->len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("Cannot read trace");
+            return -errno;
+        }
+
+        p_ts->is_eof = !n;
+        p_ts->len += n;
+    }
+}
+
+void close_trace(struct trace_stream *p_ts)
+{
+    if (!p_ts) {
+        return;
+    }
+
+    free(p_ts->buf);
+    close(p_ts->fd);
 
     return;
 }
 
 int load_partition(struct partition *p_pa, const char *s_pf)
 {
-    FILE *fp_part;
-    struct rule_set *subsets;
+    struct text_scan scan;
+    struct rule_set_vector subsets;
+    struct rule_set *p_rs;
     struct rule *rules;
 
     uint32_t part_idx, rule_num;
+    size_t j;
     int ret, i = 0;
 
     if (!p_pa || !s_pf) {
@@ -206,30 +603,41 @@ int load_partition(struct partition *p_pa, const char *s_pf)
 
     fprintf(stderr, "Loading partition from %s\n", s_pf);
 
-    fp_part = fopen(s_pf, "r");
-    if (!fp_part) {
+    if (f_scan_open(&scan, s_pf)) {
         fprintf(stderr, "Cannot open file %s", s_pf);
         return -errno;
     }
 
-    subsets = calloc(PART_MAX, sizeof(*subsets));
-    if (!subsets) {
-        perror("Cannot allocate memory for subsets");
-        fclose(fp_part);
-        return -ENOMEM;
-    }
-
+    VECTOR_INIT(&subsets);
     p_pa->rule_num = p_pa->subset_num = 0;
 
-    while (!feof(fp_part)) {
-        if (p_pa->subset_num >= PART_MAX) {
-            fprintf(stderr, "Too many partitions\n");
+    /* scan partition file: "#index,rule_num" and then rule_num rules */
+    do {
+        if (f_scan_char(&scan, '#') || f_scan_u32(&scan, &part_idx) ||
+            f_scan_char(&scan, ',') || f_scan_u32(&scan, &rule_num) ||
+            part_idx >= INT_MAX || !rule_num || rule_num >= INT_MAX) {
+            fprintf(stderr, "Illegal partition header format\n");
             ret = -ENOTSUP;
             goto err;
         }
 
-        if (fscanf(fp_part, PART_HEAD_FMT_SCN, &part_idx, &rule_num) != 2) {
-            fprintf(stderr, "Illegal partition header format\n");
+        /* subsets are indexed by the file, slots in between stay empty */
+        if (part_idx >= VECTOR_LEN(&subsets)) {
+            if (VECTOR_EXTEND(rule_set_vector, &subsets, part_idx + 1)) {
+                perror("Cannot allocate memory for subsets");
+                ret = -ENOMEM;
+                goto err;
+            }
+
+            memset(VECTOR_ADDR(&subsets, VECTOR_LEN(&subsets)), 0,
+                    (part_idx + 1 - VECTOR_LEN(&subsets)) *
+                    sizeof(*VECTOR_BASE(&subsets)));
+            VECTOR_LEN(&subsets) = part_idx + 1;
+        }
+
+        p_rs = VECTOR_ADDR(&subsets, part_idx);
+        if (p_rs->rules) {
+            fprintf(stderr, "Duplicate partition %"PRIu32"\n", part_idx);
             ret = -ENOTSUP;
             goto err;
         }
@@ -242,13 +650,16 @@ int load_partition(struct partition *p_pa, const char *s_pf)
         }
 
         for (i = 0; i < rule_num; i++) {
-            if (fscanf(fp_part, PART_RULE_FMT_SCN,
-                &rules[i].dims[DIM_SIP][0], &rules[i].dims[DIM_SIP][1],
-                &rules[i].dims[DIM_DIP][0], &rules[i].dims[DIM_DIP][1],
-                &rules[i].dims[DIM_SPORT][0], &rules[i].dims[DIM_SPORT][1],
-                &rules[i].dims[DIM_DPORT][0], &rules[i].dims[DIM_DPORT][1],
-                &rules[i].dims[DIM_PROTO][0], &rules[i].dims[DIM_PROTO][1],
-                &rules[i].pri) != 11) {
+            int d, illegal = f_scan_char(&scan, '@');
+
+            for (d = 0; !illegal && d < DIM_MAX; d++) {
+                illegal = f_scan_u32(&scan, &rules[i].dims[d][0]) ||
+                    f_scan_char(&scan, ',') ||
+                    f_scan_u32(&scan, &rules[i].dims[d][1]) ||
+                    f_scan_char(&scan, ',');
+            }
+
+            if (illegal || f_scan_d32(&scan, &rules[i].pri)) {
                 fprintf(stderr, "Illegal partition rule format\n");
                 free(rules);
                 ret = -ENOTSUP;
@@ -256,30 +667,36 @@ int load_partition(struct partition *p_pa, const char *s_pf)
             }
         }
 
-        subsets[part_idx].rules = rules;
-        subsets[part_idx].rule_num = rule_num;
-        subsets[part_idx].def_rule = rules[i - 1].pri;
+        p_rs->rules = rules;
+        p_rs->rule_num = rule_num;
+        p_rs->def_rule = rules[i - 1].pri;
 
         p_pa->rule_num += rule_num;
         p_pa->subset_num++;
+    } while (f_scan_more(&scan));
+
+    if (p_pa->subset_num != VECTOR_LEN(&subsets)) {
+        fprintf(stderr, "Missing partitions\n");
+        ret = -ENOTSUP;
+        goto err;
     }
 
-    p_pa->subsets = subsets;
+    p_pa->subsets = VECTOR_BASE(&subsets);
     p_pa->rule_num -= p_pa->subset_num - 1;
 
-    fclose(fp_part);
+    f_scan_close(&scan);
     fprintf(stderr, "%d subsets and %d rules loaded\n",
             p_pa->subset_num, p_pa->rule_num);
 
     return 0;
 
 err:
-    while (--p_pa->subset_num >= 0) {
-        unload_rules(&subsets[p_pa->subset_num]);
-    };
+    for (j = 0; j < VECTOR_LEN(&subsets); j++) {
+        unload_rules(VECTOR_ADDR(&subsets, j));
+    }
 
-    free(subsets);
-    fclose(fp_part);
+    VECTOR_TERM(&subsets);
+    f_scan_close(&scan);
 
     return ret;
 }
@@ -444,8 +861,8 @@ int shadow_rules(struct shadow_range *srngs, int64_t *spnts,
         const uint32_t dim_rng[2], const int *rule_id, int rule_num,
         const struct rule *rules, int dim)
 {
-    uint32_t *pnts, begin, end;
-    int *cnts, i, last, cur_cnt, total, pnt_num, spnt_num;
+    uint32_t begin, end;
+    int i, spnt_num;
 
     if (!srngs || !srngs->pnts || !dim_rng || dim_rng[0] > dim_rng[1] ||
         !rule_id || !rule_num || !rules || dim <= DIM_INV || dim >= DIM_MAX) {
@@ -464,9 +881,77 @@ int shadow_rules(struct shadow_range *srngs, int64_t *spnts,
         spnts[i] = (spnts[i] << 1) + 1;
     }
 
-    QSORT(int64, spnts, spnt_num);
+    SORT(int64, spnts, spnts + spnt_num, spnt_num);
+
+    /* step 2: de-duplicated and output */
+    f_shadow_ranges(srngs, spnts, spnt_num);
+
+    return 0;
+}
+
+int sort_rule_ends(int *ends, int64_t *spnts, const int *rule_id,
+        int rule_num, const struct rule *rules, int dim)
+{
+    int i, spnt_num;
+
+    if (!ends || !spnts || !rule_id || !rule_num || !rules ||
+        dim <= DIM_INV || dim >= DIM_MAX) {
+        return -EINVAL;
+    }
+
+    /* the projected endpoint is followed by the rule id in sorting keys */
+    spnt_num = rule_num << 1;
+    for (i = 0; i < spnt_num; i++) {
+        int64_t rid = rule_id[i >> 1];
+
+        assert(rid < (1 << 30));
+        spnts[i] = (int64_t)rules[rid].dims[dim][0] << 31 | rid;
+        spnts[++i] = ((int64_t)rules[rid].dims[dim][1] << 1 | 1) << 30 | rid;
+    }
+
+    SORT(int64, spnts, spnts + spnt_num, spnt_num);
+
+    for (i = 0; i < spnt_num; i++) {
+        ends[i] = (spnts[i] & ((1 << 30) - 1)) << 1 | ((spnts[i] >> 30) & 1);
+    }
+
+    return 0;
+}
+
+int shadow_sorted_rules(struct shadow_range *srngs, int64_t *spnts,
+        const uint32_t dim_rng[2], const int *ends, int end_num,
+        const struct rule *rules, int dim)
+{
+    int i;
+    uint32_t pnt;
+
+    if (!srngs || !srngs->pnts || !dim_rng || dim_rng[0] > dim_rng[1] ||
+        !ends || !end_num || !rules || dim <= DIM_INV || dim >= DIM_MAX) {
+        return -EINVAL;
+    }
+
+    /* step 1: project, clamping keeps the order of sorted endpoints */
+    for (i = 0; i < end_num; i++) {
+        pnt = rules[ends[i] >> 1].dims[dim][ends[i] & 1];
+        if (ends[i] & 1) {
+            spnts[i] = (int64_t)(pnt > dim_rng[1] ? dim_rng[1] : pnt) << 1 | 1;
+        } else {
+            spnts[i] = (int64_t)(pnt < dim_rng[0] ? dim_rng[0] : pnt) << 1;
+        }
+    }
 
     /* step 2: de-duplicated and output */
+    f_shadow_ranges(srngs, spnts, end_num);
+
+    return 0;
+}
+
+static void f_shadow_ranges(struct shadow_range *srngs,
+        const int64_t *spnts, int spnt_num)
+{
+    uint32_t *pnts;
+    int *cnts, i, last, cur_cnt, total, pnt_num;
+
     pnts = srngs->pnts;
     cnts = srngs->cnts;
     cur_cnt = total = 0;
@@ -525,6 +1010,294 @@ int shadow_rules(struct shadow_range *srngs, int64_t *spnts,
     srngs->pnt_num  = pnt_num;
     srngs->total = total;
 
+    return;
+}
+
+static int f_scan_open(struct text_scan *p_scan, const char *s_file)
+{
+    int fd;
+    struct stat st;
+
+    fd = open(s_file, O_RDONLY);
+    if (fd == -1) {
+        return -errno;
+    }
+
+    if (fstat(fd, &st)) {
+        close(fd);
+        return -errno;
+    }
+
+    p_scan->size = st.st_size;
+    p_scan->p_map = NULL;
+    if (p_scan->size) {
+        p_scan->p_map = mmap(NULL, p_scan->size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE, fd, 0);
+        if (p_scan->p_map == MAP_FAILED) {
+            close(fd);
+            return -errno;
+        }
+
+        madvise(p_scan->p_map, p_scan->size, MADV_SEQUENTIAL);
+    }
+
+    close(fd);
+    p_scan->cur = p_scan->p_map;
+    p_scan->end = p_scan->cur + p_scan->size;
+
     return 0;
 }
 
+static void f_scan_close(struct text_scan *p_scan)
+{
+    if (p_scan->p_map) {
+        munmap(p_scan->p_map, p_scan->size);
+    }
+}
+
+static inline void f_scan_space(struct text_scan *p_scan)
+{
+    while (p_scan->cur < p_scan->end && (*p_scan->cur == ' ' ||
+        (*p_scan->cur >= '\t' && *p_scan->cur <= '\r'))) {
+        p_scan->cur++;
+    }
+}
+
+/* Skip the white spaces after a record, true if another record follows */
+static int f_scan_more(struct text_scan *p_scan)
+{
+    f_scan_space(p_scan);
+
+    return p_scan->cur < p_scan->end;
+}
+
+/* The separators may be surrounded by white spaces */
+static int f_scan_char(struct text_scan *p_scan, char c)
+{
+    f_scan_space(p_scan);
+    if (p_scan->cur == p_scan->end || *p_scan->cur != c) {
+        return -EINVAL;
+    }
+
+    p_scan->cur++;
+
+    return 0;
+}
+
+static int f_scan_u32(struct text_scan *p_scan, uint32_t *p_value)
+{
+    const char *begin;
+    uint64_t value = 0;
+
+    f_scan_space(p_scan);
+    for (begin = p_scan->cur; p_scan->cur < p_scan->end &&
+        *p_scan->cur >= '0' && *p_scan->cur <= '9'; p_scan->cur++) {
+        value = value * 10 + (*p_scan->cur - '0');
+        if (value > UINT32_MAX) {
+            return -ERANGE;
+        }
+    }
+
+    if (p_scan->cur == begin) {
+        return -EINVAL;
+    }
+
+    *p_value = value;
+
+    return 0;
+}
+
+static int f_scan_x32(struct text_scan *p_scan, uint32_t *p_value)
+{
+    int digit;
+    const char *begin;
+    uint64_t value = 0;
+
+    f_scan_space(p_scan);
+    if (p_scan->end - p_scan->cur > 2 && p_scan->cur[0] == '0' &&
+        (p_scan->cur[1] == 'x' || p_scan->cur[1] == 'X')) {
+        p_scan->cur += 2;
+    }
+
+    for (begin = p_scan->cur; p_scan->cur < p_scan->end; p_scan->cur++) {
+        if (*p_scan->cur >= '0' && *p_scan->cur <= '9') {
+            digit = *p_scan->cur - '0';
+        } else if (*p_scan->cur >= 'a' && *p_scan->cur <= 'f') {
+            digit = *p_scan->cur - 'a' + 10;
+        } else if (*p_scan->cur >= 'A' && *p_scan->cur <= 'F') {
+            digit = *p_scan->cur - 'A' + 10;
+        } else {
+            break;
+        }
+
+        value = (value << 4) | digit;
+        if (value > UINT32_MAX) {
+            return -ERANGE;
+        }
+    }
+
+    if (p_scan->cur == begin) {
+        return -EINVAL;
+    }
+
+    *p_value = value;
+
+    return 0;
+}
+
+static int f_scan_d32(struct text_scan *p_scan, int32_t *p_value)
+{
+    int neg = 0;
+    uint32_t value;
+
+    f_scan_space(p_scan);
+    if (p_scan->cur < p_scan->end &&
+        (*p_scan->cur == '-' || *p_scan->cur == '+')) {
+        neg = *p_scan->cur++ == '-';
+    }
+
+    /* no white space is allowed after the sign */
+    if (p_scan->cur == p_scan->end || *p_scan->cur < '0' ||
+        *p_scan->cur > '9' || f_scan_u32(p_scan, &value) ||
+        value > (uint32_t)INT32_MAX + neg) {
+        return -EINVAL;
+    }
+
+    *p_value = neg ? -(int64_t)value : (int64_t)value;
+
+    return 0;
+}
+
+/* "a.b.c.d/mask" into the host order address and the mask length */
+static int f_scan_ip(struct text_scan *p_scan, uint32_t *p_ip,
+        uint32_t *p_mask)
+{
+    int i;
+    uint32_t byte;
+
+    for (*p_ip = i = 0; i < 4; i++) {
+        if ((i && f_scan_char(p_scan, '.')) || f_scan_u32(p_scan, &byte) ||
+            byte > UINT8_MAX) {
+            return -EINVAL;
+        }
+
+        *p_ip = (*p_ip << 8) | byte;
+    }
+
+    if (f_scan_char(p_scan, '/') || f_scan_u32(p_scan, p_mask) ||
+        *p_mask > 32) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* trace line: "sip dip sport dport proto match" */
+static int f_scan_packet(struct text_scan *p_scan, struct packet *p_pkt)
+{
+    if (f_scan_u32(p_scan, &p_pkt->dims[DIM_SIP]) ||
+        f_scan_u32(p_scan, &p_pkt->dims[DIM_DIP]) ||
+        f_scan_u32(p_scan, &p_pkt->dims[DIM_SPORT]) ||
+        f_scan_u32(p_scan, &p_pkt->dims[DIM_DPORT]) ||
+        f_scan_u32(p_scan, &p_pkt->dims[DIM_PROTO]) ||
+        f_scan_d32(p_scan, &p_pkt->match_rule)) {
+        return -EINVAL;
+    }
+
+    p_pkt->match_rule--;
+
+    return 0;
+}
+
+/* Keep the mapping of a binary trace as the packet array */
+static int f_map_trace(struct trace *p_t, struct text_scan *p_scan)
+{
+    const struct trace_file_header *p_hdr = p_scan->p_map;
+
+    if (p_hdr->version != TRACE_FILE_VERSION ||
+        p_hdr->pkt_size != sizeof(struct packet) ||
+        p_hdr->pkt_num == 0 || p_hdr->pkt_num > INT_MAX ||
+        p_scan->size != sizeof(*p_hdr) +
+        (size_t)p_hdr->pkt_num * sizeof(struct packet) ||
+        __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__) {
+        fprintf(stderr, "Illegal binary trace format\n");
+        f_scan_close(p_scan);
+        return -ENOTSUP;
+    }
+
+    p_t->pkts = (struct packet *)(p_hdr + 1);
+    p_t->pkt_num = p_hdr->pkt_num;
+    p_t->p_map = p_scan->p_map;
+    p_t->map_size = p_scan->size;
+
+    fprintf(stderr, "%d packets loaded\n", p_t->pkt_num);
+
+    return 0;
+}
+
+/* Extract the IPv4 packets of a pcap or pcapng file */
+static int f_load_pcap(struct trace *p_t, struct text_scan *p_scan)
+{
+    struct pcap_parser pcap;
+    struct packet_vector pkts;
+    ssize_t n;
+    int is_pkt, ret;
+
+    pcap_init(&pcap);
+    VECTOR_INIT(&pkts);
+
+    while (p_scan->cur < p_scan->end) {
+        if (VECTOR_LEN(&pkts) >= INT_MAX) {
+            fprintf(stderr, "Too many packets\n");
+            ret = -ENOTSUP;
+            goto err;
+        }
+
+        if (VECTOR_FULL(&pkts) && VECTOR_EXTEND(packet_vector, &pkts,
+            VECTOR_LEN(&pkts) + 1)) {
+            perror("Cannot allocate memory for packets");
+            ret = -ENOMEM;
+            goto err;
+        }
+
+        n = pcap_parse(&pcap, p_scan->cur, p_scan->end - p_scan->cur,
+                VECTOR_ADDR(&pkts, VECTOR_LEN(&pkts)), &is_pkt);
+        if (n < 0) {
+            fprintf(stderr, "Illegal pcap format\n");
+            ret = -ENOTSUP;
+            goto err;
+
+        } else if (!n) {
+            /* a capture cut short keeps the records before */
+            fprintf(stderr, "Warning: pcap truncated, last %zu bytes "
+                    "ignored\n", (size_t)(p_scan->end - p_scan->cur));
+            break;
+        }
+
+        p_scan->cur += n;
+        VECTOR_LEN(&pkts) += is_pkt;
+    }
+
+    if (VECTOR_EMPTY(&pkts)) {
+        fprintf(stderr, "No IPv4 packet in pcap\n");
+        ret = -ENOTSUP;
+        goto err;
+    }
+
+    p_t->pkts = VECTOR_BASE(&pkts);
+    p_t->pkt_num = VECTOR_LEN(&pkts);
+    p_t->p_map = NULL;
+    p_t->map_size = 0;
+
+    f_scan_close(p_scan);
+    fprintf(stderr, "%d packets loaded, %"PRIu64" skipped\n",
+            p_t->pkt_num, pcap.skip_num);
+
+    return 0;
+
+err:
+    VECTOR_TERM(&pkts);
+    f_scan_close(p_scan);
+
+    return ret;
+}
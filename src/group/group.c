@@ -0,0 +1,54 @@
+/*
+ *     Filename: group.c
+ *  Description: Source file for the registry of grouping algorithms
+ *
+ *       Author: Xiang Wang (xiang.wang.s@gmail.com)
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "common/utils.h"
+#include "group/group.h"
+#include "group/rfg.h"
+
+
+/* A new algorithm is added here, and is selected by its name */
+static const struct grp_algo s_grp_algos[] = {
+    {
+        .name = "rfg",
+        .desc = "Replication Free Grouping",
+        .group = rf_group
+    }
+};
+
+
+const struct grp_algo *grp_find(const char *s_name)
+{
+    int i;
+
+    assert(s_name);
+
+    for (i = 0; i < (int)ARRAY_SIZE(s_grp_algos); i++) {
+        if (!strcmp(s_grp_algos[i].name, s_name)) {
+            return &s_grp_algos[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* The i-th algorithm registered, or NULL past the last one */
+const struct grp_algo *grp_get(int i)
+{
+    if (i < 0 || i >= (int)ARRAY_SIZE(s_grp_algos)) {
+        return NULL;
+    }
+
+    return &s_grp_algos[i];
+}
@@ -34,10 +34,11 @@ STAILQ_HEAD(rfg_queue_head, rfg_queue_entry);
 struct rfg_runtime {
     struct rfg_queue_head wqh;
     struct rfg_rng_rid *raws[DIM_MAX];
+    struct rfg_rng_rid *raw_buf; /* buffer of sorting raws */
     struct rfg_rng_idx *acks[DIM_MAX];
     struct rfg_rng_idx *rejs[DIM_MAX];
     const struct rule_set *p_rs;
-    struct rule_set *subsets;
+    struct rule_set_vector subsets;
     int *rule_ids[2]; /* first loop: 0 - ack, 1 - rej */
     int rule_nums[2];
     int cur;
@@ -78,8 +79,8 @@ int rf_group(struct partition *p_pa_grp, const struct partition *p_pa_orig)
     }
 
     /* Each loop forms a new group. */
-    for (rfg_rt.cur = 0; rfg_rt.rule_nums[rfg_rt.cur & 0x1] &&
-        rfg_rt.cur < PART_MAX; rfg_rt.cur++) {
+    for (rfg_rt.cur = 0; rfg_rt.rule_nums[rfg_rt.cur & 0x1];
+        rfg_rt.cur++) {
 
         /* trigger entry enqueue */
         ret = f_rfg_trigger(&rfg_rt);
@@ -100,22 +101,10 @@ int rf_group(struct partition *p_pa_grp, const struct partition *p_pa_orig)
         }
     }
 
-    if (rfg_rt.cur == PART_MAX) {
-        fprintf(stderr, "Final group number exceeds %d\n", PART_MAX);
-        ret = -ENOTSUP;
-        goto err;
-    }
-
     /* Write final result */
-    p_pa_grp->subsets = realloc(rfg_rt.subsets,
-            rfg_rt.cur * sizeof(*p_pa_grp->subsets));
-    if (!p_pa_grp->subsets) {
-        ret = -ENOMEM;
-        goto err;
-    }
-
-    rfg_rt.subsets = NULL;
-    p_pa_grp->subset_num = rfg_rt.cur;
+    p_pa_grp->subsets = VECTOR_BASE(&rfg_rt.subsets);
+    p_pa_grp->subset_num = VECTOR_LEN(&rfg_rt.subsets);
+    VECTOR_INIT(&rfg_rt.subsets);
     p_pa_grp->rule_num = p_pa_orig->rule_num;
 
     /* Term */
@@ -124,8 +113,10 @@ int rf_group(struct partition *p_pa_grp, const struct partition *p_pa_orig)
     return 0;
 
 err:
-    while (--rfg_rt.cur >= 0) {
-        unload_rules(&rfg_rt.subsets[rfg_rt.cur]);
+    while (!VECTOR_EMPTY(&rfg_rt.subsets)) {
+        VECTOR_LEN(&rfg_rt.subsets)--;
+        unload_rules(VECTOR_ADDR(&rfg_rt.subsets,
+                    VECTOR_LEN(&rfg_rt.subsets)));
     }
 
     f_rfg_term(&rfg_rt);
@@ -136,7 +127,6 @@ err:
 static int f_rfg_init(struct rfg_runtime *p_rfg_rt,
         const struct rule_set *p_rs)
 {
-    struct rule_set *subsets;
     int i, null_flag = 0, rule_num = p_rs->rule_num - 1;
     int **rule_ids = p_rfg_rt->rule_ids;
     struct rfg_rng_rid **raws = p_rfg_rt->raws;
@@ -159,9 +149,13 @@ static int f_rfg_init(struct rfg_runtime *p_rfg_rt,
         }
     }
 
-    subsets = malloc(PART_MAX * sizeof(*subsets));
-    if (null_flag && !subsets) {
-        free(subsets);
+    p_rfg_rt->raw_buf = malloc(rule_num * sizeof(*p_rfg_rt->raw_buf));
+    if (!p_rfg_rt->raw_buf) {
+        null_flag = 1;
+    }
+
+    if (null_flag) {
+        free(p_rfg_rt->raw_buf);
 
         for (i = 0; i < 2; i++) {
             free(rule_ids[i]);
@@ -182,7 +176,7 @@ static int f_rfg_init(struct rfg_runtime *p_rfg_rt,
 
     STAILQ_INIT(&p_rfg_rt->wqh);
     p_rfg_rt->p_rs = p_rs;
-    p_rfg_rt->subsets = subsets;
+    VECTOR_INIT(&p_rfg_rt->subsets);
     p_rfg_rt->rule_nums[0] = rule_num;
     p_rfg_rt->rule_nums[1] = 0;
 
@@ -201,7 +195,8 @@ static void f_rfg_term(struct rfg_runtime *p_rfg_rt)
         free(p_wqe);
     }
 
-    free(p_rfg_rt->subsets);
+    VECTOR_TERM(&p_rfg_rt->subsets);
+    free(p_rfg_rt->raw_buf);
 
     for (i = 0; i < 2; i++) {
         free(p_rfg_rt->rule_ids[i]);
@@ -283,7 +278,7 @@ static int f_rfg_process(struct rfg_runtime *p_rfg_rt)
                 raw[j].rule_id = rid;
             }
 
-            QSORT(rng_rid, raw, p_wqe->rule_num);
+            SORT(rng_rid, raw, p_rfg_rt->raw_buf, p_wqe->rule_num);
 
             /* generate non-overlapping ranges of small sizes */
             measure = f_rfg_gen_minrng(&j, &k, p_rfg_rt->rejs[i],
@@ -322,7 +317,7 @@ static int f_rfg_gather(struct rfg_runtime *p_rfg_rt)
     int *rule_id = p_rfg_rt->rule_ids[cur];
     int rule_num = p_rfg_rt->rule_nums[cur];
     const struct rule_set *p_rs = p_rfg_rt->p_rs;
-    struct rule_set *p_srs = &p_rfg_rt->subsets[p_rfg_rt->cur];
+    struct rule_set srs;
     struct rule *rules = malloc((rule_num + 1) * sizeof(*rules));
     if (!rules) {
         return -ENOMEM;
@@ -337,9 +332,14 @@ static int f_rfg_gather(struct rfg_runtime *p_rfg_rt)
     rules[rule_num++] = p_rs->rules[p_rs->def_rule];
     p_rfg_rt->rule_nums[cur] = 0;
 
-    p_srs->rules = rules;
-    p_srs->rule_num = rule_num;
-    p_srs->def_rule = p_rs->def_rule;
+    srs.rules = rules;
+    srs.rule_num = rule_num;
+    srs.def_rule = p_rs->def_rule;
+
+    if (VECTOR_PUSH(rule_set_vector, &p_rfg_rt->subsets, srs)) {
+        free(rules);
+        return -ENOMEM;
+    }
 
     return 0;
 }
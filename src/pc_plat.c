@@ -9,6 +9,8 @@
  *               Tsinghua University (THU)
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,12 +21,23 @@
 #include <errno.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 
+#include "common/impl.h"
 #include "common/rule_trace.h"
-#include "clsfy/hypersplit.h"
-#include "group/rfg.h"
+#include "common/rule_gen.h"
+#include "common/flow_cache.h"
+#include "clsfy/clsfy.h"
+#include "group/group.h"
 
 #define GRP_FILE "group_result.txt"
+#define THREAD_MAX 256
+#define STREAM_CHUNK_SIZE 4096 /* packets per chunk */
+#define STREAM_RING_SIZE 64 /* chunks in flight, a power of 2 */
+#define GEN_RULE_NUM 10000
+#define GEN_TRACE_SCALE 10 /* packets per generated rule */
 
 
 enum {
@@ -35,61 +48,202 @@ enum {
 };
 
 enum {
-    PC_ALGO_INV = -1,
-    PC_ALGO_HYPERSPLIT = 0,
-    PC_ALGO_MAX = 1
-};
-
-enum {
-    GRP_ALGO_INV = -1,
-    GRP_ALGO_RFG = 0,
-    GRP_ALGO_MAX = 1
+    SEARCH_SCALAR = 0,
+    SEARCH_BATCH = 1, /* packets in lockstep */
+    SEARCH_SIMD = 2 /* trees in vector lanes */
 };
 
 
 struct platform_config {
     char *s_rule_file;
     char *s_trace_file;
+    char *s_save_file;
+    char *s_load_file;
+    char *s_convert_file;
+    char *s_gen_file;
+    uint64_t gen_seed;
+    int gen_profile;
+    int gen_rule_num;
+    int gen_pkt_num;
+    size_t cache_size; /* flow cache entries of each thread, 0 for none */
+    int cache_evict;
     int rule_fmt;
-    int pc_algo;
-    int grp_algo;
+    const struct clsfy_algo *p_ca; /* NULL if not in pc mode */
+    const struct grp_algo *p_ga; /* NULL if not in grp mode */
+    int search;
+    int binth; /* most rules of a leaf bucket, 0 for none */
+    int is_packed;
+    int is_dag;
+    int is_stream;
+    int is_verify;
+    int update_pct; /* of the rules deleted and inserted again, 0 for none */
+    int thread_num;
+};
+
+struct search_worker {
+    pthread_t tid;
+    pthread_barrier_t *p_barrier;
+    const struct platform_config *p_plat_cfg;
+    const void *built_result;
+    struct trace t;
+    struct flow_cache fc;
+    uint64_t timediff;
+    int cpu;
+    int ret;
+};
+
+/* Chunks cycle from the reader to the searchers through full, and back
+ * through empty; both rings are guarded by lock */
+struct search_stream {
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t drained;
+    struct trace_ring full;
+    struct trace_ring empty;
+    struct trace full_buf[STREAM_RING_SIZE];
+    struct trace empty_buf[STREAM_RING_SIZE];
+    int is_eof;
+    int ret;
+};
+
+struct stream_worker {
+    pthread_t tid;
+    struct search_stream *p_stream;
+    const struct platform_config *p_plat_cfg;
+    const void *built_result;
+    struct flow_cache fc;
+    uint64_t pkt_num;
+    uint64_t timediff; /* time spent searching */
+    int cpu;
 };
 
 
 static void f_print_help(void);
 static void f_parse_args(struct platform_config *p_plat_cfg,
         int argc, char *argv[]);
+static int f_check_algo(const struct platform_config *p_plat_cfg);
 static uint64_t f_make_timediff(const struct timespec stop,
         const struct timespec start);
 
-static int f_build(int pc_algo, void *built_result,
+static int f_generate(const struct platform_config *p_plat_cfg);
+static int f_build(const struct platform_config *p_plat_cfg,
+        void *built_result, const struct partition *p_pa);
+static int f_save(const struct clsfy_algo *p_ca, const void *built_result,
+        const char *s_file);
+static int f_load(const struct clsfy_algo *p_ca, void *built_result,
+        const char *s_file);
+static int f_update(const struct platform_config *p_plat_cfg,
+        void *built_result, const struct partition *p_pa,
+        uint64_t *p_update_num);
+static int f_group(const struct grp_algo *p_ga, struct partition *p_pa_grp,
         const struct partition *p_pa);
-static int f_group(int grp_algo, struct partition *p_pa_grp,
+static int f_search(const struct clsfy_algo *p_ca, int search,
+        const struct trace *p_t, const void *built_result,
+        struct flow_cache *p_fc);
+static void f_destroy(const struct clsfy_algo *p_ca, void *built_result);
+
+static int f_search_mt(const struct platform_config *p_plat_cfg,
+        const struct trace *p_t, const void *built_result);
+static void *f_search_worker(void *arg);
+static void f_print_cache(uint64_t hit_num, uint64_t miss_num,
+        uint64_t evict_num);
+
+static int f_search_stream(const struct platform_config *p_plat_cfg,
+        uint64_t *p_pkt_num, const void *built_result,
         const struct partition *p_pa);
-static int f_search(int pc_algo, const struct trace *p_t,
-        const void *built_result);
-static void f_destroy(int pc_algo, void *built_result);
+static void *f_stream_worker(void *arg);
 
 
 int main(int argc, char *argv[])
 {
     struct timespec starttime, stoptime;
-    uint64_t timediff;
+    uint64_t timediff, pkt_num = 0;
+    int simd_lanes;
 
     struct partition pa, pa_grp;
+    struct flow_cache fc;
     struct trace t;
     void *result = NULL;
 
     struct platform_config plat_cfg = {
         .s_rule_file = NULL,
         .s_trace_file = NULL,
+        .s_save_file = NULL,
+        .s_load_file = NULL,
+        .s_convert_file = NULL,
+        .s_gen_file = NULL,
+        .gen_seed = 1,
+        .gen_profile = GEN_PROFILE_INV,
+        .gen_rule_num = GEN_RULE_NUM,
+        .gen_pkt_num = 0,
+        .cache_size = 0,
+        .cache_evict = FLOW_EVICT_CLOCK,
         .rule_fmt = RULE_FMT_INV,
-        .pc_algo = PC_ALGO_INV,
-        .grp_algo = GRP_ALGO_INV
+        .p_ca = NULL,
+        .p_ga = NULL,
+        .search = SEARCH_SCALAR,
+        .binth = 0,
+        .is_packed = 0,
+        .is_dag = 0,
+        .is_stream = 0,
+        .is_verify = 0,
+        .thread_num = 1
     };
 
     f_parse_args(&plat_cfg, argc, argv);
 
+    /*
+     * Generating rules and trace: no building and no searching
+     */
+    if (plat_cfg.s_gen_file) {
+        if (f_generate(&plat_cfg)) {
+            fprintf(stderr, "Generating fail\n");
+            exit(-1);
+        }
+
+        fprintf(stderr, "Generating pass\n");
+
+        return 0;
+    }
+
+    /*
+     * Converting trace: no rules and no searching
+     */
+    if (plat_cfg.s_convert_file) {
+        if (load_trace(&t, plat_cfg.s_trace_file) ||
+            dump_trace(plat_cfg.s_convert_file, &t)) {
+            fprintf(stderr, "Converting fail\n");
+            exit(-1);
+        }
+
+        fprintf(stderr, "Converting pass\n");
+        unload_trace(&t);
+
+        return 0;
+    }
+
+    /*
+     * Loading built classifier: no rules and no building
+     */
+    if (plat_cfg.s_load_file) {
+        clock_gettime(CLOCK_MONOTONIC, &starttime);
+
+        if (f_load(plat_cfg.p_ca, &result, plat_cfg.s_load_file)) {
+            fprintf(stderr, "Loading fail\n");
+            exit(-1);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &stoptime);
+
+        fprintf(stderr, "Loading pass\n");
+        fprintf(stderr, "Time for loading: %"PRIu64"(us)\n",
+                f_make_timediff(stoptime, starttime));
+        fprintf(stderr, "Memory for classifier: %zu(bytes)\n",
+                plat_cfg.p_ca->memory(&result));
+
+        goto search;
+    }
+
     /*
      * Loading classifier
      */
@@ -112,7 +266,7 @@ int main(int argc, char *argv[])
             exit(-1);
         }
 
-        if (plat_cfg.grp_algo != GRP_ALGO_INV) {
+        if (plat_cfg.p_ga) {
             struct rule_set *p_rs = calloc(1, sizeof(*p_rs));
             if (!p_rs) {
                 perror("Cannot allocate memory for subsets");
@@ -134,13 +288,13 @@ int main(int argc, char *argv[])
     /*
      * Grouping
      */
-    if (plat_cfg.grp_algo != GRP_ALGO_INV) {
+    if (plat_cfg.p_ga) {
         fprintf(stderr, "Grouping\n");
 
         clock_gettime(CLOCK_MONOTONIC, &starttime);
 
         assert(pa.subset_num == 1);
-        if (f_group(plat_cfg.grp_algo, &pa_grp, &pa)) {
+        if (f_group(plat_cfg.p_ga, &pa_grp, &pa)) {
             fprintf(stderr, "Grouping fail\n");
             exit(-1);
         }
@@ -166,7 +320,7 @@ int main(int argc, char *argv[])
 
     clock_gettime(CLOCK_MONOTONIC, &starttime);
 
-    if (f_build(plat_cfg.pc_algo, &result, &pa)) {
+    if (f_build(&plat_cfg, &result, &pa)) {
         fprintf(stderr, "Building fail\n");
         exit(-1);
     }
@@ -176,17 +330,78 @@ int main(int argc, char *argv[])
     fprintf(stderr, "Building pass\n");
     fprintf(stderr, "Time for building: %"PRIu64"(us)\n",
             f_make_timediff(stoptime, starttime));
+    fprintf(stderr, "Memory for classifier: %zu(bytes)\n",
+            plat_cfg.p_ca->memory(&result));
 
-    unload_partition(&pa);
+    /*
+     * Updating: the search after checks the classifier is as built
+     */
+    if (plat_cfg.update_pct) {
+        uint64_t update_num = 0;
+
+        fprintf(stderr, "Updating\n");
+
+        clock_gettime(CLOCK_MONOTONIC, &starttime);
+
+        if (f_update(&plat_cfg, &result, &pa, &update_num)) {
+            fprintf(stderr, "Updating fail\n");
+            exit(-1);
+        }
 
+        clock_gettime(CLOCK_MONOTONIC, &stoptime);
+        timediff = f_make_timediff(stoptime, starttime);
+
+        fprintf(stderr, "Updating pass\n");
+        fprintf(stderr, "Time for updating: %"PRIu64"(us)\n", timediff);
+        fprintf(stderr, "Updating speed: %"PRIu64"(ups)\n",
+                (update_num * 1000000) / (timediff ? timediff : 1));
+    }
+
+    /* the rules are kept to label the trace */
+    if (!plat_cfg.is_verify) {
+        unload_partition(&pa);
+    }
+
+    if (plat_cfg.s_save_file &&
+        f_save(plat_cfg.p_ca, &result, plat_cfg.s_save_file)) {
+        fprintf(stderr, "Saving fail\n");
+        exit(-1);
+    }
+
+search:
     if (!plat_cfg.s_trace_file) {
-        f_destroy(plat_cfg.pc_algo, &result);
+        f_destroy(plat_cfg.p_ca, &result);
         return 0;
 
-    } else if (load_trace(&t, plat_cfg.s_trace_file)) {
+    } else if (!plat_cfg.is_stream) {
+        if (load_trace(&t, plat_cfg.s_trace_file)) {
+            exit(-1);
+        }
+
+        pkt_num = t.pkt_num;
+
+        if (plat_cfg.is_verify) {
+            label_trace(&t, &pa);
+        }
+    }
+
+    /* threads of -n and -S have caches of their own */
+    if (plat_cfg.cache_size && !plat_cfg.is_stream &&
+        plat_cfg.thread_num == 1 &&
+        flow_cache_init(&fc, plat_cfg.cache_size, plat_cfg.cache_evict)) {
         exit(-1);
     }
 
+    /* the vector width is up to the CPU, which may have none */
+    if (plat_cfg.search == SEARCH_SIMD) {
+        simd_lanes = plat_cfg.p_ca->simd_lanes(&result);
+        if (simd_lanes > 0) {
+            fprintf(stderr, "Walking %d trees at once\n", simd_lanes);
+        } else {
+            fprintf(stderr, "Walking trees one by one: no SIMD support\n");
+        }
+    }
+
     /*
      * Searching
      */
@@ -194,7 +409,21 @@ int main(int argc, char *argv[])
 
     clock_gettime(CLOCK_MONOTONIC, &starttime);
 
-    if (f_search(plat_cfg.pc_algo, &t, &result)) {
+    if (plat_cfg.is_stream) {
+        if (f_search_stream(&plat_cfg, &pkt_num, &result,
+            plat_cfg.is_verify ? &pa : NULL)) {
+            fprintf(stderr, "Searching fail\n");
+            exit(-1);
+        }
+
+    } else if (plat_cfg.thread_num > 1) {
+        if (f_search_mt(&plat_cfg, &t, &result)) {
+            fprintf(stderr, "Searching fail\n");
+            exit(-1);
+        }
+
+    } else if (f_search(plat_cfg.p_ca, plat_cfg.search, &t, &result,
+        plat_cfg.cache_size ? &fc : NULL)) {
         fprintf(stderr, "Searching fail\n");
         exit(-1);
     }
@@ -204,11 +433,24 @@ int main(int argc, char *argv[])
 
     fprintf(stderr, "Searching pass\n");
     fprintf(stderr, "Time for searching: %"PRIu64"(us)\n", timediff);
-    fprintf(stderr, "Searching speed: %lld(pps)\n",
-            (t.pkt_num * 1000000ULL) / timediff);
+    fprintf(stderr, "Searching speed: %"PRIu64"(pps)\n",
+            (pkt_num * 1000000) / (timediff ? timediff : 1));
 
-    unload_trace(&t);
-    f_destroy(plat_cfg.pc_algo, &result);
+    if (plat_cfg.cache_size && !plat_cfg.is_stream &&
+        plat_cfg.thread_num == 1) {
+        f_print_cache(fc.hit_num, fc.miss_num, fc.evict_num);
+        flow_cache_term(&fc);
+    }
+
+    if (!plat_cfg.is_stream) {
+        unload_trace(&t);
+    }
+
+    if (plat_cfg.is_verify) {
+        unload_partition(&pa);
+    }
+
+    f_destroy(plat_cfg.p_ca, &result);
 
     return 0;
 }
@@ -222,14 +464,55 @@ static void f_print_help(void)
         "  -r, --rule FILE  specify a rule file for building\n"
         "  -f, --format FORMAT  specify a rule file format: [wustl, wustl_g]\n"
         "  -t, --trace FILE  specify a trace file for searching\n"
+        "  -s, --save FILE  save the built classifier to FILE\n"
+        "  -c, --classifier FILE  load a saved classifier instead of building\n"
+        "  -w, --write FILE  convert the trace into the binary format in FILE\n"
+        "\n"
+        "  -G, --gen PROFILE  generate rules like PROFILE: [acl, fw, ipc], "
+        "or like the wustl rules of -r\n"
+        "  -o, --output FILE  write generated rules to FILE and the trace "
+        "to FILE_trace\n"
+        "  -N, --rule-num NUM  generate NUM rules (default %d)\n"
+        "  -P, --pkt-num NUM  generate NUM packets (default %d per rule)\n"
+        "  -e, --seed SEED  seed the generator with SEED (default 1)\n"
         "\n"
-        "  -p, --pc ALGO  specify a pc algorithm: [hs]\n"
-        "  -g, --grp ALGO  specify a grp algorithm: [rfg]\n"
+        "  -p, --pc ALGO  specify a pc algorithm, listed below\n"
+        "  -l, --layout LAYOUT  specify a tree layout: [binary, packed]\n"
+        "  -B, --binth NUM  stop splitting at NUM rules, which are searched "
+        "linearly\n"
+        "  -D, --dag  share identical subtrees and buckets of each tree\n"
+        "  -b, --batch  search packets in batches with prefetching\n"
+        "  -x, --simd  walk several trees at once with AVX2 or AVX-512\n"
+        "  -v, --verify  check matches against a linear scan of the rules\n"
+        "  -u, --update PERCENT  delete PERCENT of the rules and insert them "
+        "again before searching\n"
+        "  -S, --stream  stream the trace through a reader thread instead "
+        "of loading it\n"
+        "  -C, --cache NUM  look packets up in a flow cache of NUM entries "
+        "per thread first\n"
+        "  -E, --evict POLICY  specify a flow cache eviction: [clock, lru]\n"
+        "  -n, --threads NUM  build and search with NUM threads\n"
+        "  -g, --grp ALGO  specify a grp algorithm, listed below\n"
         "\n"
         "  -h, --help  display this help and exit\n"
         "\n";
+    const struct clsfy_algo *p_ca;
+    const struct grp_algo *p_ga;
+    int i;
+
+    fprintf(stdout, s_help, GEN_RULE_NUM, GEN_TRACE_SCALE);
 
-    fprintf(stdout, "%s", s_help);
+    fprintf(stdout, "pc algorithms:\n");
+    for (i = 0; (p_ca = clsfy_get(i)); i++) {
+        fprintf(stdout, "  %-8s %s\n", p_ca->name, p_ca->desc);
+    }
+
+    fprintf(stdout, "\ngrp algorithms:\n");
+    for (i = 0; (p_ga = grp_get(i)); i++) {
+        fprintf(stdout, "  %-8s %s\n", p_ga->name, p_ga->desc);
+    }
+
+    fprintf(stdout, "\n");
 
     return;
 }
@@ -238,13 +521,32 @@ static void f_parse_args(struct platform_config *p_plat_cfg,
         int argc, char *argv[])
 {
     int option;
-    const char *s_opts = "r:f:t:p:g:h";
+    const char *s_opts = "r:f:t:s:c:w:G:o:N:P:e:p:g:l:B:Dbxvu:SC:E:n:h";
     const struct option opts[] = {
         {"rule", required_argument, NULL, 'r'},
         {"format", required_argument, NULL, 'f'},
         {"trace", required_argument, NULL, 't'},
+        {"save", required_argument, NULL, 's'},
+        {"classifier", required_argument, NULL, 'c'},
+        {"write", required_argument, NULL, 'w'},
+        {"gen", required_argument, NULL, 'G'},
+        {"output", required_argument, NULL, 'o'},
+        {"rule-num", required_argument, NULL, 'N'},
+        {"pkt-num", required_argument, NULL, 'P'},
+        {"seed", required_argument, NULL, 'e'},
         {"pc", required_argument, NULL, 'p'},
         {"grp", required_argument, NULL, 'g'},
+        {"layout", required_argument, NULL, 'l'},
+        {"binth", required_argument, NULL, 'B'},
+        {"dag", no_argument, NULL, 'D'},
+        {"batch", no_argument, NULL, 'b'},
+        {"simd", no_argument, NULL, 'x'},
+        {"verify", no_argument, NULL, 'v'},
+        {"update", required_argument, NULL, 'u'},
+        {"stream", no_argument, NULL, 'S'},
+        {"cache", required_argument, NULL, 'C'},
+        {"evict", required_argument, NULL, 'E'},
+        {"threads", required_argument, NULL, 'n'},
         {"help", no_argument, NULL, 'h'},
         {NULL, 0, NULL, 0}
     };
@@ -260,6 +562,7 @@ static void f_parse_args(struct platform_config *p_plat_cfg,
         switch (option) {
         case 'r':
         case 't':
+        case 'c':
             if (access(optarg, F_OK) == -1) {
                 perror(optarg);
                 exit(-1);
@@ -270,10 +573,60 @@ static void f_parse_args(struct platform_config *p_plat_cfg,
 
             } else if (option == 't') {
                 p_plat_cfg->s_trace_file = optarg;
+
+            } else if (option == 'c') {
+                p_plat_cfg->s_load_file = optarg;
+            }
+
+            break;
+
+        case 's':
+            p_plat_cfg->s_save_file = optarg;
+            break;
+
+        case 'w':
+            p_plat_cfg->s_convert_file = optarg;
+            break;
+
+        case 'G':
+            if (!strcmp(optarg, "acl")) {
+                p_plat_cfg->gen_profile = GEN_PROFILE_ACL;
+
+            } else if (!strcmp(optarg, "fw")) {
+                p_plat_cfg->gen_profile = GEN_PROFILE_FW;
+
+            } else if (!strcmp(optarg, "ipc")) {
+                p_plat_cfg->gen_profile = GEN_PROFILE_IPC;
             }
 
             break;
 
+        case 'o':
+            p_plat_cfg->s_gen_file = optarg;
+            break;
+
+        case 'N':
+            p_plat_cfg->gen_rule_num = atoi(optarg);
+            if (p_plat_cfg->gen_rule_num < 2) {
+                fprintf(stderr, "Rule number must be at least 2\n");
+                exit(-1);
+            }
+
+            break;
+
+        case 'P':
+            p_plat_cfg->gen_pkt_num = atoi(optarg);
+            if (p_plat_cfg->gen_pkt_num < 1) {
+                fprintf(stderr, "Packet number must be at least 1\n");
+                exit(-1);
+            }
+
+            break;
+
+        case 'e':
+            p_plat_cfg->gen_seed = strtoull(optarg, NULL, 0);
+            break;
+
         case 'f':
             if (!strcmp(optarg, "wustl")) {
                 p_plat_cfg->rule_fmt = RULE_FMT_WUSTL;
@@ -285,15 +638,97 @@ static void f_parse_args(struct platform_config *p_plat_cfg,
             break;
 
         case 'p':
-            if (!strcmp(optarg, "hs")) {
-                p_plat_cfg->pc_algo = PC_ALGO_HYPERSPLIT;
+            p_plat_cfg->p_ca = clsfy_find(optarg);
+            if (!p_plat_cfg->p_ca) {
+                fprintf(stderr, "Unknown pc algorithm: %s\n", optarg);
+                exit(-1);
             }
 
             break;
 
         case 'g':
-            if (!strcmp(optarg, "rfg")) {
-                p_plat_cfg->grp_algo = GRP_ALGO_RFG;
+            p_plat_cfg->p_ga = grp_find(optarg);
+            if (!p_plat_cfg->p_ga) {
+                fprintf(stderr, "Unknown grp algorithm: %s\n", optarg);
+                exit(-1);
+            }
+
+            break;
+
+        case 'l':
+            if (!strcmp(optarg, "binary")) {
+                p_plat_cfg->is_packed = 0;
+
+            } else if (!strcmp(optarg, "packed")) {
+                p_plat_cfg->is_packed = 1;
+            }
+
+            break;
+
+        case 'B':
+            p_plat_cfg->binth = atoi(optarg);
+            if (p_plat_cfg->binth < 1) {
+                fprintf(stderr, "Bucket size must be at least 1\n");
+                exit(-1);
+            }
+
+            break;
+
+        case 'D':
+            p_plat_cfg->is_dag = 1;
+            break;
+
+        case 'b':
+            p_plat_cfg->search = SEARCH_BATCH;
+            break;
+
+        case 'x':
+            p_plat_cfg->search = SEARCH_SIMD;
+            break;
+
+        case 'v':
+            p_plat_cfg->is_verify = 1;
+            break;
+
+        case 'u':
+            p_plat_cfg->update_pct = atoi(optarg);
+            if (p_plat_cfg->update_pct < 1 || p_plat_cfg->update_pct > 100) {
+                fprintf(stderr, "Update percent must be in [1, 100]\n");
+                exit(-1);
+            }
+
+            break;
+
+        case 'S':
+            p_plat_cfg->is_stream = 1;
+            break;
+
+        case 'C':
+            if (atol(optarg) < 1) {
+                fprintf(stderr, "Cache size must be at least 1\n");
+                exit(-1);
+            }
+
+            p_plat_cfg->cache_size = atol(optarg);
+            break;
+
+        case 'E':
+            if (!strcmp(optarg, "clock")) {
+                p_plat_cfg->cache_evict = FLOW_EVICT_CLOCK;
+
+            } else if (!strcmp(optarg, "lru")) {
+                p_plat_cfg->cache_evict = FLOW_EVICT_LRU;
+            }
+
+            break;
+
+        case 'n':
+            p_plat_cfg->thread_num = atoi(optarg);
+            if (p_plat_cfg->thread_num < 1 ||
+                p_plat_cfg->thread_num > THREAD_MAX) {
+                fprintf(stderr, "Thread number must be in [1, %d]\n",
+                        THREAD_MAX);
+                exit(-1);
             }
 
             break;
@@ -308,6 +743,97 @@ static void f_parse_args(struct platform_config *p_plat_cfg,
         }
     }
 
+    if (p_plat_cfg->p_ca && !f_check_algo(p_plat_cfg)) {
+        exit(-1);
+    }
+
+    if (p_plat_cfg->is_dag && p_plat_cfg->is_packed) {
+        fprintf(stderr, "Cannot share subtrees in the packed layout\n");
+        exit(-1);
+    }
+
+    if (p_plat_cfg->search == SEARCH_SIMD && p_plat_cfg->cache_size) {
+        fprintf(stderr, "Cannot walk the flow cache misses with SIMD\n");
+        exit(-1);
+    }
+
+    if (p_plat_cfg->s_gen_file) {
+        if (p_plat_cfg->s_trace_file || p_plat_cfg->s_load_file ||
+            p_plat_cfg->s_save_file || p_plat_cfg->s_convert_file ||
+            p_plat_cfg->p_ca ||
+            p_plat_cfg->p_ga) {
+            fprintf(stderr, "Cannot build or search when generating\n");
+            exit(-1);
+        }
+
+        if (p_plat_cfg->s_rule_file) {
+            if (p_plat_cfg->gen_profile != GEN_PROFILE_INV) {
+                fprintf(stderr, "Cannot generate like both a profile and "
+                        "the rules\n");
+                exit(-1);
+            }
+
+            if (p_plat_cfg->rule_fmt != RULE_FMT_WUSTL) {
+                fprintf(stderr, "Can only generate like wustl rules\n");
+                exit(-1);
+            }
+
+        } else if (p_plat_cfg->gen_profile == GEN_PROFILE_INV) {
+            fprintf(stderr, "Not specify the generator profile\n");
+            exit(-1);
+        }
+
+        fprintf(stderr, "Run in gen mode\n");
+        return;
+
+    } else if (p_plat_cfg->gen_profile != GEN_PROFILE_INV) {
+        fprintf(stderr, "Not specify the output file to generate\n");
+        exit(-1);
+    }
+
+    if (p_plat_cfg->s_convert_file) {
+        if (!p_plat_cfg->s_trace_file) {
+            fprintf(stderr, "Not specify the trace file\n");
+            exit(-1);
+        }
+
+        if (p_plat_cfg->s_rule_file || p_plat_cfg->s_load_file ||
+            p_plat_cfg->p_ca ||
+            p_plat_cfg->p_ga) {
+            fprintf(stderr, "Cannot build or search when converting\n");
+            exit(-1);
+        }
+
+        fprintf(stderr, "Run in convert mode\n");
+        return;
+    }
+
+    if (p_plat_cfg->s_load_file) {
+        if (!p_plat_cfg->p_ca ||
+            p_plat_cfg->p_ga) {
+            fprintf(stderr, "Can only load a classifier in pc mode\n");
+            exit(-1);
+        }
+
+        if (p_plat_cfg->s_rule_file || p_plat_cfg->s_save_file) {
+            fprintf(stderr, "Cannot build when loading a classifier\n");
+            exit(-1);
+        }
+
+        if (p_plat_cfg->is_verify) {
+            fprintf(stderr, "Cannot verify without the rules\n");
+            exit(-1);
+        }
+
+        if (p_plat_cfg->update_pct) {
+            fprintf(stderr, "Cannot update without the rules\n");
+            exit(-1);
+        }
+
+        fprintf(stderr, "Run in pc mode\n");
+        return;
+    }
+
     if (!p_plat_cfg->s_rule_file) {
         fprintf(stderr, "Not specify the rule file\n");
         exit(-1);
@@ -318,15 +844,20 @@ static void f_parse_args(struct platform_config *p_plat_cfg,
         exit(-1);
     }
 
-    if (p_plat_cfg->pc_algo != PC_ALGO_INV &&
-        p_plat_cfg->grp_algo != GRP_ALGO_INV) {
+    if (p_plat_cfg->p_ca &&
+        p_plat_cfg->p_ga) {
         fprintf(stderr, "Cannot run in hybrid mode [pc & grp]\n");
         exit(-1);
 
-    } else if (p_plat_cfg->pc_algo != PC_ALGO_INV) {
+    } else if (p_plat_cfg->p_ca) {
+        if (p_plat_cfg->is_verify && !p_plat_cfg->s_trace_file) {
+            fprintf(stderr, "Not specify the trace file to verify\n");
+            exit(-1);
+        }
+
         fprintf(stderr, "Run in pc mode\n");
 
-    } else if (p_plat_cfg->grp_algo != GRP_ALGO_INV) {
+    } else if (p_plat_cfg->p_ga) {
         fprintf(stderr, "Run in grp mode\n");
 
     } else {
@@ -337,6 +868,60 @@ static void f_parse_args(struct platform_config *p_plat_cfg,
     return;
 }
 
+/* Whether the pc algorithm has the operations and options asked for */
+static int f_check_algo(const struct platform_config *p_plat_cfg)
+{
+    const struct clsfy_algo *p_ca = p_plat_cfg->p_ca;
+    const char *s_op = NULL;
+
+    if (p_plat_cfg->binth && !(p_ca->opts & CLSFY_OPT_BINTH)) {
+        s_op = "leaf buckets";
+
+    } else if (p_plat_cfg->is_dag && !(p_ca->opts & CLSFY_OPT_DAG)) {
+        s_op = "shared subtrees";
+
+    } else if (p_plat_cfg->is_packed && !(p_ca->opts & CLSFY_OPT_PACKED)) {
+        s_op = "the packed layout";
+
+    } else if (p_plat_cfg->thread_num > 1 &&
+        !(p_ca->opts & CLSFY_OPT_THREAD) && !p_plat_cfg->s_trace_file) {
+        s_op = "building with threads";
+
+    } else if (p_plat_cfg->cache_size && !p_ca->search_cache) {
+        s_op = "flow cache";
+
+    } else if (p_plat_cfg->search == SEARCH_BATCH && !p_ca->search_batch) {
+        s_op = "batch search";
+
+    } else if (p_plat_cfg->search == SEARCH_SIMD &&
+        (!p_ca->lookup_simd || !p_ca->simd_lanes)) {
+        s_op = "SIMD search";
+
+    } else if (p_plat_cfg->s_save_file && !p_ca->save) {
+        s_op = "saving";
+
+    } else if (p_plat_cfg->s_load_file && !p_ca->load) {
+        s_op = "loading";
+
+    } else if (p_plat_cfg->update_pct && (!p_ca->insert || !p_ca->delete)) {
+        s_op = "updates";
+    }
+
+    if (s_op) {
+        fprintf(stderr, "Algorithm %s does not support %s\n", p_ca->name,
+                s_op);
+        return 0;
+    }
+
+    /* -n still splits the search, which every algorithm can share */
+    if (p_plat_cfg->thread_num > 1 && !(p_ca->opts & CLSFY_OPT_THREAD)) {
+        fprintf(stderr, "Algorithm %s builds with 1 thread, searches with "
+                "%d\n", p_ca->name, p_plat_cfg->thread_num);
+    }
+
+    return 1;
+}
+
 static uint64_t f_make_timediff(const struct timespec stop,
         const struct timespec start)
 {
@@ -344,78 +929,549 @@ static uint64_t f_make_timediff(const struct timespec stop,
         - (start.tv_sec * 1000000ULL + start.tv_nsec / 1000);
 }
 
-static int f_build(int pc_algo, void *built_result,
-        const struct partition *p_pa)
+static int f_generate(const struct platform_config *p_plat_cfg)
 {
-    assert(pc_algo > PC_ALGO_INV && pc_algo < PC_ALGO_MAX);
+    int ret, pkt_num;
+    char *s_trace_file;
+    struct timespec starttime, stoptime;
+    struct gen_profile gp;
+    struct rule_set rs;
+    struct trace t;
+
+    assert(p_plat_cfg && p_plat_cfg->s_gen_file);
+
+    /* the rules given are the seed of the profile */
+    if (p_plat_cfg->s_rule_file) {
+        if (load_rules(&rs, p_plat_cfg->s_rule_file)) {
+            return -EINVAL;
+        }
+
+        ret = gen_profile_learn(&gp, &rs);
+        unload_rules(&rs);
+
+    } else {
+        ret = gen_profile_init(&gp, p_plat_cfg->gen_profile);
+    }
+
+    if (ret) {
+        return ret;
+    }
+
+    pkt_num = p_plat_cfg->gen_pkt_num;
+    if (!pkt_num) {
+        pkt_num = MIN((int64_t)p_plat_cfg->gen_rule_num * GEN_TRACE_SCALE,
+                (int64_t)INT_MAX);
+    }
+
+    if (asprintf(&s_trace_file, "%s_trace", p_plat_cfg->s_gen_file) == -1) {
+        return -ENOMEM;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &starttime);
+
+    ret = gen_rules(&rs, &gp, p_plat_cfg->gen_rule_num, p_plat_cfg->gen_seed);
+    if (ret) {
+        free(s_trace_file);
+        return ret;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stoptime);
+    fprintf(stderr, "Time for generating rules: %"PRIu64"(us)\n",
+            f_make_timediff(stoptime, starttime));
+
+    clock_gettime(CLOCK_MONOTONIC, &starttime);
+
+    ret = gen_trace(&t, &rs, pkt_num, p_plat_cfg->gen_seed);
+    if (ret) {
+        unload_rules(&rs);
+        free(s_trace_file);
+        return ret;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stoptime);
+    fprintf(stderr, "Time for generating trace: %"PRIu64"(us)\n",
+            f_make_timediff(stoptime, starttime));
+
+    ret = dump_rules(p_plat_cfg->s_gen_file, &rs);
+    if (!ret) {
+        ret = print_trace(s_trace_file, &t);
+    }
+
+    unload_trace(&t);
+    unload_rules(&rs);
+    free(s_trace_file);
+
+    return ret;
+}
+
+static int f_build(const struct platform_config *p_plat_cfg,
+        void *built_result, const struct partition *p_pa)
+{
+    struct clsfy_param param;
+
+    assert(p_plat_cfg && p_plat_cfg->p_ca);
     assert(built_result && p_pa && p_pa->subsets && p_pa->rule_num > 1);
-    assert(p_pa->subset_num > 0 && p_pa->subset_num <= PART_MAX);
+    assert(p_pa->subset_num > 0);
 
-    switch (pc_algo) {
-    case PC_ALGO_HYPERSPLIT:
-        return hs_build(built_result, p_pa);
+    param.thread_num = p_plat_cfg->thread_num;
+    param.binth = p_plat_cfg->binth;
+    param.is_dag = p_plat_cfg->is_dag;
+    param.is_packed = p_plat_cfg->is_packed;
+    param.is_simd = p_plat_cfg->search == SEARCH_SIMD;
+
+    return p_plat_cfg->p_ca->build(built_result, p_pa, &param);
+}
 
-    default:
-        *(typeof(built_result) *)built_result = NULL;
-        return -ENOTSUP;
+static int f_save(const struct clsfy_algo *p_ca, const void *built_result,
+        const char *s_file)
+{
+    assert(p_ca && p_ca->save);
+    assert(built_result && s_file);
+
+    return p_ca->save(built_result, s_file);
+}
+
+static int f_load(const struct clsfy_algo *p_ca, void *built_result,
+        const char *s_file)
+{
+    assert(p_ca && p_ca->load);
+    assert(built_result && s_file);
+
+    return p_ca->load(built_result, s_file);
+}
+
+/*
+ * Delete update_pct percent of the rules, spread evenly over all of them,
+ * then insert them again. The default rule is in no table, so it stays.
+ */
+static int f_update(const struct platform_config *p_plat_cfg,
+        void *built_result, const struct partition *p_pa,
+        uint64_t *p_update_num)
+{
+    int i, j, ret, is_insert;
+    long k;
+    const struct clsfy_algo *p_ca = p_plat_cfg->p_ca;
+    const struct rule_set *p_rs;
+
+    assert(p_ca && p_ca->insert && p_ca->delete);
+    assert(built_result && p_pa && p_update_num);
+
+    for (is_insert = 0; is_insert <= 1; is_insert++) {
+        for (k = i = 0; i < p_pa->subset_num; i++) {
+            p_rs = &p_pa->subsets[i];
+            for (j = 0; j < p_rs->rule_num; j++) {
+                if (p_rs->rules[j].pri == p_rs->def_rule ||
+                    k++ * p_plat_cfg->update_pct % 100 >=
+                    p_plat_cfg->update_pct) {
+                    continue;
+                }
+
+                ret = is_insert ? p_ca->insert(built_result, &p_rs->rules[j]) :
+                    p_ca->delete(built_result, &p_rs->rules[j]);
+                if (ret) {
+                    fprintf(stderr, "Cannot %s rule %d\n",
+                            is_insert ? "insert" : "delete",
+                            p_rs->rules[j].pri);
+                    return ret;
+                }
+
+                (*p_update_num)++;
+            }
+        }
     }
+
+    return 0;
 }
 
-static int f_group(int grp_algo, struct partition *p_pa_grp,
+static int f_group(const struct grp_algo *p_ga, struct partition *p_pa_grp,
         const struct partition *p_pa)
 {
-    assert(grp_algo > GRP_ALGO_INV && grp_algo < GRP_ALGO_MAX);
+    assert(p_ga);
     assert(p_pa_grp && p_pa && p_pa->subsets && p_pa->rule_num > 1);
-    assert(p_pa->subset_num > 0 && p_pa->subset_num <= PART_MAX);
-
-    switch (grp_algo) {
-    case GRP_ALGO_RFG:
-        return rf_group(p_pa_grp, p_pa);
+    assert(p_pa->subset_num > 0);
 
-    default:
-        return -ENOTSUP;
-    }
+    return p_ga->group(p_pa_grp, p_pa);
 }
 
-static int f_search(int pc_algo, const struct trace *p_t,
-        const void *built_result)
+static int f_search(const struct clsfy_algo *p_ca, int search,
+        const struct trace *p_t, const void *built_result,
+        struct flow_cache *p_fc)
 {
-    assert(pc_algo > PC_ALGO_INV && pc_algo < PC_ALGO_MAX);
+    assert(p_ca);
     assert(p_t && p_t->pkts && built_result);
 
     if (*(typeof(built_result) *)built_result == NULL) {
         return -EINVAL;
     }
 
-    switch (pc_algo) {
-    case PC_ALGO_HYPERSPLIT:
-        return hs_search(p_t, built_result);
+    /* f_check_algo has made sure the algorithm has the one asked for */
+    if (p_fc) {
+        return p_ca->search_cache(p_t, built_result, p_fc,
+                search == SEARCH_BATCH);
+
+    } else if (search == SEARCH_BATCH) {
+        return p_ca->search_batch(p_t, built_result);
 
-    default:
-        return -ENOTSUP;
+    } else if (search == SEARCH_SIMD) {
+        return clsfy_search(p_ca->lookup_simd, p_t, built_result);
     }
+
+    return clsfy_search(p_ca->lookup, p_t, built_result);
 }
 
-static void f_destroy(int pc_algo, void *built_result)
+static void f_destroy(const struct clsfy_algo *p_ca, void *built_result)
 {
-    assert(pc_algo > PC_ALGO_INV && pc_algo < PC_ALGO_MAX);
+    assert(p_ca);
     assert(built_result);
 
     if (*(typeof(built_result) *)built_result == NULL) {
         return;
     }
 
-    switch (pc_algo) {
-    case PC_ALGO_HYPERSPLIT:
-        hs_destroy(built_result);
-        break;
+    p_ca->destroy(built_result);
+    *(typeof(built_result) *)built_result = NULL;
 
-    default:
-        break;
+    return;
+}
+
+static int f_search_mt(const struct platform_config *p_plat_cfg,
+        const struct trace *p_t, const void *built_result)
+{
+    int i, ret = 0, cpu_num, pkt_cur, thread_num;
+    uint64_t hit_num = 0, miss_num = 0, evict_num = 0;
+    struct search_worker *workers;
+    pthread_barrier_t barrier;
+
+    assert(p_plat_cfg && p_t && p_t->pkts && built_result);
+
+    thread_num = p_plat_cfg->thread_num;
+    if (thread_num > p_t->pkt_num) {
+        thread_num = p_t->pkt_num;
     }
 
-    *(typeof(built_result) *)built_result = NULL;
+    cpu_num = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_num < 1) {
+        cpu_num = 1;
+    }
+
+    if (thread_num > cpu_num) {
+        fprintf(stderr, "Warning: %d threads share %d cores\n",
+                thread_num, cpu_num);
+    }
+
+    workers = calloc(thread_num, sizeof(*workers));
+    if (!workers) {
+        return -ENOMEM;
+    }
+
+    /* the built result is read only, so only the trace is sharded */
+    pthread_barrier_init(&barrier, NULL, thread_num);
+
+    for (pkt_cur = i = 0; i < thread_num; i++) {
+        int pkt_num = p_t->pkt_num / thread_num +
+            (i < p_t->pkt_num % thread_num);
+        pthread_attr_t attr;
+        cpu_set_t cpus;
+
+        workers[i].p_barrier = &barrier;
+        workers[i].p_plat_cfg = p_plat_cfg;
+        workers[i].built_result = built_result;
+        workers[i].t.pkts = p_t->pkts + pkt_cur;
+        workers[i].t.pkt_num = pkt_num;
+        workers[i].cpu = i % cpu_num;
+        pkt_cur += pkt_num;
+
+        if (p_plat_cfg->cache_size && flow_cache_init(&workers[i].fc,
+            p_plat_cfg->cache_size, p_plat_cfg->cache_evict)) {
+            exit(-1);
+        }
+
+        CPU_ZERO(&cpus);
+        CPU_SET(workers[i].cpu, &cpus);
+        pthread_attr_init(&attr);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+
+        ret = pthread_create(&workers[i].tid, &attr, f_search_worker,
+                &workers[i]);
+        pthread_attr_destroy(&attr);
+        if (ret) {
+            fprintf(stderr, "Cannot create thread %d: %s\n", i, strerror(ret));
+            exit(-1);
+        }
+    }
+
+    for (i = 0; i < thread_num; i++) {
+        pthread_join(workers[i].tid, NULL);
+        if (workers[i].ret) {
+            ret = workers[i].ret;
+        }
+    }
+
+    for (i = 0; !ret && i < thread_num; i++) {
+        fprintf(stderr, "Thread %d on cpu %d: %d packets in %"PRIu64"(us), "
+                "%lld(pps)\n", i, workers[i].cpu, workers[i].t.pkt_num,
+                workers[i].timediff, (workers[i].t.pkt_num * 1000000ULL) /
+                (workers[i].timediff ? workers[i].timediff : 1));
+    }
+
+    for (i = 0; p_plat_cfg->cache_size && i < thread_num; i++) {
+        hit_num += workers[i].fc.hit_num;
+        miss_num += workers[i].fc.miss_num;
+        evict_num += workers[i].fc.evict_num;
+        flow_cache_term(&workers[i].fc);
+    }
+
+    if (!ret && p_plat_cfg->cache_size) {
+        f_print_cache(hit_num, miss_num, evict_num);
+    }
+
+    pthread_barrier_destroy(&barrier);
+    free(workers);
+
+    return ret;
+}
+
+static void *f_search_worker(void *arg)
+{
+    struct timespec starttime, stoptime;
+    struct search_worker *p_worker = arg;
+    const struct platform_config *p_plat_cfg = p_worker->p_plat_cfg;
+
+    /* all threads start searching at the same time */
+    pthread_barrier_wait(p_worker->p_barrier);
+
+    clock_gettime(CLOCK_MONOTONIC, &starttime);
+
+    p_worker->ret = f_search(p_plat_cfg->p_ca, p_plat_cfg->search,
+            &p_worker->t, p_worker->built_result,
+            p_plat_cfg->cache_size ? &p_worker->fc : NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &stoptime);
+    p_worker->timediff = f_make_timediff(stoptime, starttime);
+
+    return NULL;
+}
+
+static void f_print_cache(uint64_t hit_num, uint64_t miss_num,
+        uint64_t evict_num)
+{
+    uint64_t lookup_num = hit_num + miss_num;
+
+    fprintf(stderr, "Flow cache: %"PRIu64" hits, %"PRIu64" misses, "
+            "%"PRIu64" evictions, hit rate %.2f%%\n", hit_num, miss_num,
+            evict_num, lookup_num ? hit_num * 100.0 / lookup_num : 0.0);
 
     return;
 }
 
+static int f_search_stream(const struct platform_config *p_plat_cfg,
+        uint64_t *p_pkt_num, const void *built_result,
+        const struct partition *p_pa)
+{
+    int i, n, ret = 0, cpu_num, thread_num;
+    struct timespec starttime, stoptime;
+    uint64_t timediff = 0, pkt_num = 0;
+    uint64_t hit_num = 0, miss_num = 0, evict_num = 0;
+    struct stream_worker *workers;
+    struct search_stream stream;
+    struct trace_stream ts;
+    struct packet *pkts;
+    struct trace chunk;
+
+    assert(p_plat_cfg && p_pkt_num && built_result);
+
+    thread_num = p_plat_cfg->thread_num;
+    cpu_num = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_num < 1) {
+        cpu_num = 1;
+    }
+
+    if (thread_num >= cpu_num) {
+        fprintf(stderr, "Warning: %d threads and the reader share %d cores\n",
+                thread_num, cpu_num);
+    }
+
+    if (open_trace(&ts, p_plat_cfg->s_trace_file)) {
+        return -EINVAL;
+    }
+
+    pkts = malloc(STREAM_RING_SIZE * STREAM_CHUNK_SIZE * sizeof(*pkts));
+    workers = calloc(thread_num, sizeof(*workers));
+    if (!pkts || !workers) {
+        free(workers);
+        free(pkts);
+        close_trace(&ts);
+        return -ENOMEM;
+    }
+
+    pthread_mutex_init(&stream.lock, NULL);
+    pthread_cond_init(&stream.filled, NULL);
+    pthread_cond_init(&stream.drained, NULL);
+    RING_INIT(&stream.full, STREAM_RING_SIZE, stream.full_buf);
+    RING_INIT(&stream.empty, STREAM_RING_SIZE, stream.empty_buf);
+    stream.is_eof = stream.ret = 0;
+
+    for (i = 0; i < STREAM_RING_SIZE; i++) {
+        chunk.pkts = pkts + i * STREAM_CHUNK_SIZE;
+        chunk.pkt_num = 0;
+        RING_PUT(trace_ring, &stream.empty, chunk);
+    }
+
+    for (i = 0; i < thread_num; i++) {
+        pthread_attr_t attr;
+        cpu_set_t cpus;
+
+        workers[i].p_stream = &stream;
+        workers[i].p_plat_cfg = p_plat_cfg;
+        workers[i].built_result = built_result;
+        workers[i].cpu = i % cpu_num;
+
+        if (p_plat_cfg->cache_size && flow_cache_init(&workers[i].fc,
+            p_plat_cfg->cache_size, p_plat_cfg->cache_evict)) {
+            exit(-1);
+        }
+
+        CPU_ZERO(&cpus);
+        CPU_SET(workers[i].cpu, &cpus);
+        pthread_attr_init(&attr);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+
+        ret = pthread_create(&workers[i].tid, &attr, f_stream_worker,
+                &workers[i]);
+        pthread_attr_destroy(&attr);
+        if (ret) {
+            fprintf(stderr, "Cannot create thread %d: %s\n", i, strerror(ret));
+            exit(-1);
+        }
+    }
+
+    /* The calling thread parses chunks until the trace ends */
+    while (1) {
+        pthread_mutex_lock(&stream.lock);
+        while (RING_EMPTY(&stream.empty) && !stream.ret) {
+            pthread_cond_wait(&stream.drained, &stream.lock);
+        }
+
+        if (stream.ret) {
+            pthread_mutex_unlock(&stream.lock);
+            break;
+        }
+
+        RING_GET(trace_ring, &stream.empty, &chunk);
+        pthread_mutex_unlock(&stream.lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &starttime);
+        n = read_trace(&ts, chunk.pkts, STREAM_CHUNK_SIZE);
+        clock_gettime(CLOCK_MONOTONIC, &stoptime);
+        timediff += f_make_timediff(stoptime, starttime);
+
+        if (n <= 0) {
+            pthread_mutex_lock(&stream.lock);
+            stream.ret = stream.ret ? stream.ret : n;
+            pthread_mutex_unlock(&stream.lock);
+            break;
+        }
+
+        chunk.pkt_num = n;
+        if (p_pa) {
+            label_trace(&chunk, p_pa);
+        }
+        pkt_num += n;
+
+        pthread_mutex_lock(&stream.lock);
+        RING_PUT(trace_ring, &stream.full, chunk);
+        pthread_cond_signal(&stream.filled);
+        pthread_mutex_unlock(&stream.lock);
+    }
+
+    pthread_mutex_lock(&stream.lock);
+    stream.is_eof = 1;
+    pthread_cond_broadcast(&stream.filled);
+    pthread_mutex_unlock(&stream.lock);
+
+    for (i = 0; i < thread_num; i++) {
+        pthread_join(workers[i].tid, NULL);
+    }
+
+    ret = stream.ret;
+    if (!ret) {
+        fprintf(stderr, "Reader: %"PRIu64" packets parsed in %"PRIu64"(us)\n",
+                pkt_num, timediff);
+    }
+
+    for (i = 0; !ret && i < thread_num; i++) {
+        fprintf(stderr, "Thread %d on cpu %d: %"PRIu64" packets in "
+                "%"PRIu64"(us), %"PRIu64"(pps)\n", i, workers[i].cpu,
+                workers[i].pkt_num, workers[i].timediff,
+                (workers[i].pkt_num * 1000000) /
+                (workers[i].timediff ? workers[i].timediff : 1));
+    }
+
+    for (i = 0; p_plat_cfg->cache_size && i < thread_num; i++) {
+        hit_num += workers[i].fc.hit_num;
+        miss_num += workers[i].fc.miss_num;
+        evict_num += workers[i].fc.evict_num;
+        flow_cache_term(&workers[i].fc);
+    }
+
+    if (!ret && p_plat_cfg->cache_size) {
+        f_print_cache(hit_num, miss_num, evict_num);
+    }
+
+    *p_pkt_num = pkt_num;
+
+    pthread_cond_destroy(&stream.drained);
+    pthread_cond_destroy(&stream.filled);
+    pthread_mutex_destroy(&stream.lock);
+    free(workers);
+    free(pkts);
+    close_trace(&ts);
+
+    return ret;
+}
+
+static void *f_stream_worker(void *arg)
+{
+    struct timespec starttime, stoptime;
+    struct stream_worker *p_worker = arg;
+    struct search_stream *p_stream = p_worker->p_stream;
+    const struct platform_config *p_plat_cfg = p_worker->p_plat_cfg;
+    struct trace chunk;
+    int ret;
+
+    while (1) {
+        pthread_mutex_lock(&p_stream->lock);
+        while (RING_EMPTY(&p_stream->full) && !p_stream->is_eof &&
+            !p_stream->ret) {
+            pthread_cond_wait(&p_stream->filled, &p_stream->lock);
+        }
+
+        /* the reader stops on errors, so the rest is left unsearched */
+        if (RING_EMPTY(&p_stream->full) || p_stream->ret) {
+            pthread_mutex_unlock(&p_stream->lock);
+            break;
+        }
+
+        RING_GET(trace_ring, &p_stream->full, &chunk);
+        pthread_mutex_unlock(&p_stream->lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &starttime);
+        ret = f_search(p_plat_cfg->p_ca, p_plat_cfg->search, &chunk,
+                p_worker->built_result,
+                p_plat_cfg->cache_size ? &p_worker->fc : NULL);
+        clock_gettime(CLOCK_MONOTONIC, &stoptime);
+        p_worker->timediff += f_make_timediff(stoptime, starttime);
+        p_worker->pkt_num += chunk.pkt_num;
+
+        pthread_mutex_lock(&p_stream->lock);
+        RING_PUT(trace_ring, &p_stream->empty, chunk);
+        if (ret && !p_stream->ret) {
+            p_stream->ret = ret;
+        }
+
+        pthread_cond_signal(&p_stream->drained);
+        pthread_mutex_unlock(&p_stream->lock);
+    }
+
+    return NULL;
+}